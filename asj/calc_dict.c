@@ -12,279 +12,382 @@
 
 
 /**
- * @brief qsort comparator for pairs (full, abbreviation)
+ * @brief Abbreviation search strategy
+ */
+typedef enum {
+    /// Walk the trie of all abbreviations once per full form
+    CALC_DICT_ENGINE_TRIE,
+    /// Build a subsequence automaton per full form and check every abbreviation with it
+    CALC_DICT_ENGINE_AUTOMATON
+} CalcDictEngine;
+
+
+/**
+ * Relative cost of scanning one character of a full form while walking the trie
+ */
+#define TRIE_CHAR_COST 0.1
+/**
+ * Relative cost of filling one cell of a subsequence automaton
+ */
+#define AUTOMATON_CELL_COST 1.0
+/**
+ * Relative cost of checking one abbreviation with a subsequence automaton.
+ * Most checks stop after a few characters
+ */
+#define AUTOMATON_CHECK_COST 2.0
+
+
+/**
+ * @brief Distinct strings read from a table column
+ */
+typedef struct {
+    unsigned long size;
+    char** strings;
+    /// Total length of 'strings'
+    uint64 length_total;
+} StringColumn;
+
+
+/**
+ * @brief Read distinct non-NULL values of a source of one column
  *
- * Abbreviation is compared first, then full form
+ * @param skip_empty skip empty strings
+ * @param stat call whose rows read are counted
  */
-static int
-_compare_pair(const void* l, const void* r)
+static StringColumn
+_read_distinct(const ScanSource* source, const char* description, bool skip_empty, StatCall* stat)
 {
-    const char** pair_l = *(const char***)l;
-    const char** pair_r = *(const char***)r;
-    int result;
+    StringColumn result = {0, NULL, 0};
+    TextRows rows;
+    StringHashSet seen;
+
+    rows = scan_source(source, 1, SCAN_ROW_ID_NONE);
+    stat->counters.rows += rows.size;
+    elog(INFO, "Processing %lu rows of %s...", rows.size, description);
+
+    string_hashset_init(&seen, rows.size);
+    result.strings = rows.values;
+    for (unsigned long i = 0; i < rows.size; i++) {
+        char* row = rows.values[i];
+        if ((skip_empty && row[0] == '\0') || !string_hashset_insert(&seen, row)) {
+            pfree(row);
+            continue;
+        }
+        result.strings[result.size++] = row;
+        result.length_total += strlen(row);
+    }
+    string_hashset_free(&seen);
 
-    result = strcmp(pair_l[1], pair_r[1]);
-    if (result == 0)
-        result = strcmp(pair_l[0], pair_r[0]);
     return result;
 }
 
 
 /**
- * @brief Calculate abbreviation dictionary
- *
- * @note SPI must be properly initialized by caller
+ * @brief Choose the cheapest abbreviation search strategy
  *
- * @param fullOid Full forms table ID
- * @param fullCol
- * @param abbrOid Abbreviations table ID
- * @param abbrCol
+ * Trie walk visits trie nodes whose keys are subsequences of a full form,
+ * and scans the rest of the full form at every such node. The number of
+ * visited nodes is bounded by the size of the trie and by the number of
+ * short subsequences of a full form.
  *
- * @return Abbreviation dictionary with properly initialized fields
+ * Automaton is built for every full form and checks every abbreviation.
  */
-static StringPairRows
-_do_calc_dict(const Oid fullOid, const char* fullCol, const Oid abbrOid, const char* abbrCol)
+static CalcDictEngine
+_choose_engine(const StringColumn* fulls, const StringColumn* abbrs)
 {
-    char* fullTable;
-    char* abbrTable;
+    const double full_length = (double)fulls->length_total / Max(fulls->size, 1);
+    const double alphabet_size = Min(full_length, 32.0);
+    const double trie_nodes = Min((double)abbrs->length_total, full_length * full_length);
 
-    struct trie* trie;
-    char query[4096];
+    const double cost_trie = fulls->size * full_length * trie_nodes * TRIE_CHAR_COST;
+    const double cost_automaton = fulls->size * (
+        full_length * alphabet_size * AUTOMATON_CELL_COST +
+        abbrs->size * AUTOMATON_CHECK_COST
+    );
 
-    StringPairRows result = {.size = 0, .read = 0, .pairs = NULL};
+    elog(DEBUG1, "Estimated costs: trie %f, automaton %f", cost_trie, cost_automaton);
 
-    char** abbrs = NULL;
-    int abbrs_used = 0;
+    return cost_automaton < cost_trie ? CALC_DICT_ENGINE_AUTOMATON : CALC_DICT_ENGINE_TRIE;
+}
 
-    char*** pairs = NULL;
-    int pairs_used = 0;
 
+/**
+ * @brief Abbreviation dictionary under construction
+ */
+typedef struct {
+    StringPairRows result;
 
-    // Process call parameters
+    const StringColumn* fulls;
+    const StringColumn* abbrs;
+    // Offsets of 'fulls' and 'abbrs' in 'result' arena; strings are added when first used in a rule
+    Size* fulls_offsets;
+    Size* abbrs_offsets;
+} RulesBuilder;
 
-    fullTable = get_table_name_by_oid(fullOid);
-    abbrTable = get_table_name_by_oid(abbrOid);
 
+/**
+ * @brief Add a rule (full form, abbreviation) to abbreviation dictionary
+ */
+static void
+_add_rule(RulesBuilder* builder, unsigned long full_i, unsigned long abbr_i)
+{
+    if (builder->fulls_offsets[full_i] == STRING_PAIRS_NO_OFFSET) {
+        const char* full = builder->fulls->strings[full_i];
+        builder->fulls_offsets[full_i] = string_pairs_add_string(&builder->result, full, strlen(full));
+    }
+    if (builder->abbrs_offsets[abbr_i] == STRING_PAIRS_NO_OFFSET) {
+        const char* abbr = builder->abbrs->strings[abbr_i];
+        builder->abbrs_offsets[abbr_i] = string_pairs_add_string(&builder->result, abbr, strlen(abbr));
+    }
 
-    // Create trie
+    string_pairs_add(&builder->result, builder->fulls_offsets[full_i], builder->abbrs_offsets[abbr_i]);
+}
 
-    trie = trie_create();
-    if (trie == NULL)
-        elog(ERROR, "Could not create trie structure. Not enough memory?");
 
+/**
+ * @brief 'calc_dict_rule_found_callback' for parallel search
+ */
+static void
+_add_rule_callback(uint32 full_i, int32 abbr_i, void* arg)
+{
+    _add_rule((RulesBuilder*)arg, full_i, abbr_i);
+}
 
-    // Process abbreviations
 
-    sprintf(query, "SELECT %s FROM %s;", abbrCol, fullTable);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT from abbreviations table '%s' (OID %d).", fullTable, fullOid);
-    }
-    elog(INFO, "Processing %d rows of abbreviations...", SPI_processed);
+/**
+ * @brief Map trie data (pointer into 'StringColumn.strings') to abbreviation index
+ */
+static int32
+_abbr_index(const void* data, void* arg)
+{
+    return (char* const*)data - ((const StringColumn*)arg)->strings;
+}
 
-    abbrs = palloc(sizeof(*abbrs) * SPI_processed);
-    for (int i = 0; i < SPI_processed; i++) {
-        char* row = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
-        if (row == NULL) {
-            continue;
-        }
-        trie_insert(trie, row, row);
-        abbrs[abbrs_used] = row;
-        abbrs_used += 1;
+
+/**
+ * @brief Build a trie of abbreviations and flatten it
+ *
+ * @return pointer trie, if 'flat' is NULL; NULL otherwise
+ */
+static struct trie*
+_build_trie(const StringColumn* abbrs, struct flat_trie** flat)
+{
+    struct trie* trie;
+
+    trie = trie_create();
+    if (trie == NULL)
+        elog(ERROR, "Could not create trie structure. Not enough memory?");
+    // Trie data is a pointer to abbreviation in 'abbrs'
+    for (unsigned long i = 0; i < abbrs->size; i++) {
+        trie_insert(trie, abbrs->strings[i], &abbrs->strings[i]);
     }
-    if (abbrs_used == 0) {
-        elog(ERROR, "No abbreviations found in given table and column.");
+
+    if (flat == NULL) {
+        return trie;
     }
+    *flat = trie_flatten(trie, palloc(trie_flat_size(trie)), _abbr_index, (void*)abbrs);
+    trie_free(trie);
+    return NULL;
+}
 
-    SPI_freetuptable(SPI_tuptable);
 
+/**
+ * @brief Search abbreviations in full forms in this backend
+ *
+ * @param builder abbreviation dictionary to add rules to
+ */
+static void
+_search(RulesBuilder* builder)
+{
+    const StringColumn* fulls = builder->fulls;
+    const StringColumn* abbrs = builder->abbrs;
+
+    CalcDictEngine engine;
+    struct flat_trie* trie = NULL;
+    SubsequenceAutomaton automaton;
+    // Character masks of 'abbrs' and flags of abbreviations passing the mask test (automaton engine)
+    uint64* abbrs_masks = NULL;
+    bool* abbrs_candidate = NULL;
 
-    // Process full names
 
-    sprintf(query, "SELECT %s FROM %s;", fullCol, abbrTable);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT from full forms table '%s' (OID %d).", abbrTable, abbrOid);
+    // Prepare search engine
+
+    engine = _choose_engine(fulls, abbrs);
+    if (engine == CALC_DICT_ENGINE_TRIE) {
+        elog(INFO, "Searching abbreviations with a trie...");
+        _build_trie(abbrs, &trie);
+    }
+    else {
+        elog(INFO, "Searching abbreviations with subsequence automata...");
+        subseq_automaton_init(&automaton);
+        abbrs_masks = palloc(sizeof(*abbrs_masks) * abbrs->size);
+        abbrs_candidate = palloc(sizeof(*abbrs_candidate) * abbrs->size);
+        for (unsigned long i = 0; i < abbrs->size; i++) {
+            abbrs_masks[i] = string_char_mask(abbrs->strings[i], strlen(abbrs->strings[i]));
+        }
     }
-    elog(INFO, "Processing %d rows of full forms...", SPI_processed);
 
-    for (int i = 0; i < SPI_processed; i++) {
-        char* row = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
 
-        char** subsequences = NULL;
-        int subsequences_found;
+    // Search abbreviations in every full form
 
-        if (row == NULL) {
-            continue;
+    for (unsigned long i = 0; i < fulls->size; i++) {
+        const char* row = fulls->strings[i];
+        const size_t row_length = strlen(row);
+        unsigned long found_size = 0;
+
+        if (engine == CALC_DICT_ENGINE_TRIE) {
+            int32* found = NULL;
+            found_size = flat_trie_search_subsequences(trie, row, row_length, &found);
+            for (unsigned long s = 0; s < found_size; s++) {
+                _add_rule(builder, i, found[s]);
+            }
+            if (found != NULL) {
+                pfree(found);
+            }
         }
+        else {
+            const uint64 row_mask = string_char_mask(row, row_length);
+            bool automaton_built = false;
 
-        subsequences_found = trie_search_subsequences(trie, row, &subsequences);
-        elog(DEBUG1, "Found %d abbreviations for row '%s'", subsequences_found, row);
-        if (subsequences_found != 0) {
-            pairs = pairs == NULL ?
-                palloc(subsequences_found * sizeof(*pairs)) :
-                repalloc(pairs, (pairs_used + subsequences_found) * sizeof(*pairs));
-            for (int s = 0; s < subsequences_found; s++) {
-                char** current_pair = palloc(sizeof(*current_pair) * 2);
-                current_pair[0] = palloc(strlen(row) + 1);
-                strcpy(current_pair[0], row);
-                current_pair[1] = palloc(strlen(subsequences[s]) + 1);
-                strcpy(current_pair[1], subsequences[s]);
-                pfree(subsequences[s]);
-
-                pairs[pairs_used] = current_pair;
-                pairs_used += 1;
+            // Branch-free loop, so that the compiler can vectorize it
+            for (unsigned long a = 0; a < abbrs->size; a++) {
+                abbrs_candidate[a] = char_mask_is_subset(abbrs_masks[a], row_mask);
+            }
+            for (unsigned long a = 0; a < abbrs->size; a++) {
+                if (!abbrs_candidate[a]) {
+                    continue;
+                }
+                if (!automaton_built) {
+                    subseq_automaton_build(&automaton, row, row_length);
+                    automaton_built = true;
+                }
+                if (subseq_automaton_match(&automaton, abbrs->strings[a])) {
+                    _add_rule(builder, i, a);
+                    found_size += 1;
+                }
             }
-            pfree(subsequences);
         }
 
-        pfree(row);
+        elog(DEBUG1, "Found %lu abbreviations for row '%s'", found_size, row);
     }
 
-    SPI_freetuptable(SPI_tuptable);
-
-    if (pairs_used == 0) {
-        elog(WARNING, "No abbreviation rules found");
-        return result;
+    if (trie != NULL) {
+        pfree(trie);
+    }
+    else {
+        subseq_automaton_free(&automaton);
     }
-
-
-    // Return result
-
-    result.pairs = pairs;
-    result.size = pairs_used;
-
-    trie_free(trie);
-
-    elog(DEBUG1, "%ld abbreviations in total", result.size);
-
-    return result;
 }
 
 
 /**
- * @brief Remove repeating pairs (full, abbreviation)
- * from StringPairRows in place
+ * @brief Calculate abbreviation dictionary
+ *
+ * Every rule is produced once: full forms and abbreviations are deduplicated
+ * before search, and all engines report every abbreviation at most once
+ * per full form. Strings are added to the result arena once, and rules refer
+ * to them by offsets.
+ *
+ * @param fullSource source of full forms
+ * @param abbrSource source of abbreviations; if it is the same as 'fullSource', it is read once
+ * @param workers number of background workers to use; 0 to search in this backend
+ * @param stat call whose rows read are counted
  *
- * @param dict
+ * @return Abbreviation dictionary with properly initialized fields
  */
-static void
-_remove_duplicate_pairs(StringPairRows* dict)
+static StringPairRows
+_do_calc_dict(const ScanSource* fullSource, const ScanSource* abbrSource, int workers, StatCall* stat)
 {
-    bool* pairs_to_stay;
-    int pairs_to_stay_count = 1;  // At least 1 pair exists, 0 case is eliminated
+    StringColumn abbrs;
+    StringColumn fulls;
+    RulesBuilder builder;
+
 
-    if (dict->pairs == NULL || dict->size == 0) {
-        return;
+    // Read abbreviations and full forms
+
+    // An empty abbreviation is a subsequence of every full form; it is not a rule
+    abbrs = _read_distinct(abbrSource, "abbreviations", true, stat);
+    if (abbrs.size == 0) {
+        elog(ERROR, "No abbreviations found in given table and column.");
+    }
+    fulls = scan_source_equal(fullSource, abbrSource, 1) ? abbrs : _read_distinct(fullSource, "full forms", false, stat);
+
+    builder.fulls = &fulls;
+    builder.abbrs = &abbrs;
+    builder.fulls_offsets = palloc(sizeof(*builder.fulls_offsets) * Max(fulls.size, 1));
+    builder.abbrs_offsets = palloc(sizeof(*builder.abbrs_offsets) * abbrs.size);
+    for (unsigned long i = 0; i < fulls.size; i++) {
+        builder.fulls_offsets[i] = STRING_PAIRS_NO_OFFSET;
+    }
+    for (unsigned long i = 0; i < abbrs.size; i++) {
+        builder.abbrs_offsets[i] = STRING_PAIRS_NO_OFFSET;
     }
+    string_pairs_init(&builder.result);
 
-    elog(DEBUG1, "Removing duplicates...");
 
-    pg_qsort((void*)dict->pairs, dict->size, sizeof(*dict->pairs), _compare_pair);
+    // Search in background workers, if asked to
 
-    pairs_to_stay = palloc(sizeof(*pairs_to_stay) * dict->size);
-    pairs_to_stay[0] = true;
-    for (int i = 1; i < dict->size; i++) {
+    if (workers > 0) {
+        struct trie* pointer_trie = _build_trie(&abbrs, NULL);
+        bool searched;
 
-        if (_compare_pair(&dict->pairs[i - 1], &dict->pairs[i]) == 0) {
-            pairs_to_stay[i] = false;
-        }
-        else {
-            pairs_to_stay[i] = true;
-            pairs_to_stay_count += 1;
+        elog(INFO, "Searching abbreviations with a trie in background workers...");
+        searched = calc_dict_parallel_search(
+            pointer_trie, _abbr_index, &abbrs,
+            fulls.strings, fulls.size,
+            workers,
+            _add_rule_callback, &builder
+        );
+        trie_free(pointer_trie);
+        if (!searched) {
+            _search(&builder);
         }
     }
+    else {
+        _search(&builder);
+    }
 
-    if (pairs_to_stay_count != dict->size) {
-        char*** pairs_duplicate;
-        int pairs_duplicate_used = 0;
+    if (builder.result.size == 0) {
+        elog(WARNING, "No abbreviation rules found");
+        return builder.result;
+    }
 
-        pairs_duplicate = palloc(sizeof(*pairs_duplicate) * pairs_to_stay_count);
-        for (int i = 0; i < dict->size; i++) {
-            if (pairs_to_stay[i]) {
-                pairs_duplicate[pairs_duplicate_used] = dict->pairs[i];
-                pairs_duplicate_used += 1;
-            }
-            else {
-                pfree(dict->pairs[i][0]);
-                pfree(dict->pairs[i][1]);
-                pfree(dict->pairs[i]);
-            }
-        }
+    elog(DEBUG1, "%ld abbreviations in total", builder.result.size);
 
-        pfree(dict->pairs);
-        dict->pairs = pairs_duplicate;
-        dict->size = pairs_to_stay_count;
-    }
+    return builder.result;
 }
 
 
 Datum
 calc_dict(PG_FUNCTION_ARGS)
 {
-    MemoryContext oldcontext;
+    // Function call parameters
+    ScanSource fullSource;
+    ScanSource abbrSource;
+    int arg;
+    int workers;
 
-    FuncCallContext *funcctx;
-    TupleDesc tupdesc;
-    Datum result;
-    StringPairRows* dict;
-
-    if (SRF_IS_FIRSTCALL())
-    {
-        // Function call parameters
-        Oid fullOid;
-        Oid abbrOid;
-        char* fullCol;
-        char* abbrCol;
-
-        StringPairRows calculated;
-
-        // Initialize funcctx
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
-            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function returning record called in context that cannot accept type record")));
-        }
-        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
-        funcctx->user_fctx = palloc(sizeof(StringPairRows));
-
-        // Load function call parameters
-        fullOid = PG_GETARG_OID(0);
-        abbrOid = PG_GETARG_OID(2);
-        fullCol = get_text_parameter(PG_GETARG_TEXT_P(1));
-        abbrCol = get_text_parameter(PG_GETARG_TEXT_P(3));
-
-        // Calculate abbreviation dictionary
-        SPI_connect();
-        calculated = _do_calc_dict(fullOid, fullCol, abbrOid, abbrCol);
-        SPI_finish();
-        Assert(calculated.pairs != NULL);
-        _remove_duplicate_pairs(&calculated);
-
-        // Copy abbreviation dictionary into new memory context
-        dict = funcctx->user_fctx;
-        dict->size = calculated.size;
-        dict->read = 0;
-        dict->pairs = palloc(sizeof(*dict->pairs) * calculated.size);
-        for (int i = 0; i < calculated.size; i++) {
-            dict->pairs[i] = palloc(sizeof(*dict->pairs[i]) * 2);
-            for (int j = 0; j < 2; j++) {
-                dict->pairs[i][j] = palloc(strlen(calculated.pairs[i][j]) + 1);
-                strcpy(dict->pairs[i][j], calculated.pairs[i][j]);
-            }
-        }
-
-        MemoryContextSwitchTo(oldcontext);
-    }
+    MemoryContext workcontext;
+    MemoryContext oldcontext;
+    StringPairRows dict;
+    StatCall stat;
 
-    funcctx = SRF_PERCALL_SETUP();
+    stat_call_start(&stat);
 
-    dict = funcctx->user_fctx;
+    // Load function call parameters
+    arg = scan_source_from_args(fcinfo, 0, false, &fullSource);
+    arg = scan_source_from_args(fcinfo, arg, false, &abbrSource);
+    workers = PG_NARGS() > arg ? PG_GETARG_INT32(arg) : 0;
 
-    if (dict->read >= dict->size) {
-        SRF_RETURN_DONE(funcctx);
-    }
+    // Calculate abbreviation dictionary and return it. Temporary data is released afterwards
+    workcontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj calc_dict", ALLOCSET_DEFAULT_SIZES);
+    oldcontext = MemoryContextSwitchTo(workcontext);
+    dict = _do_calc_dict(&fullSource, &abbrSource, workers, &stat);
+    MemoryContextSwitchTo(oldcontext);
+    string_pairs_materialize(fcinfo, &dict);
+    MemoryContextDelete(workcontext);
 
-    result = HeapTupleGetDatum(BuildTupleFromCStrings(funcctx->attinmeta, dict->pairs[dict->read]));
-    dict->read += 1;
+    stat_call_finish(&stat, STAT_CALC_DICT);
 
-    SRF_RETURN_NEXT(funcctx, result);
+    return (Datum)0;
 }
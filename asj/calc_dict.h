@@ -17,10 +17,18 @@
 #include "executor/spi.h"
 #include "utils/builtins.h"
 #include "funcapi.h"
+#include "utils/memutils.h"
 
+#include "lib/charmask.h"
 #include "lib/common.h"
+#include "lib/hashset.h"
+#include "lib/scan.h"
+#include "lib/stat.h"
+#include "lib/subseq.h"
 #include "lib/trie.h"
 
+#include "calc_dict_parallel.h"
+
 
 /**
  * @brief Calculate abbreviation dictionary from two columns in PostgreSQL
@@ -29,6 +37,10 @@
  * @param 1: column of full names table
  * @param 2: OID of abbreviations table
  * @param 3: column of abbreviations table
+ * @param 4: number of background workers to use (optional)
+ *
+ * Either table is replaced by a single query or cursor argument in other overloads;
+ * see 'scan_source_from_args'.
  *
  * Returns table (see SQL definition)
  */
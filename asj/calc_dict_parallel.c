@@ -0,0 +1,335 @@
+/*
+ * calc_dict_parallel.c
+ *      Parallel abbreviation search for abbreviation dictionary calculation,
+ *      part of Tao-Deng-Stonebraker algorithm for
+ *      approximate string JOINs with abbreviations
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/asj/calc_dict_parallel.c
+ */
+
+#include "calc_dict_parallel.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+
+/**
+ * Magic number of shared memory table of contents
+ */
+#define CALC_DICT_PARALLEL_MAGIC 0x41534A44
+
+/*
+ * Keys of shared memory table of contents
+ */
+#define CALC_DICT_KEY_SHARED 1
+#define CALC_DICT_KEY_TRIE 2
+#define CALC_DICT_KEY_OFFSETS 3
+#define CALC_DICT_KEY_STRINGS 4
+#define CALC_DICT_KEY_QUEUES 5
+
+/**
+ * Size of a message queue of every worker
+ */
+#define CALC_DICT_QUEUE_SIZE (64 * 1024)
+/**
+ * Number of rules sent by a worker in one message
+ */
+#define CALC_DICT_BATCH_SIZE 1024
+
+
+/**
+ * @brief State shared by leader and workers
+ */
+typedef struct {
+    /// Index of next chunk of full forms to process
+    pg_atomic_uint32 next_chunk;
+    /// Number of full forms in a chunk
+    uint32 chunk_size;
+    /// Number of full forms
+    uint32 nfulls;
+    /// Number of workers which have processed all chunks they took
+    pg_atomic_uint32 workers_finished;
+} CalcDictParallelShared;
+
+
+/**
+ * @brief A rule found by a worker
+ */
+typedef struct {
+    uint32 full_i;
+    int32 abbr_i;
+} CalcDictParallelRule;
+
+
+bool
+calc_dict_parallel_search(
+    const struct trie* trie, int32 (*data_index)(const void* data, void* arg), void* data_index_arg,
+    char** fulls, unsigned long nfulls,
+    int nworkers,
+    calc_dict_rule_found_callback rule_found, void* rule_found_arg
+)
+{
+    shm_toc_estimator estimator;
+    Size segment_size;
+    const Size trie_size = trie_flat_size(trie);
+    Size strings_size = 0;
+
+    dsm_segment* segment;
+    shm_toc* toc;
+    CalcDictParallelShared* shared;
+    struct flat_trie* flat_trie;
+    uint64* offsets;
+    char* strings;
+    char* queues;
+
+    BackgroundWorkerHandle** workers;
+    shm_mq_handle** queue_handles;
+    int nlaunched = 0;
+    int nactive;
+
+    if (nfulls > PG_UINT32_MAX) {
+        elog(ERROR, "Too many full forms for parallel search: %lu", nfulls);
+    }
+    for (unsigned long i = 0; i < nfulls; i++) {
+        strings_size += strlen(fulls[i]);
+    }
+
+
+    // Create shared memory segment
+
+    shm_toc_initialize_estimator(&estimator);
+    shm_toc_estimate_chunk(&estimator, sizeof(CalcDictParallelShared));
+    shm_toc_estimate_chunk(&estimator, trie_size);
+    shm_toc_estimate_chunk(&estimator, sizeof(*offsets) * (nfulls + 1));
+    shm_toc_estimate_chunk(&estimator, Max(strings_size, 1));
+    shm_toc_estimate_chunk(&estimator, (Size)CALC_DICT_QUEUE_SIZE * nworkers);
+    shm_toc_estimate_keys(&estimator, 5);
+    segment_size = shm_toc_estimate(&estimator);
+
+    segment = dsm_create(segment_size, 0);
+    toc = shm_toc_create(CALC_DICT_PARALLEL_MAGIC, dsm_segment_address(segment), segment_size);
+
+    shared = shm_toc_allocate(toc, sizeof(CalcDictParallelShared));
+    pg_atomic_init_u32(&shared->next_chunk, 0);
+    pg_atomic_init_u32(&shared->workers_finished, 0);
+    shared->nfulls = nfulls;
+    shared->chunk_size = Max(1, Min(1024, nfulls / ((unsigned long)nworkers * 16)));
+    shm_toc_insert(toc, CALC_DICT_KEY_SHARED, shared);
+
+    flat_trie = trie_flatten(trie, shm_toc_allocate(toc, trie_size), data_index, data_index_arg);
+    shm_toc_insert(toc, CALC_DICT_KEY_TRIE, flat_trie);
+
+    // Full forms are stored without terminating '\0'; offsets[i + 1] - offsets[i] is the length of i-th
+    offsets = shm_toc_allocate(toc, sizeof(*offsets) * (nfulls + 1));
+    strings = shm_toc_allocate(toc, Max(strings_size, 1));
+    offsets[0] = 0;
+    for (unsigned long i = 0; i < nfulls; i++) {
+        const size_t length = strlen(fulls[i]);
+        memcpy(strings + offsets[i], fulls[i], length);
+        offsets[i + 1] = offsets[i] + length;
+    }
+    shm_toc_insert(toc, CALC_DICT_KEY_OFFSETS, offsets);
+    shm_toc_insert(toc, CALC_DICT_KEY_STRINGS, strings);
+
+    queues = shm_toc_allocate(toc, (Size)CALC_DICT_QUEUE_SIZE * nworkers);
+    shm_toc_insert(toc, CALC_DICT_KEY_QUEUES, queues);
+
+
+    // Launch workers
+
+    workers = palloc0(sizeof(*workers) * nworkers);
+    queue_handles = palloc0(sizeof(*queue_handles) * nworkers);
+    for (int i = 0; i < nworkers; i++) {
+        BackgroundWorker worker;
+        shm_mq* queue;
+
+        queue = shm_mq_create(queues + (Size)CALC_DICT_QUEUE_SIZE * i, CALC_DICT_QUEUE_SIZE);
+        shm_mq_set_receiver(queue, MyProc);
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "mipt-asj");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "calc_dict_worker_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "mipt-asj calc_dict worker %d", i);
+        snprintf(worker.bgw_type, BGW_MAXLEN, "mipt-asj calc_dict worker");
+        worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(segment));
+        memcpy(worker.bgw_extra, &i, sizeof(i));
+        worker.bgw_notify_pid = MyProcPid;
+
+        if (!RegisterDynamicBackgroundWorker(&worker, &workers[i])) {
+            break;
+        }
+        queue_handles[i] = shm_mq_attach(queue, segment, workers[i]);
+        nlaunched += 1;
+    }
+
+    if (nlaunched == 0) {
+        elog(WARNING, "Could not launch background workers; consider increasing max_worker_processes");
+        dsm_detach(segment);
+        return false;
+    }
+    elog(INFO, "Launched %d background workers", nlaunched);
+
+
+    // Receive rules until all workers detach from their queues
+
+    nactive = nlaunched;
+    while (nactive > 0) {
+        bool progress = false;
+
+        for (int i = 0; i < nlaunched; i++) {
+            shm_mq_result received;
+            Size nbytes;
+            void* data;
+
+            if (queue_handles[i] == NULL) {
+                continue;
+            }
+
+            received = shm_mq_receive(queue_handles[i], &nbytes, &data, true);
+            if (received == SHM_MQ_SUCCESS) {
+                const CalcDictParallelRule* rules = data;
+                for (Size r = 0; r < nbytes / sizeof(*rules); r++) {
+                    rule_found(rules[r].full_i, rules[r].abbr_i, rule_found_arg);
+                }
+                progress = true;
+            }
+            else if (received == SHM_MQ_DETACHED) {
+                shm_mq_detach(queue_handles[i]);
+                queue_handles[i] = NULL;
+                nactive -= 1;
+                progress = true;
+            }
+        }
+
+        if (!progress) {
+            (void)WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, 0, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    if (pg_atomic_read_u32(&shared->workers_finished) != nlaunched) {
+        ereport(ERROR, (errmsg("A background worker exited before finishing abbreviation search")));
+    }
+
+    dsm_detach(segment);
+    return true;
+}
+
+
+/**
+ * @brief Send a batch of rules to the leader
+ */
+static void
+_send_rules(shm_mq_handle* queue_handle, const CalcDictParallelRule* rules, int size)
+{
+    shm_mq_result result;
+
+    if (size == 0) {
+        return;
+    }
+#if PG_VERSION_NUM >= 150000
+    result = shm_mq_send(queue_handle, sizeof(*rules) * size, rules, false, true);
+#else
+    result = shm_mq_send(queue_handle, sizeof(*rules) * size, rules, false);
+#endif
+    if (result != SHM_MQ_SUCCESS) {
+        // Leader is gone; nobody needs the results
+        proc_exit(1);
+    }
+}
+
+
+void
+calc_dict_worker_main(Datum main_arg)
+{
+    dsm_segment* segment;
+    shm_toc* toc;
+    CalcDictParallelShared* shared;
+    const struct flat_trie* trie;
+    const uint64* offsets;
+    const char* strings;
+    char* queues;
+    int worker_i;
+    shm_mq* queue;
+    shm_mq_handle* queue_handle;
+
+    MemoryContext chunk_context;
+    CalcDictParallelRule batch[CALC_DICT_BATCH_SIZE];
+    int batch_used = 0;
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "mipt-asj calc_dict worker");
+    segment = dsm_attach(DatumGetUInt32(main_arg));
+    if (segment == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE), errmsg("Could not map dynamic shared memory segment")));
+    }
+    toc = shm_toc_attach(CALC_DICT_PARALLEL_MAGIC, dsm_segment_address(segment));
+    if (toc == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE), errmsg("Invalid magic number in dynamic shared memory segment")));
+    }
+
+    shared = shm_toc_lookup(toc, CALC_DICT_KEY_SHARED, false);
+    trie = shm_toc_lookup(toc, CALC_DICT_KEY_TRIE, false);
+    offsets = shm_toc_lookup(toc, CALC_DICT_KEY_OFFSETS, false);
+    strings = shm_toc_lookup(toc, CALC_DICT_KEY_STRINGS, false);
+    queues = shm_toc_lookup(toc, CALC_DICT_KEY_QUEUES, false);
+
+    memcpy(&worker_i, MyBgworkerEntry->bgw_extra, sizeof(worker_i));
+    queue = (shm_mq*)(queues + (Size)CALC_DICT_QUEUE_SIZE * worker_i);
+    shm_mq_set_sender(queue, MyProc);
+    queue_handle = shm_mq_attach(queue, segment, NULL);
+
+    chunk_context = AllocSetContextCreate(TopMemoryContext, "mipt-asj calc_dict worker chunk", ALLOCSET_DEFAULT_SIZES);
+    MemoryContextSwitchTo(chunk_context);
+
+    while (true) {
+        const uint64 chunk = pg_atomic_fetch_add_u32(&shared->next_chunk, 1);
+        const uint64 start = chunk * shared->chunk_size;
+        const uint64 end = Min(start + shared->chunk_size, shared->nfulls);
+
+        if (start >= shared->nfulls) {
+            break;
+        }
+
+        for (uint64 full_i = start; full_i < end; full_i++) {
+            int32* found = NULL;
+            const int found_size = flat_trie_search_subsequences(
+                trie, strings + offsets[full_i], offsets[full_i + 1] - offsets[full_i], &found
+            );
+            for (int s = 0; s < found_size; s++) {
+                batch[batch_used].full_i = full_i;
+                batch[batch_used].abbr_i = found[s];
+                batch_used += 1;
+                if (batch_used == CALC_DICT_BATCH_SIZE) {
+                    _send_rules(queue_handle, batch, batch_used);
+                    batch_used = 0;
+                }
+            }
+        }
+
+        MemoryContextReset(chunk_context);
+        CHECK_FOR_INTERRUPTS();
+    }
+    _send_rules(queue_handle, batch, batch_used);
+
+    pg_atomic_fetch_add_u32(&shared->workers_finished, 1);
+    dsm_detach(segment);
+}
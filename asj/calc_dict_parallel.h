@@ -0,0 +1,63 @@
+#ifndef CALC_DICT_PARALLEL_H
+#define CALC_DICT_PARALLEL_H
+
+/*
+ * calc_dict_parallel.h
+ *      Parallel abbreviation search for abbreviation dictionary calculation,
+ *      part of Tao-Deng-Stonebraker algorithm for
+ *      approximate string JOINs with abbreviations
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/asj/calc_dict_parallel.h
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "lib/trie.h"
+
+
+/**
+ * @brief Callback to receive a rule found by parallel search
+ *
+ * @param full_i index of full form
+ * @param abbr_i index of abbreviation (data index in flat trie)
+ * @param arg
+ */
+typedef void (*calc_dict_rule_found_callback)(uint32 full_i, int32 abbr_i, void* arg);
+
+
+/**
+ * @brief Search abbreviations in full forms using background workers
+ *
+ * The abbreviations' trie is flattened into a dynamic shared memory segment
+ * together with full forms. Every worker takes chunks of full forms, searches
+ * them in the trie and streams rules found back to this (leader) backend.
+ *
+ * @param trie abbreviations' trie
+ * @param data_index function to map trie data to abbreviation indices
+ * @param data_index_arg
+ * @param fulls full forms
+ * @param nfulls number of full forms
+ * @param nworkers number of background workers to launch
+ * @param rule_found callback to call for every rule found
+ * @param rule_found_arg
+ *
+ * @return false if no background worker could be launched (nothing is searched then)
+ */
+bool
+calc_dict_parallel_search(
+    const struct trie* trie, int32 (*data_index)(const void* data, void* arg), void* data_index_arg,
+    char** fulls, unsigned long nfulls,
+    int nworkers,
+    calc_dict_rule_found_callback rule_found, void* rule_found_arg
+);
+
+
+/**
+ * @brief Entry point of a background worker launched by 'calc_dict_parallel_search'
+ */
+PGDLLEXPORT void calc_dict_worker_main(Datum main_arg);
+
+
+#endif /* CALC_DICT_PARALLEL_H */
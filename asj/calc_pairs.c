@@ -11,39 +11,47 @@
 #include "calc_pairs.h"
 
 
+bool mipt_asj_suffix_filter = false;
+
+
+/**
+ * @brief Abbreviation rule, tokenized once when rules are loaded
+ */
+typedef struct {
+    /// Abbreviation (a single token)
+    Token abbr;
+    /// SORTED tokens of full form
+    TokenSequence full;
+} Rule;
+
+
 typedef struct {
     unsigned long size;
     /**
      * Rules
      */
-    char*** rs;
+    Rule* rs;
 } RuleSequence;
 
 
 /**
- * Result of rule application
+ * @brief An occurrence of a side of a rule in a token sequence
  */
 typedef struct {
-    bool applies;
-    unsigned long aside;
-    unsigned long rside;
-} SubRuleApplication;
+    const Rule* rule;
+    /// Abbreviation occurs (it may be replaced by full form); otherwise, full form occurs
+    bool a_f;
+} RuleMatch;
 
 
+/**
+ * @brief All rule occurrences in a token sequence, grouped by the position they end at
+ */
 typedef struct {
-    /**
-     * Abbreviation-to-full subrule
-     */
-    SubRuleApplication a_f;
-    /**
-     * Full-to-abbreviation subrule
-     */
-    SubRuleApplication f_a;
-    /**
-     * Raw rule pointer
-     */
-    const char** rule;
-} RuleApplication;
+    /// Occurrences ending at token i are matches[starts[i]] ... matches[starts[i + 1] - 1]
+    unsigned long* starts;
+    RuleMatch* matches;
+} RuleMatches;
 
 
 /**
@@ -60,96 +68,641 @@ _prefix_sig_length(unsigned long tokens_total, double exactness)
 
 
 /**
- * @brief Calculate prefix signature of a given string
+ * @brief Least overlap of a token set with any other set, whose Jaccard similarity with it is not less than 'exactness'
+ *
+ * @param x_size number of tokens in the set
+ * @param exactness
+ */
+static inline long
+_required_overlap(long x_size, double exactness)
+{
+    // Subtract a small value, so that rounding errors do not increase the result
+    return (long)ceil(exactness * x_size - 1e-9);
+}
+
+
+/**
+ * @brief Least overlap of two token sets, whose Jaccard similarity is not less than 'exactness'
+ *
+ * @param x_size number of tokens in one set
+ * @param y_size number of tokens in the other set
+ * @param exactness
+ */
+static inline long
+_required_pair_overlap(long x_size, long y_size, double exactness)
+{
+    // Subtract a small value, so that rounding errors do not increase the result
+    return (long)ceil(exactness / (1.0 + exactness) * (x_size + y_size) - 1e-9);
+}
+
+
+/**
+ * @brief Tokens which may be in prefix signature of a string derived from a row (U-signature), with their g-values
+ */
+typedef struct {
+    /// SORTED distinct tokens
+    TokenSequence tokens;
+    /// Greatest length of strings derived from the whole row
+    long l_max;
+    /**
+     * g[k * l_max + l - 1] is g-value of 'tokens.ts[k]' in strings of length l derived from the whole row,
+     * or -1 if the token is in no such string. Made for rows of calc_pairs only; NULL otherwise
+     */
+    long* g;
+} USignature;
+
+
+/**
+ * @brief Row prepared for filtering
+ */
+typedef struct {
+    /// All tokens of the row, SORTED
+    TokenSequence tokens;
+    /// Number of leading 'tokens' which form prefix signature of the row
+    unsigned long prefix_size;
+    /// SORTED distinct tokens of all strings derived from the row by rules; suffix filter only
+    TokenSequence reachable;
+    /// U-signature of prefix signature
+    USignature u_signature;
+} FilterRow;
+
+
+/**
+ * @brief Tokenize and sort a given string, calculate its prefix signature
  *
  * @param string
  * @param exactness
- * @return TokenSequence
+ * @return FilterRow, without 'reachable' tokens
+ */
+static FilterRow
+_filter_row_build(const char* string, double exactness)
+{
+    FilterRow result;
+
+    result.tokens = tokenize(string, " ");
+    pg_qsort((void*)result.tokens.ts, result.tokens.size, sizeof(*result.tokens.ts), cmp_tokens_wrapper);
+
+    result.prefix_size = _prefix_sig_length(result.tokens.size, exactness);
+    result.prefix_size = Min(result.prefix_size, result.tokens.size);
+
+    result.reachable = (TokenSequence){0, NULL};
+    result.u_signature = (USignature){{0, NULL}, 0, NULL};
+
+    return result;
+}
+
+
+/**
+ * @brief Make RuleSequence of a RuleSet
+ *
+ * Abbreviations are single tokens; rules whose abbreviation is not a single token
+ * never apply, and are skipped.
+ *
+ * @param rs rule set; rules refer to it
+ * @return RuleSequence
+ */
+static RuleSequence
+_rules_from_ruleset(const RuleSet* rs)
+{
+    const RuleSetRule* rs_rules = RULESET_RULES(rs);
+    Token* tokens = ruleset_tokens(rs);
+    RuleSequence result = {0, NULL};
+
+    result.rs = palloc(sizeof(*result.rs) * Max(rs->nrules, 1));
+    for (uint32 i = 0; i < rs->nrules; i++) {
+        if (rs_rules[i].abbr_count != 1) {
+            continue;
+        }
+        result.rs[result.size].abbr = tokens[rs_rules[i].abbr];
+        result.rs[result.size].full = (TokenSequence){rs_rules[i].full_count, &tokens[rs_rules[i].full]};
+        result.size += 1;
+    }
+
+    return result;
+}
+
+
+/**
+ * @brief Rules, ordered for lookup by tokens
+ */
+typedef struct {
+    unsigned long size;
+    /// Rules ordered by abbreviation
+    const Rule** by_abbr;
+    /// Rules with non-empty full form, ordered by first token of full form
+    const Rule** by_full;
+    unsigned long by_full_size;
+} RuleIndex;
+
+
+static int
+_cmp_rules_by_abbr(const void* a, const void* b)
+{
+    return cmp_tokens(&(*(const Rule* const*)a)->abbr, &(*(const Rule* const*)b)->abbr);
+}
+
+
+static int
+_cmp_rules_by_full(const void* a, const void* b)
+{
+    return cmp_tokens(&(*(const Rule* const*)a)->full.ts[0], &(*(const Rule* const*)b)->full.ts[0]);
+}
+
+
+/**
+ * @brief Build RuleIndex of given rules
+ */
+static RuleIndex
+_rule_index_build(const RuleSequence* rules)
+{
+    RuleIndex result;
+
+    result.size = rules->size;
+    result.by_abbr = palloc(sizeof(*result.by_abbr) * Max(rules->size, 1));
+    result.by_full = palloc(sizeof(*result.by_full) * Max(rules->size, 1));
+    result.by_full_size = 0;
+    for (unsigned long i = 0; i < rules->size; i++) {
+        result.by_abbr[i] = &rules->rs[i];
+        if (rules->rs[i].full.size > 0) {
+            result.by_full[result.by_full_size++] = &rules->rs[i];
+        }
+    }
+    pg_qsort((void*)result.by_abbr, result.size, sizeof(*result.by_abbr), _cmp_rules_by_abbr);
+    pg_qsort((void*)result.by_full, result.by_full_size, sizeof(*result.by_full), _cmp_rules_by_full);
+
+    return result;
+}
+
+
+/**
+ * @brief Find index of the first rule whose key (abbreviation, or first token of full form) is not less than 'token'
+ */
+static unsigned long
+_rule_index_lower_bound(const Rule* const* rules, unsigned long size, bool by_abbr, const Token* token)
+{
+    unsigned long low = 0;
+    unsigned long high = size;
+
+    while (low < high) {
+        const unsigned long middle = low + (high - low) / 2;
+        const Token* key = by_abbr ? &rules[middle]->abbr : &rules[middle]->full.ts[0];
+        if (cmp_tokens(key, token) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+/**
+ * @brief Find a token in a SORTED token sequence
+ *
+ * @return index of the token, or -1 if it is not present
+ */
+static long
+_tokens_find(TokenSequence ts, const Token* token)
+{
+    unsigned long low = 0;
+    unsigned long high = ts.size;
+
+    while (low < high) {
+        const unsigned long middle = low + (high - low) / 2;
+        const int comparation_result = cmp_tokens(&ts.ts[middle], token);
+        if (comparation_result == 0) {
+            return middle;
+        }
+        if (comparation_result < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Check whether a SORTED token sequence contains a token
+ */
+static bool
+_tokens_contain(TokenSequence ts, const Token* token)
+{
+    return _tokens_find(ts, token) >= 0;
+}
+
+
+/**
+ * @brief Calculate tokens of all strings that can be derived from given SORTED tokens by rules
+ *
+ * These are the tokens themselves, full forms of abbreviations present in them,
+ * and abbreviations whose full forms are present in them.
+ *
+ * @return SORTED sequence of distinct tokens
  */
 static TokenSequence
-_prefix_sig(const char* string, double exactness)
+_reachable_tokens(TokenSequence tokens, const RuleIndex* index)
 {
-    TokenSequence temp;
     TokenSequence result = {0, NULL};
+    unsigned long allocated = tokens.size + 1;
+    unsigned long unique = 0;
+
+    result.ts = palloc(sizeof(*result.ts) * allocated);
+
+#define REACHABLE_ADD(token) \
+    do { \
+        if (result.size == allocated) { \
+            allocated *= 2; \
+            result.ts = repalloc(result.ts, sizeof(*result.ts) * allocated); \
+        } \
+        result.ts[result.size++] = (token); \
+    } while (0)
+
+    for (unsigned long i = 0; i < tokens.size; i++) {
+        unsigned long r;
+
+        REACHABLE_ADD(tokens.ts[i]);
+
+        // Abbreviation -> full form
+        for (r = _rule_index_lower_bound(index->by_abbr, index->size, true, &tokens.ts[i]);
+                r < index->size && tokens_equal(&index->by_abbr[r]->abbr, &tokens.ts[i]); r++) {
+            for (unsigned long k = 0; k < index->by_abbr[r]->full.size; k++) {
+                REACHABLE_ADD(index->by_abbr[r]->full.ts[k]);
+            }
+        }
 
-    temp = tokenize(string, " ");
-    pg_qsort((void*)temp.ts, temp.size, sizeof(*temp.ts), cmp_tokens_wrapper);
+        // Full form -> abbreviation; every rule is found by the first token of its full form
+        for (r = _rule_index_lower_bound(index->by_full, index->by_full_size, false, &tokens.ts[i]);
+                r < index->by_full_size && tokens_equal(&index->by_full[r]->full.ts[0], &tokens.ts[i]); r++) {
+            bool applies = true;
+            for (unsigned long k = 1; k < index->by_full[r]->full.size && applies; k++) {
+                applies = _tokens_contain(tokens, &index->by_full[r]->full.ts[k]);
+            }
+            if (applies) {
+                REACHABLE_ADD(index->by_full[r]->abbr);
+            }
+        }
+    }
 
-    result.size = _prefix_sig_length(temp.size, exactness);
-    result.size = Min(result.size, temp.size);
-    result.ts = palloc(sizeof(*result.ts) * result.size);
+#undef REACHABLE_ADD
+
+    pg_qsort((void*)result.ts, result.size, sizeof(*result.ts), cmp_tokens_wrapper);
     for (unsigned long i = 0; i < result.size; i++) {
-        result.ts[i] = temp.ts[i];
-    }
-    for (unsigned long i = result.size; i < temp.size; i++) {
-        pfree(temp.ts[i]);
+        if (unique == 0 || !tokens_equal(&result.ts[unique - 1], &result.ts[i])) {
+            result.ts[unique++] = result.ts[i];
+        }
     }
-    pfree(temp.ts);
+    result.size = unique;
 
     return result;
 }
 
 
 /**
- * @brief Try to apply a rule to given TokenSequence
+ * @brief Calculate, for every token of 'x', how many of the following tokens of 'x' are reachable in 'y'
+ *
+ * @param x row whose tokens are checked
+ * @param y row whose reachable tokens are checked against
+ * @param suffix_reachable array of 'x->tokens.size' elements to fill.
+ *      Element is -1 if the token itself is not reachable in 'y'
+ */
+static void
+_suffix_reachable(const FilterRow* x, const FilterRow* y, long* suffix_reachable)
+{
+    unsigned long y_i = 0;
+    long following = 0;
+
+    // Merge two SORTED sequences; mark reachable tokens
+    for (unsigned long x_i = 0; x_i < x->tokens.size; x_i++) {
+        int comparation_result = 1;
+        while (y_i < y->reachable.size && (comparation_result = cmp_tokens(&y->reachable.ts[y_i], &x->tokens.ts[x_i])) < 0) {
+            y_i += 1;
+        }
+        suffix_reachable[x_i] = y_i < y->reachable.size && comparation_result == 0 ? 1 : 0;
+    }
+
+    // Count reachable tokens in suffixes
+    for (long x_i = (long)x->tokens.size - 1; x_i >= 0; x_i--) {
+        const bool reachable = suffix_reachable[x_i] > 0;
+        suffix_reachable[x_i] = reachable ? following : -1;
+        following += reachable ? 1 : 0;
+    }
+}
+
+
+/**
+ * @brief Aho-Corasick automaton, which finds occurrences of rules' sides in token sequences
  *
- * @param rule rule to apply
- * @param ts token sequence
- * @param ts_endpos position where applicable rule must end
- * @return RuleApplication
+ * Both sides of every rule are patterns over token IDs. Tokens which are not
+ * in any rule have no ID, and return the automaton to its root. Patterns
+ * found in a state are ones ending in it, and ones of states down its
+ * 'dict' chain. Empty full forms are patterns of the root, and occur everywhere.
+ */
+typedef struct {
+    /// SORTED distinct tokens of all rules; token ID is the index in this sequence
+    TokenSequence alphabet;
+
+    /// Number of states; state 0 is the root
+    uint32 size;
+    uint32 allocated;
+    /// Longest proper suffix state of every state
+    uint32* fail;
+    /// Nearest state down the 'fail' chain which has patterns of its own; the root if none
+    uint32* dict;
+    /// First pattern of every state, index in 'patterns'; -1 if none
+    int32* first_pattern;
+    /// Parent state, token ID of the edge from it, and depth of every state; used while building
+    uint32* parent;
+    uint32* parent_token;
+    uint32* depth;
+    /// Transitions, AcEdge
+    HTAB* edges;
+
+    /// Patterns of all states; patterns of a state are linked by 'next_pattern'
+    RuleMatch* patterns;
+    int32* next_pattern;
+    unsigned long patterns_size;
+} RuleMatcher;
+
+
+typedef struct {
+    uint32 state;
+    uint32 token;
+} AcEdgeKey;
+
+
+typedef struct {
+    /// Must be the first field (dynahash requirement)
+    AcEdgeKey key;
+    uint32 target;
+} AcEdge;
+
+
+#define RULE_MATCHER_NO_TOKEN PG_UINT32_MAX
+#define RULE_MATCHER_NO_STATE PG_UINT32_MAX
+
+
+/**
+ * @brief Get ID of a token; RULE_MATCHER_NO_TOKEN if it is in no rule
  */
-static RuleApplication
-_rule_apply(const char** rule, TokenSequence ts, unsigned long ts_endpos)
+static uint32
+_rule_matcher_token(const RuleMatcher* matcher, const Token* token)
 {
-    RuleApplication result = (RuleApplication){
-        (SubRuleApplication){false, 0, 0},
-        (SubRuleApplication){false, 0, 0},
-        rule
-    };
-    const char* rule_A = rule[0];
-    const char* rule_F = rule[1];
-    TokenSequence rule_F_tokenized;
-    bool f_a_applies = true;
+    unsigned long low = 0;
+    unsigned long high = matcher->alphabet.size;
+
+    while (low < high) {
+        const unsigned long middle = low + (high - low) / 2;
+        const int comparation_result = cmp_tokens(&matcher->alphabet.ts[middle], token);
+        if (comparation_result == 0) {
+            return middle;
+        }
+        if (comparation_result < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return RULE_MATCHER_NO_TOKEN;
+}
+
 
-    // Correct input parameter
-    ts_endpos = ts_endpos >= ts.size ? ts.size - 1 : ts_endpos;
+/**
+ * @brief Get the state reached from 'state' by 'token' edge; RULE_MATCHER_NO_STATE if there is no such edge
+ */
+static uint32
+_rule_matcher_edge(const RuleMatcher* matcher, uint32 state, uint32 token)
+{
+    AcEdgeKey key = {state, token};
+    AcEdge* edge = hash_search(matcher->edges, &key, HASH_FIND, NULL);
+    return edge == NULL ? RULE_MATCHER_NO_STATE : edge->target;
+}
 
-    // Tokenize full rule
-    rule_F_tokenized = tokenize(rule_F, " ");
 
-    // Check application of a_f rule
-    if (strcmp(rule_A, ts.ts[ts_endpos]) == 0) {
-        result.a_f = (SubRuleApplication){
-            true,
-            1,
-            rule_F_tokenized.size
-        };
+/**
+ * @brief Add a pattern to the trie of the automaton
+ */
+static void
+_rule_matcher_add(RuleMatcher* matcher, const Token* tokens, unsigned long size, RuleMatch match)
+{
+    uint32 state = 0;
+
+    for (unsigned long i = 0; i < size; i++) {
+        AcEdgeKey key = {state, _rule_matcher_token(matcher, &tokens[i])};
+        bool found;
+        AcEdge* edge = hash_search(matcher->edges, &key, HASH_ENTER, &found);
+
+        if (!found) {
+            if (matcher->size == matcher->allocated) {
+                matcher->allocated *= 2;
+                matcher->fail = repalloc_huge(matcher->fail, sizeof(*matcher->fail) * matcher->allocated);
+                matcher->dict = repalloc_huge(matcher->dict, sizeof(*matcher->dict) * matcher->allocated);
+                matcher->first_pattern = repalloc_huge(matcher->first_pattern, sizeof(*matcher->first_pattern) * matcher->allocated);
+                matcher->parent = repalloc_huge(matcher->parent, sizeof(*matcher->parent) * matcher->allocated);
+                matcher->parent_token = repalloc_huge(matcher->parent_token, sizeof(*matcher->parent_token) * matcher->allocated);
+                matcher->depth = repalloc_huge(matcher->depth, sizeof(*matcher->depth) * matcher->allocated);
+            }
+            edge->target = matcher->size;
+            matcher->first_pattern[matcher->size] = -1;
+            matcher->parent[matcher->size] = state;
+            matcher->parent_token[matcher->size] = key.token;
+            matcher->depth[matcher->size] = matcher->depth[state] + 1;
+            matcher->size += 1;
+        }
+        state = edge->target;
     }
 
-    // Check application of f_a rule
-    for (int i = 0; i < rule_F_tokenized.size; i++) {
-        int ts_currpos = ts_endpos - (rule_F_tokenized.size - 1) + i;
-        if (ts_currpos < 0) {
-            f_a_applies = false;
-            break;
+    matcher->patterns[matcher->patterns_size] = match;
+    matcher->next_pattern[matcher->patterns_size] = matcher->first_pattern[state];
+    matcher->first_pattern[state] = matcher->patterns_size;
+    matcher->patterns_size += 1;
+}
+
+
+/**
+ * @brief Build RuleMatcher of given rules
+ */
+static RuleMatcher
+_rule_matcher_build(const RuleSequence* rules)
+{
+    RuleMatcher result;
+    HASHCTL ctl;
+    unsigned long alphabet_size = 0;
+    uint32* order;
+    uint32* depth_count;
+    uint32 max_depth = 0;
+
+    // Alphabet
+    result.alphabet.size = 0;
+    for (unsigned long i = 0; i < rules->size; i++) {
+        alphabet_size += 1 + rules->rs[i].full.size;
+    }
+    result.alphabet.ts = palloc_extended(sizeof(*result.alphabet.ts) * Max(alphabet_size, 1), MCXT_ALLOC_HUGE);
+    for (unsigned long i = 0; i < rules->size; i++) {
+        result.alphabet.ts[result.alphabet.size++] = rules->rs[i].abbr;
+        for (unsigned long k = 0; k < rules->rs[i].full.size; k++) {
+            result.alphabet.ts[result.alphabet.size++] = rules->rs[i].full.ts[k];
         }
-        if (strcmp(rule_F_tokenized.ts[i], ts.ts[ts_currpos]) != 0) {
-            f_a_applies = false;
-            break;
+    }
+    pg_qsort((void*)result.alphabet.ts, result.alphabet.size, sizeof(*result.alphabet.ts), cmp_tokens_wrapper);
+    alphabet_size = 0;
+    for (unsigned long i = 0; i < result.alphabet.size; i++) {
+        if (alphabet_size == 0 || !tokens_equal(&result.alphabet.ts[alphabet_size - 1], &result.alphabet.ts[i])) {
+            result.alphabet.ts[alphabet_size++] = result.alphabet.ts[i];
+        }
+    }
+    result.alphabet.size = alphabet_size;
+
+    // Trie
+    result.size = 1;
+    result.allocated = 16;
+    result.fail = palloc(sizeof(*result.fail) * result.allocated);
+    result.dict = palloc(sizeof(*result.dict) * result.allocated);
+    result.first_pattern = palloc(sizeof(*result.first_pattern) * result.allocated);
+    result.parent = palloc(sizeof(*result.parent) * result.allocated);
+    result.parent_token = palloc(sizeof(*result.parent_token) * result.allocated);
+    result.depth = palloc(sizeof(*result.depth) * result.allocated);
+    result.first_pattern[0] = -1;
+    result.depth[0] = 0;
+
+    ctl.keysize = sizeof(AcEdgeKey);
+    ctl.entrysize = sizeof(AcEdge);
+    ctl.hcxt = CurrentMemoryContext;
+    result.edges = hash_create("mipt-asj rule matcher", Max(result.alphabet.size, 16), &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    result.patterns = palloc_extended(sizeof(*result.patterns) * Max(rules->size * 2, 1), MCXT_ALLOC_HUGE);
+    result.next_pattern = palloc_extended(sizeof(*result.next_pattern) * Max(rules->size * 2, 1), MCXT_ALLOC_HUGE);
+    result.patterns_size = 0;
+    for (unsigned long i = 0; i < rules->size; i++) {
+        const Rule* rule = &rules->rs[i];
+        _rule_matcher_add(&result, &rule->abbr, 1, (RuleMatch){rule, true});
+        _rule_matcher_add(&result, rule->full.ts, rule->full.size, (RuleMatch){rule, false});
+    }
+
+    // Failure links, in order of depth: the link of a state refers to a shallower one
+    for (uint32 v = 0; v < result.size; v++) {
+        max_depth = Max(max_depth, result.depth[v]);
+    }
+    depth_count = palloc0(sizeof(*depth_count) * (max_depth + 2));
+    for (uint32 v = 0; v < result.size; v++) {
+        depth_count[result.depth[v] + 1] += 1;
+    }
+    for (uint32 d = 1; d <= max_depth + 1; d++) {
+        depth_count[d] += depth_count[d - 1];
+    }
+    order = palloc(sizeof(*order) * result.size);
+    for (uint32 v = 0; v < result.size; v++) {
+        order[depth_count[result.depth[v]]++] = v;
+    }
+
+    result.fail[0] = 0;
+    result.dict[0] = 0;
+    for (uint32 o = 1; o < result.size; o++) {
+        const uint32 v = order[o];
+        const uint32 token = result.parent_token[v];
+        uint32 f = result.fail[result.parent[v]];
+        uint32 target = RULE_MATCHER_NO_STATE;
+
+        if (result.parent[v] != 0) {
+            while ((target = _rule_matcher_edge(&result, f, token)) == RULE_MATCHER_NO_STATE && f != 0) {
+                f = result.fail[f];
+            }
         }
+        result.fail[v] = target == RULE_MATCHER_NO_STATE ? 0 : target;
+        result.dict[v] = result.first_pattern[result.fail[v]] >= 0 ? result.fail[v] : result.dict[result.fail[v]];
+    }
+
+    pfree(order);
+    pfree(depth_count);
+    return result;
+}
+
+
+/**
+ * @brief Order RuleMatch by rule, abbreviation first
+ */
+static int
+_cmp_rule_matches(const void* a, const void* b)
+{
+    const RuleMatch* m1 = (const RuleMatch*)a;
+    const RuleMatch* m2 = (const RuleMatch*)b;
+
+    if (m1->rule != m2->rule) {
+        return m1->rule < m2->rule ? -1 : 1;
     }
-    if (f_a_applies) {
-        result.f_a = (SubRuleApplication) {
-            true,
-            rule_F_tokenized.size,
-            1
-        };
+    return (int)m2->a_f - (int)m1->a_f;
+}
+
+
+/**
+ * @brief Find all occurrences of rules' sides in a token sequence, in one pass over it
+ *
+ * Occurrences ending at the same position are ordered as rules are, so that
+ * '_calculate_g' sees them in the same order as with a scan over all rules.
+ */
+static RuleMatches
+_rule_matcher_run(const RuleMatcher* matcher, TokenSequence ts)
+{
+    RuleMatches result;
+    unsigned long allocated = ts.size + 1;
+    unsigned long size = 0;
+    uint32 state = 0;
+
+    result.starts = palloc(sizeof(*result.starts) * (ts.size + 1));
+    result.matches = palloc(sizeof(*result.matches) * allocated);
+
+    for (unsigned long i = 0; i < ts.size; i++) {
+        const uint32 token = _rule_matcher_token(matcher, &ts.ts[i]);
+        uint32 target = RULE_MATCHER_NO_STATE;
+
+        if (token != RULE_MATCHER_NO_TOKEN) {
+            while ((target = _rule_matcher_edge(matcher, state, token)) == RULE_MATCHER_NO_STATE && state != 0) {
+                state = matcher->fail[state];
+            }
+        }
+        state = target == RULE_MATCHER_NO_STATE ? 0 : target;
+
+        result.starts[i] = size;
+        // Patterns of the state and of its 'dict' chain, then ones of the root (which is never in the chain)
+        for (uint32 s = state; ; s = matcher->dict[s]) {
+            for (int32 p = matcher->first_pattern[s]; p >= 0; p = matcher->next_pattern[p]) {
+                if (size == allocated) {
+                    allocated *= 2;
+                    result.matches = repalloc_huge(result.matches, sizeof(*result.matches) * allocated);
+                }
+                result.matches[size++] = matcher->patterns[p];
+            }
+            if (s == 0) {
+                break;
+            }
+            if (matcher->dict[s] == 0 && matcher->first_pattern[0] < 0) {
+                break;
+            }
+        }
+        pg_qsort((void*)&result.matches[result.starts[i]], size - result.starts[i], sizeof(*result.matches), _cmp_rule_matches);
     }
+    result.starts[ts.size] = size;
+    stat_rule_evaluations += size;
 
     return result;
 }
 
 
+/**
+ * @brief Release memory occupied by RuleMatches
+ */
+static void
+_rule_matches_free(RuleMatches* matches)
+{
+    pfree(matches->starts);
+    pfree(matches->matches);
+}
+
+
 /**
  * @brief Calculate g-function for given parameters
  *
@@ -165,18 +718,19 @@ _rule_apply(const char** rule, TokenSequence ts, unsigned long ts_endpos)
  * @param t token to check
  * @param t_present flag that t was found in s
  *      Must be set to false when first called, and checked after function return
- * @param rules abbreviation rules
+ * @param matches occurrences of rules' sides in s
  *
  * @return value of g-function, or INT_MAX if t was not found
  * @param t will be set to true, if t was found
  */
 static long
-_calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, RuleSequence rules)
+_calculate_g(TokenSequence s, long i, long l, const Token* t, bool* t_present, const RuleMatches* matches)
 {
     long result = (long)INT_MAX;
     long result_current;
 
-    elog(DEBUG1, " >  _g() call parameters: i=%ld, l=%ld, t=%s, t_present=%d", i, l, t, *t_present);
+    stat_g_evaluations++;
+    elog(DEBUG1, " >  _g() call parameters: i=%ld, l=%ld, t=%s, t_present=%d", i, l, t->s, *t_present);
 
     // Check recursion base return conditions
     if (l <= 0 || i < 0) {
@@ -191,16 +745,16 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
     // Calculate case 1: current token has no rules that apply to it
     {
         int comparation_result;
-        comparation_result = cmp_tokens(s.ts[i >= s.size ? s.size - 1 : i], t);
+        comparation_result = cmp_tokens(&s.ts[i >= s.size ? s.size - 1 : i], t);
         if (comparation_result > 0) {
-            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, rules);
+            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, matches);
         }
         else if (comparation_result < 0) {
-            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, rules) + 1;
+            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, matches) + 1;
         }
         else {
             *t_present = true;
-            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, rules);
+            result_current = _calculate_g(s, i - 1, l - 1, t, t_present, matches);
         }
     }
 
@@ -212,24 +766,19 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
     {
         result_current = (long)INT_MAX;
 
-        for (unsigned long j = 0; j < rules.size; j++) {
-            RuleApplication ra;
+        for (unsigned long j = matches->starts[i]; j < matches->starts[i + 1]; j++) {
+            const Rule* rule = matches->matches[j].rule;
             long result_current_rule = (long)INT_MAX;
 
-            ra = _rule_apply((const char**)rules.rs[j], s, i);
-
             // a_f recursion
-            if (ra.a_f.applies) {
-                TokenSequence rule_ts;
+            if (matches->matches[j].a_f) {
                 int ts_less = 0;
                 int comparation_result;
 
-                elog(DEBUG1, "\ta_f rule applies: aside %lu '%s' -> rside %lu '%s'", ra.a_f.aside, ra.rule[0], ra.a_f.rside, ra.rule[1]);
+                elog(DEBUG1, "\ta_f rule applies: aside 1 '%s' -> rside %lu", rule->abbr.s, rule->full.size);
 
-                rule_ts = tokenize(ra.rule[1], " ");
-
-                for (int t_i = 0; t_i < rule_ts.size; t_i++) {
-                    comparation_result = cmp_tokens(rule_ts.ts[t_i], t);
+                for (int t_i = 0; t_i < rule->full.size; t_i++) {
+                    comparation_result = cmp_tokens(&rule->full.ts[t_i], t);
                     if (comparation_result == 0) {
                         *t_present = true;
                     }
@@ -238,7 +787,7 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
                     }
                 }
 
-                result_current_rule = _calculate_g(s, i - ra.a_f.aside, l - ra.a_f.rside, t, t_present, rules) + ts_less;
+                result_current_rule = _calculate_g(s, i - 1, l - rule->full.size, t, t_present, matches) + ts_less;
                 result_current = Min(
                     result_current,
                     result_current_rule
@@ -246,13 +795,13 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
             }
 
             // f_a recursion
-            if (ra.f_a.applies) {
+            else {
                 int ts_less = 0;
                 int comparation_result;
 
-                elog(DEBUG1, "\tf_a rule applies: aside %lu '%s' -> rside %lu '%s'", ra.f_a.aside, ra.rule[1], ra.f_a.rside, ra.rule[0]);
+                elog(DEBUG1, "\tf_a rule applies: aside %lu -> rside 1 '%s'", rule->full.size, rule->abbr.s);
 
-                comparation_result = cmp_tokens(ra.rule[0], t);
+                comparation_result = cmp_tokens(&rule->abbr, t);
                 if (comparation_result == 0) {
                     *t_present = true;
                 }
@@ -260,7 +809,7 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
                     ts_less += 1;
                 }
 
-                result_current_rule = _calculate_g(s, i - ra.f_a.aside, l - ra.f_a.rside, t, t_present, rules) + ts_less;
+                result_current_rule = _calculate_g(s, i - rule->full.size, l - 1, t, t_present, matches) + ts_less;
                 result_current = Min(
                     result_current,
                     result_current_rule
@@ -279,241 +828,618 @@ _calculate_g(TokenSequence s, long i, long l, const char* t, bool* t_present, Ru
 
 
 /**
- * @brief Comparator for pairs (unsigned long, unsigned long)
+ * @brief Calculate U-signature of a row
+ *
+ * Only tokens reachable from the row may be present in strings derived from it.
+ * g-function is calculated for each of them and every length of derived strings once,
+ * instead of for every pair of rows.
+ *
+ * @param seq_u prefix signature of the row
+ * @param matches occurrences of rules' sides in 'seq_u'
+ * @param index rules
+ * @param longest_rule_length length of longest full form among all rules
+ * @param exactness
  */
-static int
-_cmp_ulong_pair_wrapped(const void* a, const void* b)
+static USignature
+_u_signature_build(TokenSequence seq_u, const RuleMatches* matches, const RuleIndex* index, unsigned long longest_rule_length, double exactness)
 {
-    unsigned long vA[2];
-    unsigned long vB[2];
-
-    for (unsigned char j = 0; j < 2; j++) {
-        vA[j] = (*(const unsigned long**)a)[j];
-        vB[j] = (*(const unsigned long**)b)[j];
+    USignature result;
+    TokenSequence reachable = _reachable_tokens(seq_u, index);
+
+    // Tokens which are in no prefix signature are dropped; 'reachable' is compacted in place
+    result.tokens = (TokenSequence){0, reachable.ts};
+    for (unsigned long k = 0; k < reachable.size; k++) {
+        for (long l = seq_u.size + longest_rule_length; l > 0; l--) {
+            bool t_present = false;
+            const long g = _calculate_g(seq_u, seq_u.size - 1, l, &reachable.ts[k], &t_present, matches);
+            if (t_present && g + 1 <= (long)_prefix_sig_length(l, exactness)) {
+                result.tokens.ts[result.tokens.size++] = reachable.ts[k];
+                break;
+            }
+        }
     }
 
-    return vA[0] == vB[0] ? vA[1] - vB[1] : vA[0] - vB[0];
+    // The signature is kept for the whole call, while 'reachable' may be much longer
+    result.tokens.ts = palloc(sizeof(*result.tokens.ts) * Max(result.tokens.size, 1));
+    memcpy(result.tokens.ts, reachable.ts, sizeof(*result.tokens.ts) * result.tokens.size);
+    pfree(reachable.ts);
+    result.l_max = 0;
+    result.g = NULL;
+
+    return result;
 }
 
 
 /**
- * @brief Remove repeating pairs of joins in-place
+ * @brief Greatest number of tokens in a string derived from a row by rules
  *
- * @param joins_ptr
- * @param joins_size
- * @return new joins_size
+ * Every occurrence of a rule is applied at most once; an empty full form adds one abbreviation where it occurs.
+ *
+ * @param s all tokens of the row
+ * @param matches occurrences of rules' sides in 's'
  */
-static unsigned long
-_remove_duplicate_joins(unsigned long*** joins_ptr, unsigned long joins_size)
+static long
+_derived_length_max(TokenSequence s, const RuleMatches* matches)
 {
-    unsigned long** joins = *joins_ptr;
-
-    bool* joins_to_stay;
-    unsigned long joins_to_stay_count;
-    unsigned long joins_to_stay_insert_index;
-
-    // Check call parameters
-    if (joins == NULL || joins_size == 0) {
-        return joins_size;
-    }
-
-    pg_qsort(joins, joins_size, sizeof(*joins), _cmp_ulong_pair_wrapped);
-
-    // Select joins to stay
-    joins_to_stay = palloc(sizeof(*joins_to_stay) * joins_size);
-    joins_to_stay[0] = true;
-    joins_to_stay_count = 1;
-    for (unsigned long i = 1; i < joins_size; i++) {
-        if (_cmp_ulong_pair_wrapped(&joins[i - 1], &joins[i]) == 0) {
-            joins_to_stay[i] = false;
-        }
-        else {
-            joins_to_stay[i] = true;
-            joins_to_stay_count += 1;
-        }
-    }
-
-    // Remove duplicates
-    if (joins_to_stay_count != joins_size) {
-        joins_to_stay_insert_index = 0;
-        for (int i = 0; i < joins_size; i++) {
-            if (joins_to_stay[i]) {
-                joins[joins_to_stay_insert_index] = joins[i];
-                joins_to_stay_insert_index += 1;
+    long* longest = palloc(sizeof(*longest) * (s.size + 1));
+    long result;
+
+    // longest[i] is the greatest length of strings derived from the first i tokens
+    longest[0] = 0;
+    for (unsigned long i = 0; i < s.size; i++) {
+        long empty = 0;
+
+        longest[i + 1] = longest[i] + 1;
+        for (unsigned long j = matches->starts[i]; j < matches->starts[i + 1]; j++) {
+            const RuleMatch* match = &matches->matches[j];
+            if (match->a_f) {
+                longest[i + 1] = Max(longest[i + 1], longest[i] + (long)match->rule->full.size);
+            }
+            else if (match->rule->full.size == 0) {
+                empty = 1;
             }
             else {
-                pfree(joins[i]);
+                longest[i + 1] = Max(longest[i + 1], longest[i + 1 - match->rule->full.size] + 1);
             }
         }
-        joins = repalloc(joins, joins_to_stay_count);
-        *joins_ptr = joins;
+        longest[i + 1] += empty;
     }
 
-    return joins_to_stay_count;
+    result = longest[s.size];
+    pfree(longest);
+    return result;
 }
 
 
 /**
- * @brief Calculate pair rows to be joined
+ * @brief Extend strings derived from the first 'from' tokens of a row by 'count' tokens, as strings derived from the first 'to' tokens
  *
- * @param t1oid table 1 OID
- * @param t1col table 1 column name
+ * @param best table of '_derived_positions'
+ * @param less number of added tokens less than the token checked
+ * @param has_t whether the token checked is among added tokens
+ */
+static void
+_derived_step(long* best, long l_max, unsigned long from, unsigned long to, long count, long less, bool has_t)
+{
+    // Lengths are walked down, so that strings extended in place ('from' == 'to') are extended once
+    for (long l = l_max - count; l >= 0; l--) {
+        for (int present = 0; present < 2; present++) {
+            const long v = best[(from * (l_max + 1) + l) * 2 + present];
+            long* target = &best[(to * (l_max + 1) + l + count) * 2 + (present || has_t)];
+            if (v != LONG_MAX && v + less < *target) {
+                *target = v + less;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Calculate g-values of a token in strings derived from the whole row, for every length of them
  *
- * @param t2oid table 2 OID
- * @param t2col table 2 column name
+ * Unlike '_calculate_g', only strings derived from all tokens of the row are considered.
  *
- * @param tRoid rules table OID
- * @param tRcol_abbr rules table abbreviations column name
- * @param tRcol_full rules table full forms column name
+ * @param s all tokens of the row
+ * @param matches occurrences of rules' sides in 's'
+ * @param t token
+ * @param l_max greatest length of derived strings
+ * @param g array of 'l_max' elements to fill: g[l - 1] is the least position of 't' in strings of length l,
+ *      or -1 if 't' is in no such string
+ */
+static void
+_derived_positions(TokenSequence s, const RuleMatches* matches, const Token* t, long l_max, long* g)
+{
+    // best[(i * (l_max + 1) + l) * 2 + present] is the least number of tokens less than 't' in strings of
+    // length l derived from the first i tokens, which contain 't' or not; LONG_MAX if there are none
+    const Size size = (s.size + 1) * (l_max + 1) * 2;
+    long* best = palloc_extended(sizeof(*best) * size, MCXT_ALLOC_HUGE);
+
+    stat_g_evaluations++;
+    for (Size k = 0; k < size; k++) {
+        best[k] = LONG_MAX;
+    }
+    best[0] = 0;
+
+    for (unsigned long i = 0; i < s.size; i++) {
+        const int c = cmp_tokens(&s.ts[i], t);
+
+        _derived_step(best, l_max, i, i + 1, 1, c < 0 ? 1 : 0, c == 0);
+        for (unsigned long j = matches->starts[i]; j < matches->starts[i + 1]; j++) {
+            const Rule* rule = matches->matches[j].rule;
+            long less = 0;
+            bool has_t = false;
+
+            if (matches->matches[j].a_f) {
+                for (unsigned long k = 0; k < rule->full.size; k++) {
+                    const int c_full = cmp_tokens(&rule->full.ts[k], t);
+                    less += c_full < 0 ? 1 : 0;
+                    has_t = has_t || c_full == 0;
+                }
+                _derived_step(best, l_max, i, i + 1, rule->full.size, less, has_t);
+            }
+            else if (rule->full.size > 0) {
+                const int c_abbr = cmp_tokens(&rule->abbr, t);
+                _derived_step(best, l_max, i + 1 - rule->full.size, i + 1, 1, c_abbr < 0 ? 1 : 0, c_abbr == 0);
+            }
+        }
+        // Empty full forms add an abbreviation after the token, once
+        for (unsigned long j = matches->starts[i]; j < matches->starts[i + 1]; j++) {
+            const Rule* rule = matches->matches[j].rule;
+            if (!matches->matches[j].a_f && rule->full.size == 0) {
+                const int c_abbr = cmp_tokens(&rule->abbr, t);
+                _derived_step(best, l_max, i + 1, i + 1, 1, c_abbr < 0 ? 1 : 0, c_abbr == 0);
+            }
+        }
+    }
+
+    for (long l = 1; l <= l_max; l++) {
+        const long v = best[(s.size * (l_max + 1) + l) * 2 + 1];
+        g[l - 1] = v == LONG_MAX ? -1 : v;
+    }
+    pfree(best);
+}
+
+
+/**
+ * @brief Calculate g-values of U-signature tokens in strings derived from the whole row, for positional filter
  *
- * @param exactness
+ * @param u U-signature of the row; its g-values are set
+ * @param s all tokens of the row
+ * @param matches occurrences of rules' sides in 's'
+ */
+static void
+_u_signature_positions(USignature* u, TokenSequence s, const RuleMatches* matches)
+{
+    u->l_max = _derived_length_max(s, matches);
+    u->g = palloc_extended(sizeof(*u->g) * Max(u->tokens.size * u->l_max, 1), MCXT_ALLOC_HUGE);
+    for (unsigned long k = 0; k < u->tokens.size; k++) {
+        _derived_positions(s, matches, &u->tokens.ts[k], u->l_max, &u->g[k * u->l_max]);
+    }
+}
+
+
+/**
+ * @brief Rules prepared for signature calculation
+ */
+typedef struct {
+    RuleSequence rules;
+    /// Finds rules applicable to rows
+    RuleMatcher matcher;
+    RuleIndex index;
+    /// Length of longest full form among all rules
+    unsigned long longest_rule_length;
+} PreparedRules;
+
+
+/**
+ * @brief Prepare rules of a RuleSet for signature calculation
  *
- * @param rescontext context to allocate result StringPairRows content in
+ * @param rs rule set; the result refers to it
+ */
+static PreparedRules
+_prepared_rules_build(const RuleSet* rs)
+{
+    PreparedRules result;
+
+    result.rules = _rules_from_ruleset(rs);
+    result.longest_rule_length = 0;
+    for (unsigned long i = 0; i < result.rules.size; i++) {
+        result.longest_rule_length = Max(result.longest_rule_length, result.rules.rs[i].full.size);
+    }
+    result.matcher = _rule_matcher_build(&result.rules);
+    result.index = _rule_index_build(&result.rules);
+    return result;
+}
+
+
+/**
+ * @brief Make FilterRow of a row, with its U-signature
  *
- * @return StringPairRows
+ * @param reachable calculate tokens reachable by rules as well, for suffix filter
  */
-static StringPairRows
-_do_calc_pairs(Oid t1oid, const char* t1col, Oid t2oid, const char* t2col, Oid tRoid, const char* tRcol_abbr, const char* tRcol_full, double exactness, MemoryContext rescontext)
+static FilterRow
+_filter_row_prepare(const char* row, double exactness, const PreparedRules* rules, bool reachable)
 {
-    char* t1;
-    char* t2;
-    char* tR;
+    FilterRow result = _filter_row_build(row, exactness);
+    const TokenSequence seq_u = {result.prefix_size, result.tokens.ts};
+    RuleMatches matches = _rule_matcher_run(&rules->matcher, seq_u);
+
+    result.u_signature = _u_signature_build(seq_u, &matches, &rules->index, rules->longest_rule_length, exactness);
+    // Matches are only needed to build the U-signature and its g-values
+    _rule_matches_free(&matches);
+    if (result.u_signature.tokens.size > 0) {
+        matches = _rule_matcher_run(&rules->matcher, result.tokens);
+        _u_signature_positions(&result.u_signature, result.tokens, &matches);
+        _rule_matches_free(&matches);
+    }
+    if (reachable) {
+        result.reachable = _reachable_tokens(result.tokens, &rules->index);
+    }
+    return result;
+}
 
-    char query[4096];
 
-    char** rows[2];
-    TokenSequence* rows_signatures[2];
-    unsigned long rows_used[2] = {0, 0};
+/**
+ * @brief Make FilterRow of every row, with its U-signature; and tokens reachable by rules, when suffix filter is on
+ *
+ * @param longest_row_length set to the number of tokens in the longest row
+ */
+static FilterRow*
+_filter_rows_build(char* const* rows, unsigned long size, double exactness, const PreparedRules* rules, unsigned long* longest_row_length)
+{
+    FilterRow* result = palloc(sizeof(*result) * Max(size, 1));
+
+    *longest_row_length = 0;
+    for (unsigned long i = 0; i < size; i++) {
+        result[i] = _filter_row_prepare(rows[i], exactness, rules, mipt_asj_suffix_filter);
+        *longest_row_length = Max(*longest_row_length, result[i].tokens.size);
+        elog(DEBUG1, "Prefix signature for row %lu is %lu tokens long", i, result[i].prefix_size);
+    }
+    return result;
+}
 
-    RuleSequence rules = {0, NULL};
-    // Length of longest full form among all rules
-    unsigned long longest_rule_length = 0;
 
-    unsigned long** joins;
-    unsigned long joins_used = 0;
+/**
+ * @brief What is returned for every pair of joined rows
+ */
+typedef enum {
+    /// Strings themselves
+    CALC_PAIRS_OUTPUT_STRINGS,
+    /// 'ctid' of both rows
+    CALC_PAIRS_OUTPUT_TIDS,
+    /// Values of user-specified key columns of both rows
+    CALC_PAIRS_OUTPUT_KEYS
+} CalcPairsOutput;
 
-    StringPairRows results;
 
-    MemoryContext oldcontext;
+/**
+ * @brief Result of calc_pairs
+ */
+typedef struct {
+    CalcPairsOutput output;
+    /// Rows of tables 1 and 2; pairs refer to them by index
+    TextRows rows[2];
+    /**
+     * Pairs (rows[0] index, rows[1] index), packed by 'hashset_pack_pair', as INT8 datums.
+     * Sorted; the same pair may appear several times in a row.
+     * Spilled to temporary files when larger than 'work_mem'
+     */
+    Tuplesortstate* joins;
+    /// Rows read, pairs whose signatures intersect, and pairs which passed the filters
+    unsigned long rows_scanned;
+    unsigned long candidates;
+    unsigned long verified;
+} CalcPairsResult;
+
 
+/**
+ * @brief Start a sort of packed pairs, bounded by 'work_mem'
+ */
+static Tuplesortstate*
+_joins_sort_begin(void)
+{
+#if PG_VERSION_NUM >= 150000
+    return tuplesort_begin_datum(INT8OID, Int8LessOperator, InvalidOid, false, work_mem, NULL, TUPLESORT_NONE);
+#else
+    return tuplesort_begin_datum(INT8OID, Int8LessOperator, InvalidOid, false, work_mem, NULL, false);
+#endif
+}
 
-    // Process call parameters
 
-    t1 = get_table_name_by_oid(t1oid);
-    t2 = get_table_name_by_oid(t2oid);
-    tR = get_table_name_by_oid(tRoid);
+/**
+ * @brief Whether one more key in 'set' would make it grow over 'work_mem'
+ */
+static bool
+_hashset_is_full(const HashSet* set)
+{
+    return (set->size + 1) * 2 > set->capacity && sizeof(*set->slots) * set->capacity * 2 > (Size)work_mem * 1024L;
+}
 
 
-    // Fill rows
+/**
+ * @brief Copy arrays of 'rows'; strings are not copied
+ */
+static TextRows
+_text_rows_copy(const TextRows* rows)
+{
+    TextRows result = *rows;
 
-    sprintf(query, "SELECT %s FROM %s;", t1col, t1);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT rows from table '%s' (OID %d).", t1, t1oid);
+    result.values = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*result.values) * Max(rows->size * rows->ncolumns, 1));
+    memcpy(result.values, rows->values, sizeof(*result.values) * rows->size * rows->ncolumns);
+    if (rows->tids != NULL) {
+        result.tids = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*result.tids) * Max(rows->size, 1));
+        memcpy(result.tids, rows->tids, sizeof(*result.tids) * rows->size);
     }
-    elog(INFO, "Processing %d rows in first source...", SPI_processed);
-    rows[0] = palloc(sizeof(*rows[0]) * SPI_processed);
-    for (uint32 i = 0; i < SPI_processed; i++) {
-        char* row = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
-        if (row == NULL) {
-            continue;
-        }
-        rows[0][rows_used[0]++] = row;
+    if (rows->keys != NULL) {
+        result.keys = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*result.keys) * Max(rows->size, 1));
+        memcpy(result.keys, rows->keys, sizeof(*result.keys) * rows->size);
     }
-    SPI_freetuptable(SPI_tuptable);
+    return result;
+}
+
+
+/**
+ * @brief Keep only rows of 'rows' that belong to partition 'remainder' of 'modulus'
+ *
+ * A row belongs to the partition its key (when 'rows' has keys) or its string hashes into.
+ * The order of kept rows is preserved.
+ */
+static void
+_filter_partition(TextRows* rows, int modulus, int remainder)
+{
+    unsigned long kept = 0;
 
-    sprintf(query, "SELECT %s FROM %s;", t2col, t2);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT rows from table '%s' (OID %d).", t2, t2oid);
+    if (modulus == 1) {
+        return;
     }
-    elog(INFO, "Processing %d rows in second source...", SPI_processed);
-    rows[1] = palloc(sizeof(*rows[1]) * SPI_processed);
-    for (uint32 i = 0; i < SPI_processed; i++) {
-        char* row = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
-        if (row == NULL) {
+    for (unsigned long i = 0; i < rows->size; i++) {
+        uint64 hash = rows->keys != NULL ?
+            hash_bytes_extended((const unsigned char*)&rows->keys[i], sizeof(rows->keys[i]), 0) :
+            hash_bytes_extended((const unsigned char*)rows->values[i], strlen(rows->values[i]), 0);
+        if (hash % (uint64)modulus != (uint64)remainder) {
             continue;
         }
-        rows[1][rows_used[1]++] = row;
+        rows->values[kept] = rows->values[i];
+        if (rows->tids != NULL) {
+            ItemPointerCopy(&rows->tids[i], &rows->tids[kept]);
+        }
+        if (rows->keys != NULL) {
+            rows->keys[kept] = rows->keys[i];
+        }
+        kept++;
     }
-    SPI_freetuptable(SPI_tuptable);
+    rows->size = kept;
+}
 
 
-    // Fill rules
+/**
+ * @brief Check whether a pair of rows may be joined, by the prefix signature of 'x' and the U-signature of 'y'
+ *
+ * Every common token (at position p of x) is also checked by positional filter. If the token is at
+ * position g of a string of length l derived from the whole y, their overlap is at most
+ *      min(p, g) + 1 + min(|x| - p - 1, l - g - 1),
+ * and must not be less than the overlap required for their Jaccard similarity to reach 'exactness'.
+ * g is not less than the g-value of the token for length l, and the bound is the largest when g = max(p, g-value).
+ *
+ * Suffix filter additionally checks the pair by the number of tokens of x that may appear in a string
+ * derived from y: it is at least the overlap required for their Jaccard similarity to reach 'exactness'.
+ *
+ * @param suffix_reachable buffer of at least |x| elements when suffix filter is on; NULL otherwise
+ * @param candidate if not NULL, set to whether the signatures intersect (whatever positional and suffix filters say)
+ */
+static bool
+_filter_pair(const FilterRow* x, const FilterRow* y, double exactness, long* suffix_reachable, bool* candidate)
+{
+    const long x_size = x->tokens.size;
+    const USignature* u = &y->u_signature;
+    bool passed = false;
 
-    sprintf(query, "SELECT %s, %s FROM %s;", tRcol_abbr, tRcol_full, tR);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT rows from table '%s' (OID %d).", tR, tRoid);
-    }
-    elog(INFO, "%d rules found, processing...", SPI_processed);
-    rules.rs = palloc(sizeof(*rules.rs) * SPI_processed);
-    for (uint32 i = 0; i < SPI_processed; i++) {
-        char* temp[2];
-        TokenSequence rule_full_seq;
-        temp[0] = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
-        temp[1] = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2);
-        if (temp[0] == NULL || temp[1] == NULL) {
+    if (candidate != NULL) {
+        *candidate = false;
+    }
+    for (unsigned long p = 0; p < x->prefix_size && !passed; p++) {
+        const long u_k = _tokens_find(u->tokens, &x->tokens.ts[p]);
+        if (u_k < 0) {
             continue;
         }
-        rules.rs[rules.size] = palloc(sizeof(rules.rs[rules.size]) * 2);
-        for (unsigned char j = 0; j < 2; j++) {
-            rules.rs[rules.size][j] = temp[j];
+        if (candidate != NULL) {
+            *candidate = true;
+        }
+        for (long l = 1; l <= u->l_max && !passed; l++) {
+            const long g = u->g[u_k * u->l_max + l - 1];
+            passed = g >= 0 &&
+                (long)p + 1 + Min(x_size - (long)p - 1, l - Max((long)p, g) - 1) >= _required_pair_overlap(x_size, l, exactness);
         }
-        rules.size += 1;
-        rule_full_seq = tokenize(temp[1], " ");
-        longest_rule_length = Max(longest_rule_length, rule_full_seq.size);
     }
-    SPI_freetuptable(SPI_tuptable);
+    if (!passed || suffix_reachable == NULL) {
+        return passed;
+    }
 
+    // All tokens shared with a derived string are at or after the first reachable one
+    _suffix_reachable(x, y, suffix_reachable);
+    for (unsigned long p = 0; p < x->tokens.size; p++) {
+        if (suffix_reachable[p] >= 0) {
+            return 1 + suffix_reachable[p] >= _required_overlap(x->tokens.size, exactness);
+        }
+    }
+    return false;
+}
 
-    // Calculate prefix signatures for every row
 
-    elog(INFO, "Calculating prefix signatures...");
+/**
+ * @brief Calculate pair rows to be joined
+ *
+ * @param t_sources sources of rows 1 and 2; keys are used with CALC_PAIRS_OUTPUT_KEYS only
+ *
+ * @param tRoid rules table OID
+ * @param tRcol_abbr rules table abbreviations column name
+ * @param tRcol_full rules table full forms column name
+ *
+ * @param exactness
+ *
+ * @param output what to return for every pair
+ *
+ * @param modulus, remainder partition of rows of table 1 to process; see '_filter_partition'
+ *
+ * @param unordered return every unordered pair once, and no pairs of a row with itself
+ *      (with CALC_PAIRS_OUTPUT_STRINGS, no pairs of equal strings); self-join only
+ *
+ * @return CalcPairsResult
+ */
+static CalcPairsResult
+_do_calc_pairs(const ScanSource t_sources[2], Oid tRoid, const char* tRcol_abbr, const char* tRcol_full, double exactness, CalcPairsOutput output, int modulus, int remainder, bool unordered)
+{
+    // Both sources give the same rows; they are read once
+    const bool same_source = scan_source_equal(&t_sources[0], &t_sources[1], 1);
+    // Both sources are the same rows. Then both directions of the candidate search are
+    // the same as well: rows and signatures are prepared once, and only one direction is searched
+    const bool self_join = same_source && modulus == 1;
+    // Number of distinct sources
+    const unsigned char sources = self_join ? 1 : 2;
+
+    TextRows t_rows[2];
+    char** rows[2];
+    FilterRow* filter_rows[2];
+    unsigned long rows_used[2] = {0, 0};
+    // Number of tokens in the longest row
+    unsigned long longest_row_length = 0;
+
+    PreparedRules rules;
+
+    // Suffix filter state: see '_suffix_reachable'
+    long* suffix_reachable = NULL;
+
+    // Pairs (rows[0] index, rows[1] index), packed by 'hashset_pack_pair'. Not deduplicated
+    Tuplesortstate* joins;
+    // Pairs known to be joined; only used to skip checks, so it stops growing at 'work_mem'
+    HashSet joins_known;
+    bool joins_known_full = false;
+
+    CalcPairsResult results;
+
+    results.rows_scanned = 0;
+    results.candidates = 0;
+    results.verified = 0;
+
+
+    // Fill rows
+
+    if (unordered && !self_join) {
+        ereport(ERROR, (
+            errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+            errmsg("Unordered pairs can only be calculated for the same table and column, without partitions")
+        ));
+    }
     for (unsigned char j = 0; j < 2; j++) {
-        rows_signatures[j] = palloc(sizeof(*rows_signatures[j]) * rows_used[j]);
-        for (unsigned long i = 0; i < rows_used[j]; i++) {
-            rows_signatures[j][i] = _prefix_sig(rows[j][i], exactness);
-            elog(DEBUG1, "Prefix signature for rows[%u][%lu] is %lu tokens long", j, i, rows_signatures[j][i].size);
+        const ScanRowId row_id =
+            output == CALC_PAIRS_OUTPUT_TIDS ? SCAN_ROW_ID_TID :
+            output == CALC_PAIRS_OUTPUT_KEYS ? SCAN_ROW_ID_KEY :
+            SCAN_ROW_ID_NONE;
+        if (j == 1 && self_join) {
+            t_rows[j] = t_rows[0];
+            rows[j] = rows[0];
+            rows_used[j] = rows_used[0];
+            break;
         }
+        // The same source is not read again (a cursor can not be); its rows are copied before partitioning
+        if (j == 0 || !same_source) {
+            t_rows[j] = scan_source(&t_sources[j], 1, row_id);
+            results.rows_scanned += t_rows[j].size;
+        }
+        // Every pair is found from its rows[0] row, so partitions of rows[0] give disjoint pair sets
+        if (j == 0) {
+            if (same_source && !self_join) {
+                t_rows[1] = _text_rows_copy(&t_rows[0]);
+            }
+            _filter_partition(&t_rows[j], modulus, remainder);
+        }
+        elog(INFO, "Processing %lu rows in %s source...", t_rows[j].size, j == 0 ? "first" : "second");
+        rows[j] = t_rows[j].values;
+        rows_used[j] = t_rows[j].size;
+    }
+
+
+    // Fill rules
+
+    rules = _prepared_rules_build(ruleset_get(tRoid, tRcol_abbr, tRcol_full, CurrentMemoryContext));
+    elog(INFO, "%lu rules found, processing...", rules.rules.size);
+
+
+    // Calculate prefix signatures and U-signatures for every row
+
+    elog(INFO, "Calculating prefix signatures...");
+    filter_rows[1] = NULL;
+    for (unsigned char j = 0; j < sources; j++) {
+        unsigned long longest;
+        filter_rows[j] = _filter_rows_build(rows[j], rows_used[j], exactness, &rules, &longest);
+        longest_row_length = Max(longest_row_length, longest);
+    }
+    if (self_join) {
+        filter_rows[1] = filter_rows[0];
+    }
+    if (mipt_asj_suffix_filter) {
+        suffix_reachable = palloc(sizeof(*suffix_reachable) * Max(longest_row_length, 1));
     }
 
 
     // Calculate joins
 
     elog(INFO, "Calculating joins...");
-    joins = palloc(sizeof(*joins) * rows_used[0] * rows_used[1] * 2);
-    for (unsigned long i = 0; i < rows_used[0] * rows_used[1] * 2; i++) {
-        joins[i] = palloc(sizeof(*joins[i]) * 2);
-    }
+    joins = _joins_sort_begin();
+    hashset_init(&joins_known, Max(rows_used[0], rows_used[1]));
 
     // 1. Check if prefix signature of every row from rows[0] intersects with U-signature of any row from rows[1]
     // 2. Do the same, but for rows[1] and rows[0], respectively
-    for (unsigned char j = 0; j < 2; j++) {
+    //
+    // In self-join, only the first direction is searched, and pairs are known by their (lesser, greater) indexes:
+    // a pair is found if either of its rows has a candidate in the other one.
+    for (unsigned char j = 0; j < sources; j++) {
         const unsigned char ROW_PF_INDEX = j;
         const unsigned char ROW_U_INDEX = 1 - j;
 
         for (unsigned long pf_i = 0; pf_i < rows_used[ROW_PF_INDEX]; pf_i++) {
+            const FilterRow* x = &filter_rows[ROW_PF_INDEX][pf_i];
+
             for (unsigned long u_i = 0; u_i < rows_used[ROW_U_INDEX]; u_i++) {
-                TokenSequence seq = rows_signatures[ROW_PF_INDEX][pf_i];
-                TokenSequence seq_u = rows_signatures[ROW_U_INDEX][u_i];
+                const FilterRow* y = &filter_rows[ROW_U_INDEX][u_i];
+                const uint64 join =
+                    self_join ? hashset_pack_pair(Min(pf_i, u_i), Max(pf_i, u_i)) :
+                    ROW_PF_INDEX == 0 ? hashset_pack_pair(pf_i, u_i) :
+                    hashset_pack_pair(u_i, pf_i);
+                bool candidate;
+                bool passed;
+
+                if (unordered && pf_i == u_i) {
+                    continue;
+                }
+                // Rows with equal strings would make a pair of a string with itself
+                if (unordered && output == CALC_PAIRS_OUTPUT_STRINGS && strcmp(rows[0][pf_i], rows[0][u_i]) == 0) {
+                    continue;
+                }
+                // This pair is already known to be joined
+                if (hashset_contains(&joins_known, join)) {
+                    continue;
+                }
                 elog(
                     DEBUG1,
                     "====== Calculating g() for [%u][%lu] (token source) and [%u][%lu] (sequence) ======",
                     ROW_PF_INDEX, pf_i, ROW_U_INDEX, u_i
                 );
-                for (unsigned long token_i = 0; token_i < seq.size; token_i++) {
-                    const char* token = seq.ts[token_i];
-                    for (long l = seq_u.size + longest_rule_length; l > 0; l--) {
-                        bool t_present = false;
-                        long g = _calculate_g(seq_u, seq_u.size - 1, l, token, &t_present, rules);
-                        elog(DEBUG1, "=== g = %ld; _psl = %lu ===", g, _prefix_sig_length(l, exactness));
-                        if (t_present && (g + 1 <= _prefix_sig_length(l, exactness))) {
-                            elog(DEBUG1, "=== [%u][%lu] ~=~ [%u][%lu] ===", ROW_PF_INDEX, pf_i, ROW_U_INDEX, u_i);
-                            joins[joins_used][ROW_PF_INDEX] = pf_i;
-                            joins[joins_used][ROW_U_INDEX] = u_i;
-                            joins_used += 1;
-                            // Break cycle
-                            token_i = seq.size;
-                            break;
-                        }
+                passed = _filter_pair(x, y, exactness, suffix_reachable, &candidate);
+                results.candidates += candidate ? 1 : 0;
+                if (passed) {
+                    elog(DEBUG1, "=== [%u][%lu] ~=~ [%u][%lu] ===", ROW_PF_INDEX, pf_i, ROW_U_INDEX, u_i);
+                    results.verified += 1;
+                    tuplesort_putdatum(joins, Int64GetDatum((int64)join), false);
+                    if (self_join && !unordered && pf_i != u_i) {
+                        const uint64 mirror = hashset_pack_pair(Max(pf_i, u_i), Min(pf_i, u_i));
+                        tuplesort_putdatum(joins, Int64GetDatum((int64)mirror), false);
+                    }
+                    if (!joins_known_full) {
+                        joins_known_full = _hashset_is_full(&joins_known);
+                    }
+                    if (!joins_known_full) {
+                        hashset_insert(&joins_known, join);
                     }
                 }
             }
@@ -521,92 +1447,519 @@ _do_calc_pairs(Oid t1oid, const char* t1col, Oid t2oid, const char* t2col, Oid t
     }
 
 
-    // Remove duplicate joins
+    // Order joins; duplicates are removed when they are returned
 
-    elog(INFO, "Removing duplicates...");
-    joins_used = _remove_duplicate_joins(&joins, joins_used);
+    hashset_free(&joins_known);
+    tuplesort_performsort(joins);
 
+    results.output = output;
+    results.rows[0] = t_rows[0];
+    results.rows[1] = t_rows[1];
+    results.joins = joins;
+    return results;
+}
 
-    // Build 'results' and return
 
-    oldcontext = MemoryContextSwitchTo(rescontext);
-    results.size = joins_used;
-    results.read = 0;
-    results.pairs = palloc(sizeof(*results.pairs) * results.size);
-    for (unsigned long i = 0; i < joins_used; i++) {
-        results.pairs[i] = palloc(sizeof(*results.pairs[results.read]) * 2);
+
+/**
+ * @brief Return CalcPairsResult from a set-returning function in materialize mode
+ *
+ * Every pair is returned once. The result tuplestore spills to disk on its own
+ * when larger than 'work_mem'. 'result->joins' is ended.
+ */
+static void
+_calc_pairs_materialize(FunctionCallInfo fcinfo, CalcPairsResult* result)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    Datum join_datum;
+    bool join_isnull;
+    uint64 previous = 0;
+    bool first = true;
+
+#if PG_VERSION_NUM >= 160000
+    InitMaterializedSRF(fcinfo, 0);
+#else
+    SetSingleFuncCall(fcinfo, 0);
+#endif
+
+#if PG_VERSION_NUM >= 160000
+    while (tuplesort_getdatum(result->joins, true, false, &join_datum, &join_isnull, NULL)) {
+#else
+    while (tuplesort_getdatum(result->joins, true, &join_datum, &join_isnull, NULL)) {
+#endif
+        const uint64 join_packed = (uint64)DatumGetInt64(join_datum);
+        uint32 join[2];
+
+        // Sort-merge deduplication: equal pairs are adjacent
+        if (!first && join_packed == previous) {
+            continue;
+        }
+        first = false;
+        previous = join_packed;
+
+        hashset_unpack_pair(join_packed, &join[0], &join[1]);
         for (unsigned char j = 0; j < 2; j++) {
-            results.pairs[i][j] = palloc(strlen(rows[j][joins[i][j]]) + 1);
-            strcpy(results.pairs[i][j], rows[j][joins[i][j]]);
+            switch (result->output) {
+                case CALC_PAIRS_OUTPUT_STRINGS:
+                    values[j] = CStringGetTextDatum(result->rows[j].values[join[j]]);
+                    break;
+                case CALC_PAIRS_OUTPUT_TIDS:
+                    values[j] = PointerGetDatum(&result->rows[j].tids[join[j]]);
+                    break;
+                case CALC_PAIRS_OUTPUT_KEYS:
+                    values[j] = Int64GetDatum(result->rows[j].keys[join[j]]);
+                    break;
+            }
+        }
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        if (result->output == CALC_PAIRS_OUTPUT_STRINGS) {
+            pfree(DatumGetPointer(values[0]));
+            pfree(DatumGetPointer(values[1]));
         }
     }
+
+    tuplesort_end(result->joins);
+    result->joins = NULL;
+}
+
+
+/**
+ * @brief calc_pairs SRF, common for all output kinds
+ *
+ * Parameters are the same as of 'calc_pairs', except for CALC_PAIRS_OUTPUT_KEYS,
+ * where each table column name is followed by a key column name.
+ * Every source of rows is either a table and its column(s), or a query or a cursor;
+ * see 'scan_source_from_args'.
+ */
+static Datum
+_calc_pairs_srf(FunctionCallInfo fcinfo, CalcPairsOutput output)
+{
+    // Function call parameters
+    ScanSource t_sources[2];
+    int arg = 0;
+    Oid tRoid;
+    char* tRcol_full;
+    char* tRcol_abbr;
+    double exactness;
+    int modulus;
+    int remainder;
+    bool unordered;
+
+    CalcPairsResult calculated;
+    MemoryContext workcontext;
+    MemoryContext oldcontext;
+    StatCall stat;
+
+    stat_call_start(&stat);
+
+    // Load call parameters
+    for (int j = 0; j < 2; j++) {
+        arg = scan_source_from_args(fcinfo, arg, output == CALC_PAIRS_OUTPUT_KEYS, &t_sources[j]);
+    }
+    tRoid = PG_GETARG_OID(arg);
+    tRcol_full = get_text_parameter(PG_GETARG_TEXT_P(arg + 1));
+    tRcol_abbr = get_text_parameter(PG_GETARG_TEXT_P(arg + 2));
+    exactness = PG_GETARG_FLOAT4(arg + 3);
+    modulus = PG_NARGS() > arg + 4 ? PG_GETARG_INT32(arg + 4) : 1;
+    remainder = PG_NARGS() > arg + 5 ? PG_GETARG_INT32(arg + 5) : 0;
+    unordered = PG_NARGS() > arg + 6 ? PG_GETARG_BOOL(arg + 6) : false;
+    if (modulus <= 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Partition modulus must be positive")));
+    }
+    if (remainder < 0 || remainder >= modulus) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Partition remainder must be in range [0; %d)", modulus)));
+    }
+
+    // Calculate pairs and return them. Temporary data is released afterwards
+    workcontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj calc_pairs", ALLOCSET_DEFAULT_SIZES);
+    oldcontext = MemoryContextSwitchTo(workcontext);
+    calculated = _do_calc_pairs(
+        t_sources, tRoid, tRcol_abbr, tRcol_full, exactness,
+        output, modulus, remainder, unordered
+    );
+    _calc_pairs_materialize(fcinfo, &calculated);
     MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(workcontext);
 
-    return results;
+    stat.counters.rows = calculated.rows_scanned;
+    stat.counters.candidates = calculated.candidates;
+    stat.counters.verified = calculated.verified;
+    stat_call_finish(&stat, STAT_CALC_PAIRS);
+
+    return (Datum)0;
 }
 
 
 Datum
 calc_pairs(PG_FUNCTION_ARGS)
 {
+    return _calc_pairs_srf(fcinfo, CALC_PAIRS_OUTPUT_STRINGS);
+}
+
+
+Datum
+calc_pairs_tid(PG_FUNCTION_ARGS)
+{
+    return _calc_pairs_srf(fcinfo, CALC_PAIRS_OUTPUT_TIDS);
+}
+
+
+Datum
+calc_pairs_key(PG_FUNCTION_ARGS)
+{
+    return _calc_pairs_srf(fcinfo, CALC_PAIRS_OUTPUT_KEYS);
+}
+
+
+/**
+ * @brief Rules given as a value made by 'ruleset', prepared for signature calculation
+ */
+typedef struct {
+    /// Hash and size of the value; identify it
+    uint64 version;
+    Size ruleset_size;
+    /// Value the rules were last found to be made of
+    const struct varlena* value;
+    /// The value is the same for every call: it is not checked
+    bool value_stable;
+    PreparedRules prepared;
+} SignatureRules;
+
+
+/**
+ * @brief Get rules for this call of 'pkduck_signature'
+ *
+ * The value is usually the same for the whole query; it is checked and prepared once then.
+ * A constant value (or a parameter of the query) is not checked afterwards; other values are
+ * hashed only when they are not the one (in the same place) checked by the previous call.
+ *
+ * @param argno number of the argument holding the value
+ */
+static const SignatureRules*
+_get_signature_rules(FunctionCallInfo fcinfo, int argno)
+{
+    SignatureRules* rules = (SignatureRules*)fcinfo->flinfo->fn_extra;
+    const struct varlena* value;
     MemoryContext oldcontext;
+    const RuleSet* rs;
 
-    FuncCallContext *funcctx;
-    TupleDesc tupdesc;
-    Datum result;
-    StringPairRows* pairs;
+    if (rules != NULL && rules->value_stable) {
+        return rules;
+    }
+    value = PG_GETARG_VARLENA_P(argno);
 
-    if (SRF_IS_FIRSTCALL())
-    {
-        // Function call parameters
-        Oid t1oid;
-        Oid t2oid;
-        Oid tRoid;
-        char* t1col;
-        char* t2col;
-        char* tRcol_full;
-        char* tRcol_abbr;
-        double exactness;
-
-        StringPairRows calculated;
-
-        // Initialize funcctx
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
-            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function returning record called in context that cannot accept type record")));
-        }
-        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
-        funcctx->user_fctx = palloc(sizeof(StringPairRows));
-
-        // Load call parameters
-        t1oid = PG_GETARG_OID(0);
-        t1col = get_text_parameter(PG_GETARG_TEXT_P(1));
-        t2oid = PG_GETARG_OID(2);
-        t2col = get_text_parameter(PG_GETARG_TEXT_P(3));
-        tRoid = PG_GETARG_OID(4);
-        tRcol_full = get_text_parameter(PG_GETARG_TEXT_P(5));
-        tRcol_abbr = get_text_parameter(PG_GETARG_TEXT_P(6));
-        exactness = PG_GETARG_FLOAT8(7);
-
-        // Calculate abbreviation dictionary
-        SPI_connect();
-        calculated = _do_calc_pairs(t1oid, t1col, t2oid, t2col, tRoid, tRcol_abbr, tRcol_full, exactness, funcctx->multi_call_memory_ctx);
-        SPI_finish();
-        *(StringPairRows*)funcctx->user_fctx = calculated;
+    // The value is identified by its hash, not by 'version' it claims
+    if (rules != NULL && rules->ruleset_size == VARSIZE(value) &&
+            (rules->value == value || rules->version == ruleset_value_hash(value))) {
+        rules->value = value;
+        return rules;
+    }
+
+    // Old rules (if any) are left in 'fn_mcxt' until the end of the query
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    rs = ruleset_from_value(value);
+    rules = palloc(sizeof(*rules));
+    rules->version = rs->version;
+    rules->ruleset_size = VARSIZE(rs);
+    rules->value = value;
+    rules->value_stable = get_fn_expr_arg_stable(fcinfo->flinfo, argno);
+    rules->prepared = _prepared_rules_build(rs);
+    MemoryContextSwitchTo(oldcontext);
+
+    fcinfo->flinfo->fn_extra = rules;
+    return rules;
+}
+
+
+Datum
+pkduck_signature(PG_FUNCTION_ARGS)
+{
+    char* string;
+    const SignatureRules* rules;
+    double exactness;
+    bool prefix_only;
+
+    FilterRow row;
+    TokenSequence signature;
+    Datum* elements;
+    unsigned long size = 0;
+
+    string = get_text_parameter(PG_GETARG_TEXT_P(0));
+    rules = _get_signature_rules(fcinfo, 1);
+    exactness = PG_GETARG_FLOAT4(2);
+    prefix_only = PG_NARGS() > 3 ? PG_GETARG_BOOL(3) : false;
+
+    row = _filter_row_build(string, exactness);
+    signature = (TokenSequence){row.prefix_size, row.tokens.ts};
+    if (!prefix_only) {
+        const RuleMatches matches = _rule_matcher_run(&rules->prepared.matcher, signature);
+        signature = _u_signature_build(signature, &matches, &rules->prepared.index, rules->prepared.longest_rule_length, exactness).tokens;
+    }
+
+    // Tokens are SORTED; prefix signature may contain repeated ones
+    elements = palloc(sizeof(*elements) * Max(signature.size, 1));
+    for (unsigned long i = 0; i < signature.size; i++) {
+        if (size > 0 && tokens_equal(&signature.ts[i - 1], &signature.ts[i])) {
+            continue;
+        }
+        elements[size++] = PointerGetDatum(cstring_to_text_with_len(signature.ts[i].s, signature.ts[i].len));
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(elements, size, TEXTOID, -1, false, TYPALIGN_INT));
+}
+
+
+/**
+ * @brief Result of estimate_pairs; see SQL definition
+ */
+typedef struct {
+    /// Rows (where the column is not NULL) of tables 1 and 2
+    unsigned long rows[2];
+    /// Rows in samples of tables 1 and 2
+    unsigned long sampled[2];
+    /// Estimated number of pairs whose signatures intersect
+    double candidates;
+    /// Estimated number of pairs returned by calc_pairs
+    double pairs;
+    double seconds;
+    /// Estimated memory for rows and their signatures, in bytes
+    double memory;
+    /// Rows read, and pairs of sampled rows which are candidates and which passed the filters
+    unsigned long rows_scanned;
+    unsigned long sampled_candidates;
+    unsigned long sampled_pairs;
+} EstimatePairsResult;
+
+
+/**
+ * @brief Seconds passed since 'start'
+ */
+static double
+_seconds_since(instr_time start)
+{
+    instr_time now;
 
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, start);
+    return INSTR_TIME_GET_DOUBLE(now);
+}
+
+
+/**
+ * @brief Estimate what calc_pairs would do, by a random sample of rows
+ *
+ * Sampled rows are checked pairwise exactly as calc_pairs checks them; pair counts are then
+ * scaled by inverse probabilities of pairs to be sampled, and times and memory by the number of
+ * rows or checks calc_pairs does. All rules are used, as the share of candidates found through
+ * a rule does not scale with the share of rules.
+ *
+ * Parameters are the same as of '_do_calc_pairs'.
+ *
+ * @param fraction probability of a row to be sampled
+ */
+static EstimatePairsResult
+_do_estimate_pairs(const Oid t_oids[2], const char* const t_cols[2], Oid tRoid, const char* tRcol_abbr, const char* tRcol_full, double exactness, double fraction)
+{
+    // The same rows are sampled once, as calc_pairs reads them once
+    const bool self_join = t_oids[0] == t_oids[1] && strcmp(t_cols[0], t_cols[1]) == 0;
+    const unsigned char sources = self_join ? 1 : 2;
+
+    EstimatePairsResult result;
+    TextRows t_rows[2];
+    FilterRow* filter_rows[2];
+    unsigned long longest_row_length = 0;
+    PreparedRules rules;
+    long* suffix_reachable = NULL;
+
+    // Share of rows of every source in its sample
+    double shares[2];
+    // Pairs of sampled rows (different and the same rows in self-join) that are candidates and are joined
+    double candidates[2] = {0, 0};
+    double pairs[2] = {0, 0};
+    double checks = 0;
+    // Checks done by calc_pairs
+    double checks_total;
+
+    double seconds_fixed;
+    double seconds_rows;
+    double seconds_checks;
+    instr_time start;
+
+    // Sample rows; the scan itself reads whole tables, as calc_pairs does
+
+    result.rows_scanned = 0;
+    INSTR_TIME_SET_CURRENT(start);
+    for (unsigned char j = 0; j < sources; j++) {
+        t_rows[j] = scan_text_columns_sample(t_oids[j], 1, &t_cols[j], fraction, &result.rows[j]);
+        result.sampled[j] = t_rows[j].size;
+        result.rows_scanned += result.rows[j];
+        elog(INFO, "Sampled %lu of %lu rows in %s source", result.sampled[j], result.rows[j], j == 0 ? "first" : "second");
+    }
+    if (self_join) {
+        t_rows[1] = t_rows[0];
+        result.rows[1] = result.rows[0];
+        result.sampled[1] = result.sampled[0];
+    }
+    rules = _prepared_rules_build(ruleset_get(tRoid, tRcol_abbr, tRcol_full, CurrentMemoryContext));
+    seconds_fixed = _seconds_since(start);
+
+    // Prepare sampled rows, measuring time and memory taken
+
+    result.memory = 0;
+    seconds_rows = 0;
+    for (unsigned char j = 0; j < sources; j++) {
+        MemoryContext rowscontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj estimate_pairs rows", ALLOCSET_DEFAULT_SIZES);
+        MemoryContext oldcontext = MemoryContextSwitchTo(rowscontext);
+        unsigned long longest;
+        Size strings = 0;
+
+        INSTR_TIME_SET_CURRENT(start);
+        filter_rows[j] = _filter_rows_build(t_rows[j].values, t_rows[j].size, exactness, &rules, &longest);
+        longest_row_length = Max(longest_row_length, longest);
         MemoryContextSwitchTo(oldcontext);
+
+        shares[j] = result.sampled[j] > 0 ? (double)result.sampled[j] / result.rows[j] : 1.0;
+        seconds_rows += _seconds_since(start) / shares[j];
+        for (unsigned long i = 0; i < t_rows[j].size; i++) {
+            strings += strlen(t_rows[j].values[i]) + 1;
+        }
+        result.memory += (MemoryContextMemAllocated(rowscontext, true) + strings) / shares[j];
+    }
+    if (self_join) {
+        filter_rows[1] = filter_rows[0];
+        shares[1] = shares[0];
+    }
+    if (mipt_asj_suffix_filter) {
+        suffix_reachable = palloc(sizeof(*suffix_reachable) * Max(longest_row_length, 1));
     }
 
-    funcctx = SRF_PERCALL_SETUP();
+    // Check pairs of sampled rows as calc_pairs does: a pair is joined if either of its rows
+    // has a candidate in the other one. In self-join, pairs of a row with itself are counted apart
+
+    INSTR_TIME_SET_CURRENT(start);
+    for (unsigned long i0 = 0; i0 < result.sampled[0]; i0++) {
+        for (unsigned long i1 = self_join ? i0 : 0; i1 < result.sampled[1]; i1++) {
+            const FilterRow* a = &filter_rows[0][i0];
+            const FilterRow* b = &filter_rows[1][i1];
+            const int kind = self_join && i0 == i1 ? 1 : 0;
+            bool candidate;
+            bool joined;
+
+            CHECK_FOR_INTERRUPTS();
+
+            joined = _filter_pair(a, b, exactness, suffix_reachable, &candidate);
+            checks += 1;
+            if (!joined && kind == 0) {
+                bool candidate_back;
+                joined = _filter_pair(b, a, exactness, suffix_reachable, &candidate_back);
+                candidate = candidate || candidate_back;
+                checks += 1;
+            }
+            candidates[kind] += candidate ? 1 : 0;
+            pairs[kind] += joined ? 1 : 0;
+        }
+    }
+    seconds_checks = _seconds_since(start);
+    result.sampled_candidates = (unsigned long)(candidates[0] + candidates[1]);
+    result.sampled_pairs = (unsigned long)(pairs[0] + pairs[1]);
+
+    // Scale. A pair of different rows is sampled with probability shares[0] * shares[1];
+    // a row with itself, with probability shares[0]. calc_pairs returns pairs of different rows
+    // of the same table twice
+
+    if (self_join) {
+        result.candidates = 2 * candidates[0] / (shares[0] * shares[0]) + candidates[1] / shares[0];
+        result.pairs = 2 * pairs[0] / (shares[0] * shares[0]) + pairs[1] / shares[0];
+        checks_total = (double)result.rows[0] * result.rows[0];
+    }
+    else {
+        result.candidates = candidates[0] / (shares[0] * shares[1]);
+        result.pairs = pairs[0] / (shares[0] * shares[1]);
+        checks_total = 2.0 * result.rows[0] * result.rows[1];
+    }
+    result.seconds = seconds_fixed + seconds_rows;
+    if (checks > 0) {
+        result.seconds += seconds_checks / checks * checks_total;
+    }
 
-    pairs = (StringPairRows*)funcctx->user_fctx;
+    return result;
+}
 
-    if (pairs->read >= pairs->size) {
-        SRF_RETURN_DONE(funcctx);
+
+Datum
+estimate_pairs(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    Datum values[8];
+    bool nulls[8] = {false, false, false, false, false, false, false, false};
+
+    // Function call parameters
+    Oid t_oids[2];
+    char* t_cols[2];
+    Oid tRoid;
+    char* tRcol_full;
+    char* tRcol_abbr;
+    double exactness;
+    double fraction;
+
+    EstimatePairsResult estimated;
+    MemoryContext workcontext;
+    MemoryContext oldcontext;
+    StatCall stat;
+
+    stat_call_start(&stat);
+
+    // Load call parameters
+    for (int j = 0; j < 2; j++) {
+        t_oids[j] = PG_GETARG_OID(j * 2);
+        t_cols[j] = get_text_parameter(PG_GETARG_TEXT_P(j * 2 + 1));
+    }
+    tRoid = PG_GETARG_OID(4);
+    tRcol_full = get_text_parameter(PG_GETARG_TEXT_P(5));
+    tRcol_abbr = get_text_parameter(PG_GETARG_TEXT_P(6));
+    exactness = PG_GETARG_FLOAT4(7);
+    fraction = PG_NARGS() > 8 ? PG_GETARG_FLOAT4(8) : 0.01;
+    if (!(fraction > 0 && fraction <= 1)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Sample fraction must be in range (0; 1]")));
+    }
+
+    workcontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj estimate_pairs", ALLOCSET_DEFAULT_SIZES);
+    oldcontext = MemoryContextSwitchTo(workcontext);
+    estimated = _do_estimate_pairs(
+        t_oids, (const char* const*)t_cols,
+        tRoid, tRcol_abbr, tRcol_full, exactness, fraction
+    );
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(workcontext);
+
+#if PG_VERSION_NUM >= 160000
+    InitMaterializedSRF(fcinfo, 0);
+#else
+    SetSingleFuncCall(fcinfo, 0);
+#endif
+    values[0] = Int64GetDatum((int64)estimated.rows[0]);
+    values[1] = Int64GetDatum((int64)estimated.rows[1]);
+    values[2] = Int64GetDatum((int64)estimated.sampled[0]);
+    values[3] = Int64GetDatum((int64)estimated.sampled[1]);
+    values[4] = Float8GetDatum(estimated.candidates);
+    values[5] = Float8GetDatum(estimated.pairs);
+    values[6] = Float8GetDatum(estimated.seconds);
+    values[7] = Int64GetDatum((int64)estimated.memory);
+    // Nothing is known of a non-empty table none of whose rows were sampled
+    if ((estimated.rows[0] > 0 && estimated.sampled[0] == 0) || (estimated.rows[1] > 0 && estimated.sampled[1] == 0)) {
+        for (int i = 4; i < 8; i++) {
+            nulls[i] = true;
+        }
     }
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
 
-    result = HeapTupleGetDatum(BuildTupleFromCStrings(funcctx->attinmeta, pairs->pairs[pairs->read++]));
+    stat.counters.rows = estimated.rows_scanned;
+    stat.counters.candidates = estimated.sampled_candidates;
+    stat.counters.verified = estimated.sampled_pairs;
+    stat_call_finish(&stat, STAT_ESTIMATE_PAIRS);
 
-    SRF_RETURN_NEXT(funcctx, result);
+    return (Datum)0;
 }
+
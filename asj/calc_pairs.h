@@ -17,10 +17,30 @@
 #include "fmgr.h"
 
 #include "executor/spi.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "funcapi.h"
+#include "utils/memutils.h"
+#include "utils/hsearch.h"
+#include "utils/tuplesort.h"
+#include "utils/tuplestore.h"
+#include "catalog/pg_operator_d.h"
+#include "catalog/pg_type_d.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
 
 #include "lib/common.h"
+#include "lib/hashset.h"
+#include "lib/ruleset.h"
+#include "lib/ruleset_cache.h"
+#include "lib/scan.h"
+#include "lib/stat.h"
+
+
+/**
+ * @brief Whether suffix filter is applied to candidate pairs (GUC 'mipt_asj.suffix_filter')
+ */
+extern bool mipt_asj_suffix_filter;
 
 
 /**
@@ -38,9 +58,86 @@
  *
  * @param 7: Exactness
  *
+ * @param 8: Partition modulus (optional, 1 by default)
+ * @param 9: Partition remainder (optional, 0 by default)
+ *
+ * @param 10: Return unordered pairs (optional, false by default); self-join only
+ *
+ * Either table and its column is replaced by a single query or cursor argument in other
+ * overloads; see 'scan_source_from_args'.
+ *
  * Returns table (see SQL definition)
  */
 Datum calc_pairs(PG_FUNCTION_ARGS);
 
 
+/**
+ * @brief Filter out rows that could be joined using TDS algorithm, return their 'ctid'
+ *
+ * Parameters are the same as of 'calc_pairs'.
+ *
+ * Returns table (see SQL definition)
+ */
+Datum calc_pairs_tid(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Filter out rows that could be joined using TDS algorithm, return their keys
+ *
+ * @param 0: 1st string set table OID
+ * @param 1: 1st string set table column
+ * @param 2: 1st string set table key column (of an integer type)
+ *
+ * @param 3: 2nd string set table OID
+ * @param 4: 2nd string set table column
+ * @param 5: 2nd string set table key column (of an integer type)
+ *
+ * @param 6: Abbreviation dictionary OID
+ * @param 7: Abbreviation dictionary column 'full'
+ * @param 8: Abbreviation dictionary column 'abbr'
+ *
+ * @param 9: Exactness
+ *
+ * @param 10: Partition modulus (optional, 1 by default)
+ * @param 11: Partition remainder (optional, 0 by default)
+ *
+ * @param 12: Return unordered pairs (optional, false by default); self-join only
+ *
+ * Either table and its columns are replaced by a single query or cursor argument,
+ * returning a string and a key, in other overloads.
+ *
+ * Returns table (see SQL definition)
+ */
+Datum calc_pairs_key(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Calculate pkduck signature of a string
+ *
+ * A pair of strings is a candidate in 'calc_pairs' only if prefix signature
+ * of one string intersects with U-signature (tokens which may be in prefix
+ * signature of a string derived from the other string by rules) of the other.
+ *
+ * @param 0: String
+ * @param 1: Rules value made by 'ruleset'
+ * @param 2: Exactness
+ * @param 3: Return prefix signature instead of U-signature (optional, false by default)
+ *
+ * @return text[] of distinct tokens
+ */
+Datum pkduck_signature(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Estimate the number of pairs 'calc_pairs' returns, and its time and memory, by a sample of rows
+ *
+ * @param 0-7: The same as of 'calc_pairs'
+ *
+ * @param 8: Probability of a row to be sampled (optional, 0.01 by default)
+ *
+ * Returns table of one row (see SQL definition)
+ */
+Datum estimate_pairs(PG_FUNCTION_ARGS);
+
+
 #endif /* CALC_PAIRS_H */
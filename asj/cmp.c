@@ -50,11 +50,13 @@ _apply_rule(TokenSequence* s1, TokenSequence* s2, Rule rule, bool modify_sequenc
 {
     double usefullness;
 
+    stat_rule_evaluations++;
+
     // Check rule applies
     {
         unsigned long rule_i = 0;
         for (unsigned long i = 0; i < s1->size; i++) {
-            if (strcmp(rule.a.ts[rule_i], s1->ts[i]) == 0) {
+            if (tokens_equal(&rule.a.ts[rule_i], &s1->ts[i])) {
                 rule_i += 1;
                 if (rule_i == rule.a.size) {
                     break;
@@ -74,7 +76,7 @@ _apply_rule(TokenSequence* s1, TokenSequence* s2, Rule rule, bool modify_sequenc
 
         for (unsigned long i_rule = 0; i_rule < rule.r.size; i_rule++) {
             for (long i_s2 = 0; i_s2 < s2->size; i_s2++) {
-                if (strcmp(rule.r.ts[i_rule], s2->ts[i_s2]) == 0) {
+                if (tokens_equal(&rule.r.ts[i_rule], &s2->ts[i_s2])) {
                     common_tokens += 1;
                     if (modify_sequences) {
                         remove_from_token_sequence(s2, i_s2);
@@ -90,7 +92,7 @@ _apply_rule(TokenSequence* s1, TokenSequence* s2, Rule rule, bool modify_sequenc
         if (modify_sequences) {
             unsigned long rule_i = 0;
             for (long i = 0; i < s1->size; i++) {
-                if (strcmp(rule.a.ts[rule_i], s1->ts[i]) == 0) {
+                if (tokens_equal(&rule.a.ts[rule_i], &s1->ts[i])) {
                     rule_i += 1;
                     remove_from_token_sequence(s1, i);
                     i -= 1;
@@ -109,16 +111,72 @@ _apply_rule(TokenSequence* s1, TokenSequence* s2, Rule rule, bool modify_sequenc
 
 
 /**
- * @brief Calculate pkduck for two sequences given
+ * @brief Mark tokens of 'in' which are equal to any token of 'from'
+ */
+static void
+_mark_tokens(const TokenSequence* from, const TokenSequence* in, bool* marks)
+{
+    for (unsigned long i = 0; i < from->size; i++) {
+        for (unsigned long j = 0; j < in->size; j++) {
+            if (!marks[j] && tokens_equal(&from->ts[i], &in->ts[j])) {
+                marks[j] = true;
+            }
+        }
+    }
+}
+
+
+/**
+ * @brief Count tokens common for two SORTED sequences, each token matched at most once
+ */
+static unsigned long
+_count_shared(const TokenSequence* s1, const TokenSequence* s2)
+{
+    unsigned long result = 0;
+    unsigned long i = 0;
+    unsigned long j = 0;
+
+    while (i < s1->size && j < s2->size) {
+        const int c = cmp_tokens(&s1->ts[i], &s2->ts[j]);
+        if (c < 0) {
+            i++;
+        }
+        else if (c > 0) {
+            j++;
+        }
+        else {
+            result++;
+            i++;
+            j++;
+        }
+    }
+    return result;
+}
+
+
+/**
+ * @brief Calculate pkduck for two sequences given, or bounds of it enough to compare it with 'exactness'
  *
- * @param s1_ptr
- * @param s2_ptr
- * @param rules SORTED (set-like) rules' sequence
+ * Rules are applied to 's1' only, and 's1' only loses tokens; so rules which do not apply now
+ * never will. After every pass over the rules, with 'similar' and 'thrown' tokens so far:
+ *  - every token of s2 is finally either common or not; it may become common only if it is in s1
+ *      or in the result side of an applicable rule ('matchable'). Tokens of s1 which are neither in s2
+ *      nor in any applicable rule ('stuck') remain till the end. So the score is at most
+ *          (similar + matchable) / (similar + |s2| + thrown + stuck);
+ *  - every future rule application removes at least one token of s1, and throws away at most
+ *      'longest' tokens, the longest result side among applicable rules. So the score is at least
+ *          similar / (similar + |s2| + thrown + |s1| * max(1, longest)).
+ * Calculation stops as soon as the bounds are on the same side of 'exactness'.
  *
- * @return pkduck metric for two token sequences
+ * @param s1 SORTED (set-like) TokenSequence; modified
+ * @param s2 SORTED (set-like) TokenSequence; modified
+ * @param rules_ptr rules' sequence
+ * @param exactness
+ *
+ * @return bounds of pkduck metric for two token sequences; equal if it was calculated exactly
  */
-static double
-_pkduck(TokenSequence* s1, TokenSequence* s2, const RuleSequence* rules_ptr)
+static ScoreBounds
+_pkduck(TokenSequence* s1, TokenSequence* s2, const RuleSequence* rules_ptr, double exactness)
 {
     /// Number of tokens which appear after rule application and are equal to tokens in s2
     unsigned long tokens_similar = 0;
@@ -127,14 +185,18 @@ _pkduck(TokenSequence* s1, TokenSequence* s2, const RuleSequence* rules_ptr)
     /// Number of tokens common for s1 and s2, after all rules' applications
     unsigned long tokens_shared = 0;
 
+    // Tokens of s1 and s2 which may still take part in a match; see above
+    bool* s1_marks = palloc(sizeof(*s1_marks) * Max(s1->size, 1));
+    bool* s2_marks = palloc(sizeof(*s2_marks) * Max(s2->size, 1));
+
     //
     for (unsigned long k = 0; k < s1->size; k++) {
-        elog(DEBUG1, "WORD S1: %s", s1->ts[k]);
+        elog(DEBUG1, "WORD S1: %s", s1->ts[k].s);
     }
     //
     //
     for (unsigned long k = 0; k < s2->size; k++) {
-        elog(DEBUG1, "WORD S2: %s", s2->ts[k]);
+        elog(DEBUG1, "WORD S2: %s", s2->ts[k].s);
     }
     //
 
@@ -142,14 +204,52 @@ _pkduck(TokenSequence* s1, TokenSequence* s2, const RuleSequence* rules_ptr)
     while (true) {
         double max_usefullness = -0.5f;
         size_t max_index = 0;
+        unsigned long longest = 0;
+        unsigned long matchable = 0;
+        unsigned long stuck = 0;
+        double bound_base;
+
+        memset(s1_marks, 0, sizeof(*s1_marks) * s1->size);
+        memset(s2_marks, 0, sizeof(*s2_marks) * s2->size);
+        _mark_tokens(s2, s1, s1_marks);
+        _mark_tokens(s1, s2, s2_marks);
+
         // Look for the best rule
         for (size_t rule_i = 0; rule_i < rules_ptr->size; rule_i++) {
-            double curr_usefullness = _apply_rule(s1, s2, rules_ptr->rules[rule_i], false, NULL, NULL);
+            const Rule* rule = &rules_ptr->rules[rule_i];
+            double curr_usefullness = _apply_rule(s1, s2, *rule, false, NULL, NULL);
+            if (curr_usefullness < 0.0f) {
+                continue;
+            }
+            longest = Max(longest, rule->r.size);
+            _mark_tokens(&rule->a, s1, s1_marks);
+            _mark_tokens(&rule->r, s2, s2_marks);
             if (curr_usefullness > max_usefullness) {
                 max_usefullness = curr_usefullness;
                 max_index = rule_i;
             }
         }
+
+        // Check bounds
+        for (unsigned long k = 0; k < s1->size; k++) {
+            stuck += s1_marks[k] ? 0 : 1;
+        }
+        for (unsigned long k = 0; k < s2->size; k++) {
+            matchable += s2_marks[k] ? 1 : 0;
+        }
+        bound_base = tokens_similar + s2->size + tokens_thrown;
+        if (bound_base + stuck > 0 && (tokens_similar + matchable) / (bound_base + stuck) <= exactness) {
+            ScoreBounds result = {0.0f, (tokens_similar + matchable) / (bound_base + stuck)};
+            elog(DEBUG1, "Upper bound %f reached", result.upper);
+            return result;
+        }
+        if (bound_base + s1->size * Max(longest, 1) > 0 &&
+                tokens_similar / (bound_base + s1->size * Max(longest, 1)) > exactness) {
+            ScoreBounds result = {tokens_similar / (bound_base + s1->size * Max(longest, 1)), 1.0f};
+            elog(DEBUG1, "Lower bound %f reached", result.lower);
+            return result;
+        }
+
         // Check exit condition
         if (max_usefullness < 0.0f) {
             break;
@@ -158,118 +258,220 @@ _pkduck(TokenSequence* s1, TokenSequence* s2, const RuleSequence* rules_ptr)
         _apply_rule(s1, s2, rules_ptr->rules[max_index], true, &tokens_similar, &tokens_thrown);
     }
 
-    // Calculate 'tokens_shared'
-    for (long s1_i = 0; s1_i < s1->size; s1_i++) {
-        for (long s2_i = 0; s2_i < s2->size; s2_i++) {
-            if (strcmp(s1->ts[s1_i], s2->ts[s2_i]) == 0) {
-                tokens_shared += 1;
-                remove_from_token_sequence(s1, s1_i);
-                s1_i -= 1;
-                remove_from_token_sequence(s2, s2_i);
-                s2_i -= 1;
-                break;
-            }
-        }
-    }
+    // Calculate 'tokens_shared'. Both sequences are still sorted
+    tokens_shared = _count_shared(s1, s2);
 
     {
         // Common tokens were calculated above
         double jaccard_common = tokens_similar + tokens_shared;
-        // By this moment, we know s1 and s2 do not contain equal tokens, and all rules were applied
+        // After all rules were applied, s1 and s2 contain 'tokens_shared' equal tokens each.
         // 'tokens_thrown' is basically number of "remains" of rule applications
-        double jaccard_total = jaccard_common + s1->size + s2->size + tokens_thrown;
+        double jaccard_total = jaccard_common + (s1->size - tokens_shared) + (s2->size - tokens_shared) + tokens_thrown;
+        ScoreBounds result;
         elog(DEBUG1, "Jaccard: %f / %f ", jaccard_common, jaccard_total);
         elog(DEBUG1, "Similar: %lu, Shared: %lu.", tokens_similar, tokens_shared);
         elog(DEBUG1, "s1.size: %lu, s2.size: %lu, thrown: %lu", s1->size, s2->size, tokens_thrown);
 
-        return jaccard_common / jaccard_total;
+        result.lower = jaccard_common / jaccard_total;
+        result.upper = result.lower;
+        return result;
     }
 }
 
 
 /**
- * @brief Compare two strings given
- *
- * @param s1
- * @param s2
- * @param rules_ptr
- * @param exactness
+ * @brief Rules loaded for a call site of 'cmp', kept in 'fn_extra' for the whole query
  */
-static bool
-_do_cmp(const char* string1, const char* string2, double exactness, Oid tRoid, const char* tRcol_abbr, const char* tRcol_full)
-{
-    char* tR;
-
-    char query[4096];
+typedef struct {
+    Oid tRoid;
+    char* tRcol_abbr;
+    char* tRcol_full;
+    RuleSequence rules;
+    /// Hash of rules' contents (of the value, for rules given as a value); identifies the rule set in 'cmp_cache'
+    uint64 version;
+    /// Size of the RuleSet the rules were made of
+    Size ruleset_size;
+    /// Value the rules were last found to be made of, for rules given as a value
+    const struct varlena* value;
+    /// The value is the same for every call: it is not checked
+    bool value_stable;
+} CmpRules;
 
-    RuleSequence rs;
 
-    TokenSequence s1;
-    TokenSequence s2;
-    double pkduck;
+/**
+ * Scores of recently compared pairs of strings; created on first use
+ */
+static LruCache* cmp_cache = NULL;
 
+int mipt_asj_cmp_cache_size = 65536;
 
-    // Process call parameters
 
-    tR = get_table_name_by_oid(tRoid);
+/**
+ * @brief Make rules of a RuleSet, in both directions
+ *
+ * Rules' tokens refer to 'rs'. The result is allocated in current memory context.
+ */
+static CmpRules
+_rules_of_ruleset(const RuleSet* rs)
+{
+    const RuleSetRule* rs_rules;
+    Token* tokens;
+    CmpRules result;
 
+    result.tRoid = InvalidOid;
+    result.tRcol_abbr = NULL;
+    result.tRcol_full = NULL;
 
-    // Fill rules
+    rs_rules = RULESET_RULES(rs);
+    tokens = ruleset_tokens(rs);
+    result.version = rs->version;
+    result.ruleset_size = VARSIZE(rs);
+    result.value = NULL;
+    result.value_stable = false;
 
-    sprintf(query, "SELECT %s, %s FROM %s;", tRcol_abbr, tRcol_full, tR);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL) {
-        elog(ERROR, "Could not SELECT rows from table '%s' (OID %d).", tR, tRoid);
-    }
-    rs = (RuleSequence){
+    result.rules = (RuleSequence){
         0,
-        palloc(sizeof(*rs.rules) * SPI_processed * 2)
+        palloc(sizeof(*result.rules.rules) * Max(rs->nrules, 1) * 2)
     };
-    for (uint32 i = 0; i < SPI_processed; i++) {
-        char* temp[2];
-        TokenSequence rule_abbr_seq;
-        TokenSequence rule_full_seq;
-
-        temp[0] = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
-        temp[1] = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2);
-        if (temp[0] == NULL || temp[1] == NULL) {
-            continue;
-        }
-
-        // Sequences
-        rule_abbr_seq = tokenize(temp[0], " ");
-        pg_qsort(rule_abbr_seq.ts, rule_abbr_seq.size, sizeof(*rule_abbr_seq.ts), cmp_tokens_wrapper);
-        rule_full_seq = tokenize(temp[1], " ");
-        pg_qsort(rule_full_seq.ts, rule_full_seq.size, sizeof(*rule_full_seq.ts), cmp_tokens_wrapper);
+    for (uint32 i = 0; i < rs->nrules; i++) {
+        TokenSequence rule_abbr_seq = {rs_rules[i].abbr_count, &tokens[rs_rules[i].abbr]};
+        TokenSequence rule_full_seq = {rs_rules[i].full_count, &tokens[rs_rules[i].full]};
 
         // abbr -> full
-        rs.rules[rs.size].a = rule_abbr_seq;
-        rs.rules[rs.size].r = rule_full_seq;
-        rs.size += 1;
+        result.rules.rules[result.rules.size].a = rule_abbr_seq;
+        result.rules.rules[result.rules.size].r = rule_full_seq;
+        result.rules.size += 1;
         // full -> abbr
-        rs.rules[rs.size].a = rule_full_seq;
-        rs.rules[rs.size].r = rule_abbr_seq;
-        rs.size += 1;
+        result.rules.rules[result.rules.size].a = rule_full_seq;
+        result.rules.rules[result.rules.size].r = rule_abbr_seq;
+        result.rules.size += 1;
     }
-    // Shorten rules array, if necessary
-    if (rs.size != SPI_processed * 2) {
-        rs.rules = repalloc(rs.rules, sizeof(*rs.rules) * rs.size);
+
+    return result;
+}
+
+
+/**
+ * @brief Load rules of a table
+ *
+ * Rules' tokens refer to the RuleSet, which stays valid as long as 'owner' context is.
+ * The result is allocated in current memory context.
+ */
+static CmpRules
+_load_rules(Oid tRoid, const char* tRcol_abbr, const char* tRcol_full, MemoryContext owner)
+{
+    CmpRules result = _rules_of_ruleset(ruleset_get(tRoid, tRcol_abbr, tRcol_full, owner));
+
+    result.tRoid = tRoid;
+    result.tRcol_abbr = pstrdup(tRcol_abbr);
+    result.tRcol_full = pstrdup(tRcol_full);
+    return result;
+}
+
+
+/**
+ * @brief Get rules for this call of 'cmp', loading them on first call in the query
+ *
+ * Rules are reloaded if the call site is given another table or columns.
+ * A shared RuleSet stays pinned until the end of the query.
+ */
+static const CmpRules*
+_get_rules(FunctionCallInfo fcinfo, Oid tRoid, const char* tRcol_abbr, const char* tRcol_full)
+{
+    CmpRules* cached = (CmpRules*)fcinfo->flinfo->fn_extra;
+    MemoryContext oldcontext;
+
+    if (cached != NULL &&
+            cached->tRoid == tRoid &&
+            strcmp(cached->tRcol_abbr, tRcol_abbr) == 0 &&
+            strcmp(cached->tRcol_full, tRcol_full) == 0) {
+        return cached;
     }
-    SPI_freetuptable(SPI_tuptable);
 
+    // Old rules (if any) are left in 'fn_mcxt' until the end of the query
+    oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    cached = palloc(sizeof(*cached));
+    *cached = _load_rules(tRoid, tRcol_abbr, tRcol_full, fcinfo->flinfo->fn_mcxt);
+    MemoryContextSwitchTo(oldcontext);
 
-    // Apply rules
+    fcinfo->flinfo->fn_extra = cached;
+    return cached;
+}
+
+
+/**
+ * @brief Calculate pkduck of two strings given, or its bounds enough to compare it with 'exactness'
+ *
+ * @param string1
+ * @param string2
+ * @param rules
+ * @param exactness
+ */
+static ScoreBounds
+_do_cmp(const char* string1, const char* string2, const CmpRules* rules, double exactness)
+{
+    TokenSequence s1;
+    TokenSequence s2;
 
     s1 = tokenize(string1, " ");
     pg_qsort(s1.ts, s1.size, sizeof(*s1.ts), cmp_tokens_wrapper);
     s2 = tokenize(string2, " ");
     pg_qsort(s2.ts, s2.size, sizeof(*s2.ts), cmp_tokens_wrapper);
 
-    pkduck = _pkduck(&s1, &s2, &rs);
+    return _pkduck(&s1, &s2, &rules->rules, exactness);
+}
+
+
+/**
+ * @brief Whether pkduck of two strings exceeds 'exactness'
+ *
+ * Known bounds of the score are taken from 'cmp_cache', and are
+ * narrowed by calculation when they are not enough.
+ */
+static bool
+_cached_cmp(const char* string1, const char* string2, const CmpRules* rules, double exactness)
+{
+    LruKey key;
+    ScoreBounds pkduck = {0.0f, 1.0f};
+    ScoreBounds calculated;
+
+    // Scores do not depend on exactness, so it is not a part of the key
+    key.hash1 = hash_bytes_extended((const unsigned char*)string1, strlen(string1), 0);
+    key.hash2 = hash_bytes_extended((const unsigned char*)string2, strlen(string2), 0);
+    key.version = rules->version;
+
+    if (mipt_asj_cmp_cache_size > 0) {
+        if (cmp_cache != NULL && cmp_cache->capacity != mipt_asj_cmp_cache_size) {
+            lru_destroy(cmp_cache);
+            cmp_cache = NULL;
+        }
+        if (cmp_cache == NULL) {
+            cmp_cache = lru_create(TopMemoryContext, "mipt-asj cmp cache", mipt_asj_cmp_cache_size);
+        }
+        if (lru_lookup(cmp_cache, &key, &pkduck)) {
+            if (pkduck.lower - exactness > 0.0f) {
+                return true;
+            }
+            if (!(pkduck.upper - exactness > 0.0f)) {
+                return false;
+            }
+        }
+    }
+    else if (cmp_cache != NULL) {
+        lru_destroy(cmp_cache);
+        cmp_cache = NULL;
+    }
+
+    calculated = _do_cmp(string1, string2, rules, exactness);
 
-    if (pkduck - exactness > 0.0f) {
-        return true;
+    if (cmp_cache != NULL) {
+        // Both the old and the new bounds hold
+        pkduck.lower = Max(pkduck.lower, calculated.lower);
+        pkduck.upper = Min(pkduck.upper, calculated.upper);
+        lru_insert(cmp_cache, &key, pkduck);
     }
-    return false;
+
+    return calculated.lower - exactness > 0.0f;
 }
 
 
@@ -283,8 +485,12 @@ cmp(PG_FUNCTION_ARGS)
     char* tRcol_abbr;
     double exactness;
 
+    const CmpRules* rules;
+    StatCall stat;
     bool result;
 
+    stat_call_start(&stat);
+
     string1 = get_text_parameter(PG_GETARG_TEXT_P(0));
     string2 = get_text_parameter(PG_GETARG_TEXT_P(1));
     tRoid = PG_GETARG_OID(2);
@@ -292,9 +498,600 @@ cmp(PG_FUNCTION_ARGS)
     tRcol_abbr = get_text_parameter(PG_GETARG_TEXT_P(4));
     exactness = PG_GETARG_FLOAT4(5);
 
-    SPI_connect();
-    result = _do_cmp(string1, string2, exactness, tRoid, tRcol_abbr, tRcol_full);
-    SPI_finish();
+    rules = _get_rules(fcinfo, tRoid, tRcol_abbr, tRcol_full);
+    result = _cached_cmp(string1, string2, rules, exactness);
+
+    stat.counters.verified = 1;
+    stat_call_finish(&stat, STAT_CMP);
+
+    PG_RETURN_BOOL(result);
+}
+
+
+/**
+ * @brief Get rules for this call of a function taking rules as a value made by 'ruleset'
+ *
+ * The value is usually the same for the whole query; it is checked and tokenized once then.
+ * A constant value (or a parameter of the query) is not checked afterwards; other values are
+ * hashed only when they are not the one (in the same place) checked by the previous call.
+ *
+ * @param argno number of the argument holding the value
+ */
+static const CmpRules*
+_get_value_rules(FunctionCallInfo fcinfo, int argno)
+{
+    CmpRules* rules = (CmpRules*)fcinfo->flinfo->fn_extra;
+    const struct varlena* value;
+
+    if (rules != NULL && rules->value_stable) {
+        return rules;
+    }
+    value = PG_GETARG_VARLENA_P(argno);
+
+    // The value is identified by its hash, not by 'version' it claims
+    if (rules != NULL && (rules->value != value || rules->ruleset_size != VARSIZE(value)) &&
+            (rules->version != ruleset_value_hash(value) || rules->ruleset_size != VARSIZE(value))) {
+        rules = NULL;
+    }
+    if (rules == NULL) {
+        // Old rules (if any) are left in 'fn_mcxt' until the end of the query
+        MemoryContext oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+        const RuleSet* rs = ruleset_from_value(value);
+        rules = palloc(sizeof(*rules));
+        *rules = _rules_of_ruleset(rs);
+        rules->value_stable = get_fn_expr_arg_stable(fcinfo->flinfo, argno);
+        MemoryContextSwitchTo(oldcontext);
+        fcinfo->flinfo->fn_extra = rules;
+    }
+    rules->value = value;
+
+    return rules;
+}
+
+
+Datum
+cmp_ruleset(PG_FUNCTION_ARGS)
+{
+    char* string1;
+    char* string2;
+    double exactness;
+
+    const CmpRules* rules;
+    StatCall stat;
+    bool result;
+
+    stat_call_start(&stat);
+
+    string1 = get_text_parameter(PG_GETARG_TEXT_P(0));
+    string2 = get_text_parameter(PG_GETARG_TEXT_P(1));
+    rules = _get_value_rules(fcinfo, 2);
+    exactness = PG_GETARG_FLOAT4(3);
+    result = _cached_cmp(string1, string2, rules, exactness);
+
+    stat.counters.verified = 1;
+    stat_call_finish(&stat, STAT_CMP);
+
+    PG_RETURN_BOOL(result);
+}
+
+
+/**
+ * @brief Compare two SORTED token sequences: by length, then token by token
+ */
+static int
+_cmp_token_sequences(const TokenSequence* s1, const TokenSequence* s2)
+{
+    if (s1->size != s2->size) {
+        return s1->size > s2->size ? -1 : 1;
+    }
+    for (unsigned long i = 0; i < s1->size; i++) {
+        const int result = cmp_tokens(&s1->ts[i], &s2->ts[i]);
+        if (result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Expand abbreviations in a string
+ *
+ * While any abbreviation is present among the tokens of 's', the one of the most tokens is
+ * replaced by its full form; ties (several full forms of the same abbreviation included)
+ * are broken by '_cmp_token_sequences' of full forms, so the result does not depend on
+ * the order of rules. Tokens of full forms are not abbreviations-checked again.
+ *
+ * @param s SORTED (set-like) TokenSequence; modified
+ * @param rules rules in both directions, as made by '_rules_of_ruleset'
+ *
+ * @return SORTED tokens of the canonical form
+ */
+static TokenSequence
+_canonicalize(TokenSequence* s, const RuleSequence* rules)
+{
+    TokenSequence none = {0, NULL};
+    TokenSequence result = {0, NULL};
+    Size result_allocated = s->size + 1;
+    unsigned long unused = 0;
+
+    result.ts = palloc(sizeof(*result.ts) * result_allocated);
+
+    while (true) {
+        const Rule* best = NULL;
+
+        // Even rules are 'abbr -> full'
+        for (unsigned long rule_i = 0; rule_i < rules->size; rule_i += 2) {
+            const Rule* rule = &rules->rules[rule_i];
+            if (rule->a.size == 0 || rule->r.size == 0) {
+                continue;
+            }
+            if (best != NULL && (rule->a.size < best->a.size ||
+                    (rule->a.size == best->a.size && _cmp_token_sequences(&rule->r, &best->r) >= 0))) {
+                continue;
+            }
+            if (_apply_rule(s, &none, *rule, false, NULL, NULL) < 0) {
+                continue;
+            }
+            best = rule;
+        }
+        if (best == NULL) {
+            break;
+        }
+
+        // Remove the abbreviation from 's', and keep the full form
+        _apply_rule(s, &none, *best, true, &unused, &unused);
+        if (result.size + best->r.size > result_allocated) {
+            result_allocated = (result.size + best->r.size) * 2;
+            result.ts = repalloc(result.ts, sizeof(*result.ts) * result_allocated);
+        }
+        memcpy(&result.ts[result.size], best->r.ts, sizeof(*result.ts) * best->r.size);
+        result.size += best->r.size;
+    }
+
+    // Tokens which are not abbreviations remain as they are
+    if (result.size + s->size > result_allocated) {
+        result_allocated = result.size + s->size;
+        result.ts = repalloc(result.ts, sizeof(*result.ts) * result_allocated);
+    }
+    memcpy(&result.ts[result.size], s->ts, sizeof(*result.ts) * s->size);
+    result.size += s->size;
+    pg_qsort(result.ts, result.size, sizeof(*result.ts), cmp_tokens_wrapper);
+
+    return result;
+}
+
+
+Datum
+canonicalize_text(PG_FUNCTION_ARGS)
+{
+    char* string;
+    const CmpRules* rules;
+    TokenSequence s;
+    TokenSequence canonical;
+    StringInfoData result;
+
+    string = get_text_parameter(PG_GETARG_TEXT_P(0));
+    rules = _get_value_rules(fcinfo, 1);
+
+    s = tokenize(string, " ");
+    pg_qsort(s.ts, s.size, sizeof(*s.ts), cmp_tokens_wrapper);
+    canonical = _canonicalize(&s, &rules->rules);
+
+    initStringInfo(&result);
+    for (unsigned long i = 0; i < canonical.size; i++) {
+        if (i > 0) {
+            appendStringInfoChar(&result, ' ');
+        }
+        appendBinaryStringInfo(&result, canonical.ts[i].s, canonical.ts[i].len);
+    }
+
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(result.data, result.len));
+}
+
+
+/**
+ * @brief Numbers of rules or strings of CmpIndex
+ */
+typedef struct {
+    unsigned long size;
+    unsigned long allocated;
+    uint32* items;
+} CmpIndexList;
+
+
+/**
+ * @brief Entry of a CmpIndex hash table
+ */
+typedef struct {
+    /// Hash of a token. Tokens with the same hash share the entry; extra items are checked anyway
+    uint32 hash;
+    CmpIndexList list;
+} CmpIndexEntry;
+
+
+struct CmpIndex {
+    double exactness;
+    /// Every pair is a candidate: the exactness is negative or NaN
+    bool all;
+    /// Strings added are the first arguments of 'cmp', strings probed are the second ones
+    bool first;
+
+    CmpRules rules;
+    /// Token hash -> rules whose applicable side starts with the token
+    HTAB* rules_by_token;
+    /// Rules with an empty applicable side, which apply to any string
+    CmpIndexList rules_always;
+
+    /// Tokens of strings added, as made by '_cmp_index_tokens'
+    TokenSequence* rows;
+    unsigned long size;
+    unsigned long allocated;
+
+    /// Token hash -> strings whose keys contain the token
+    HTAB* keys;
+
+    /// Number of the last probe every string was a candidate in
+    uint64* seen;
+    uint64 probe;
+    /// Strings passed the check in the last probe
+    uint32* matches;
+    unsigned long matches_allocated;
+
+    /// Context of the index
+    MemoryContext context;
+    /// Context of temporary data of the last probe
+    MemoryContext probecontext;
+};
+
+
+/**
+ * @brief Append a number to 'list'
+ */
+static void
+_cmp_index_list_add(CmpIndexList* list, uint32 item)
+{
+    if (list->size == list->allocated) {
+        list->allocated = list->allocated == 0 ? 4 : list->allocated * 2;
+        list->items = list->items == NULL ?
+            palloc(sizeof(*list->items) * list->allocated) :
+            repalloc_huge(list->items, sizeof(*list->items) * list->allocated);
+    }
+    list->items[list->size++] = item;
+}
+
+
+/**
+ * @brief Find or make an entry of a token
+ */
+static CmpIndexEntry*
+_cmp_index_entry(HTAB* table, const Token* token, HASHACTION action)
+{
+    bool found;
+    CmpIndexEntry* entry = hash_search(table, &token->hash, action, &found);
+
+    if (entry != NULL && !found) {
+        entry->list = (CmpIndexList){0, 0, NULL};
+    }
+    return entry;
+}
+
+
+static HTAB*
+_cmp_index_table(const char* name)
+{
+    HASHCTL ctl;
+
+    ctl.keysize = sizeof(uint32);
+    ctl.entrysize = sizeof(CmpIndexEntry);
+    ctl.hcxt = CurrentMemoryContext;
+    return hash_create(name, 1024, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+
+/**
+ * @brief Whether a SORTED sequence contains a token
+ */
+static bool
+_contains_token(const TokenSequence* s, const Token* token)
+{
+    return s->size > 0 && bsearch(token, s->ts, s->size, sizeof(*s->ts), cmp_tokens_wrapper) != NULL;
+}
+
+
+/**
+ * @brief Tokens of 's1' which may be common with a second string: the tokens of 's1', and
+ * the result sides of rules which may apply to it
+ *
+ * @param s1 SORTED (set-like) TokenSequence
+ *
+ * @return SORTED distinct tokens
+ */
+static TokenSequence
+_matchable_tokens(const CmpIndex* index, const TokenSequence* s1)
+{
+    TokenSequence result = {0, NULL};
+    Size allocated = s1->size + 1;
+    unsigned long distinct = 0;
+
+    result.ts = palloc(sizeof(*result.ts) * allocated);
+    memcpy(result.ts, s1->ts, sizeof(*result.ts) * s1->size);
+    result.size = s1->size;
+
+    for (unsigned long i = 0; i <= s1->size; i++) {
+        const CmpIndexList* rules;
+
+        // The last pass is over the rules which apply always
+        if (i == s1->size) {
+            rules = &index->rules_always;
+        }
+        else {
+            const CmpIndexEntry* entry;
+            if (i > 0 && tokens_equal(&s1->ts[i - 1], &s1->ts[i])) {
+                continue;
+            }
+            entry = _cmp_index_entry(index->rules_by_token, &s1->ts[i], HASH_FIND);
+            if (entry == NULL) {
+                continue;
+            }
+            rules = &entry->list;
+        }
+
+        for (unsigned long r = 0; r < rules->size; r++) {
+            const Rule* rule = &index->rules.rules.rules[rules->items[r]];
+            bool applies = true;
+
+            stat_rule_evaluations++;
+            // Repeated tokens of the applicable side are not counted, so a rule may be taken in vain
+            for (unsigned long k = 0; k < rule->a.size && applies; k++) {
+                applies = _contains_token(s1, &rule->a.ts[k]);
+            }
+            if (!applies) {
+                continue;
+            }
+            if (result.size + rule->r.size > allocated) {
+                allocated = (result.size + rule->r.size) * 2;
+                result.ts = repalloc(result.ts, sizeof(*result.ts) * allocated);
+            }
+            memcpy(&result.ts[result.size], rule->r.ts, sizeof(*result.ts) * rule->r.size);
+            result.size += rule->r.size;
+        }
+    }
+
+    pg_qsort(result.ts, result.size, sizeof(*result.ts), cmp_tokens_wrapper);
+    for (unsigned long i = 0; i < result.size; i++) {
+        if (distinct == 0 || !tokens_equal(&result.ts[distinct - 1], &result.ts[i])) {
+            result.ts[distinct++] = result.ts[i];
+        }
+    }
+    result.size = distinct;
+
+    return result;
+}
+
+
+/**
+ * @brief Number of leading SORTED tokens of the second string, some of which are matchable in any pair 'cmp' joins
+ *
+ * Tokens counted as common by 'cmp' are distinct tokens of 's2', and the score is at most
+ * common / |s2|. So more than 'exactness * |s2|' tokens of 's2' are matchable, and the first
+ * 'size' tokens can not all be unmatchable. A small margin covers rounding of the score.
+ */
+static unsigned long
+_key_prefix_size(unsigned long size, double exactness)
+{
+    const double unmatchable = floor(exactness * size - 1e-9);
+
+    if (unmatchable < 0) {
+        return size;
+    }
+    return unmatchable >= size ? 0 : size - (unsigned long)unmatchable;
+}
+
+
+/**
+ * @brief Whether enough tokens of 's2' are matchable for 'cmp' to join the strings
+ *
+ * @param matchable tokens made by '_matchable_tokens' for the first string
+ * @param s2 SORTED (set-like) TokenSequence
+ */
+static bool
+_enough_matchable(const TokenSequence* matchable, const TokenSequence* s2, double exactness)
+{
+    unsigned long count = 0;
+    unsigned long i = 0;
+    unsigned long j = 0;
+
+    while (i < s2->size && j < matchable->size) {
+        const int c = cmp_tokens(&s2->ts[i], &matchable->ts[j]);
+        if (c < 0) {
+            i++;
+        }
+        else if (c > 0) {
+            j++;
+        }
+        else {
+            count++;
+            i++;
+        }
+    }
+    return count > exactness * s2->size - 1e-9;
+}
+
+
+/**
+ * @brief Tokens of a string kept by the index, and its keys
+ *
+ * For a first string, both are its matchable tokens. For a second string, tokens are all
+ * its SORTED tokens, and keys are the first '_key_prefix_size' of them.
+ *
+ * @param keys_size set to the number of leading tokens of the result which are keys
+ */
+static TokenSequence
+_cmp_index_tokens(const CmpIndex* index, const char* string, bool first, unsigned long* keys_size)
+{
+    TokenSequence s = tokenize(string, " ");
+
+    pg_qsort(s.ts, s.size, sizeof(*s.ts), cmp_tokens_wrapper);
+    if (first) {
+        s = _matchable_tokens(index, &s);
+        *keys_size = s.size;
+    }
+    else {
+        *keys_size = _key_prefix_size(s.size, index->exactness);
+    }
+    return s;
+}
+
+
+CmpIndex*
+cmp_index_create(const struct varlena* rules, double exactness, bool first)
+{
+    CmpIndex* index = palloc(sizeof(*index));
+
+    index->exactness = exactness;
+    index->all = !(exactness >= 0.0);
+    index->first = first;
+
+    index->rules = _rules_of_ruleset(ruleset_from_value(rules));
+    index->rules_by_token = _cmp_index_table("mipt-asj cmp index rules");
+    index->rules_always = (CmpIndexList){0, 0, NULL};
+    for (uint32 i = 0; i < index->rules.rules.size; i++) {
+        const Rule* rule = &index->rules.rules.rules[i];
+        if (rule->a.size == 0) {
+            _cmp_index_list_add(&index->rules_always, i);
+        }
+        else {
+            _cmp_index_list_add(&_cmp_index_entry(index->rules_by_token, &rule->a.ts[0], HASH_ENTER)->list, i);
+        }
+    }
+
+    index->rows = NULL;
+    index->size = 0;
+    index->allocated = 0;
+    index->keys = _cmp_index_table("mipt-asj cmp index keys");
+
+    index->seen = NULL;
+    index->probe = 0;
+    index->matches = NULL;
+    index->matches_allocated = 0;
+
+    index->context = CurrentMemoryContext;
+    index->probecontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj cmp index probe", ALLOCSET_DEFAULT_SIZES);
+
+    return index;
+}
+
+
+void
+cmp_index_add(CmpIndex* index, const char* string)
+{
+    MemoryContext oldcontext = MemoryContextSwitchTo(index->context);
+    const uint32 row = index->size;
+    TokenSequence* s;
+    unsigned long keys_size;
+
+    if (index->size == index->allocated) {
+        index->allocated = index->allocated == 0 ? 1024 : index->allocated * 2;
+        index->rows = index->rows == NULL ?
+            MemoryContextAllocHuge(index->context, sizeof(*index->rows) * index->allocated) :
+            repalloc_huge(index->rows, sizeof(*index->rows) * index->allocated);
+        index->seen = index->seen == NULL ?
+            MemoryContextAllocHuge(index->context, sizeof(*index->seen) * index->allocated) :
+            repalloc_huge(index->seen, sizeof(*index->seen) * index->allocated);
+    }
+    s = &index->rows[index->size++];
+    index->seen[row] = 0;
+    if (index->all) {
+        // Strings are not checked, so they are not kept
+        *s = (TokenSequence){0, NULL};
+        MemoryContextSwitchTo(oldcontext);
+        return;
+    }
+
+    *s = _cmp_index_tokens(index, string, index->first, &keys_size);
+    for (unsigned long i = 0; i < keys_size; i++) {
+        if (i == 0 || !tokens_equal(&s->ts[i - 1], &s->ts[i])) {
+            _cmp_index_list_add(&_cmp_index_entry(index->keys, &s->ts[i], HASH_ENTER)->list, row);
+        }
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+
+/**
+ * @brief Append a string of the index to the matches of the probe
+ */
+static void
+_cmp_index_match(CmpIndex* index, uint32 row, unsigned long* matches)
+{
+    if (*matches == index->matches_allocated) {
+        index->matches_allocated = index->matches_allocated == 0 ? 64 : index->matches_allocated * 2;
+        index->matches = index->matches == NULL ?
+            MemoryContextAllocHuge(index->context, sizeof(*index->matches) * index->matches_allocated) :
+            repalloc_huge(index->matches, sizeof(*index->matches) * index->matches_allocated);
+    }
+    index->matches[(*matches)++] = row;
+}
+
+
+unsigned long
+cmp_index_probe(CmpIndex* index, const char* string, const uint32** matches, unsigned long* candidates)
+{
+    MemoryContext oldcontext;
+    TokenSequence x;
+    unsigned long keys_size;
+    unsigned long result = 0;
+
+    *candidates = 0;
+    if (index->all) {
+        for (uint32 row = 0; row < index->size; row++) {
+            _cmp_index_match(index, row, &result);
+        }
+        *matches = index->matches;
+        *candidates = result;
+        return result;
+    }
+
+    MemoryContextReset(index->probecontext);
+    oldcontext = MemoryContextSwitchTo(index->probecontext);
+
+    x = _cmp_index_tokens(index, string, !index->first, &keys_size);
+    index->probe++;
+
+    // A key of the probed string is a key of a string of the index
+    for (unsigned long i = 0; i < keys_size; i++) {
+        const CmpIndexEntry* entry;
+
+        if (i > 0 && tokens_equal(&x.ts[i - 1], &x.ts[i])) {
+            continue;
+        }
+        entry = _cmp_index_entry(index->keys, &x.ts[i], HASH_FIND);
+        if (entry == NULL) {
+            continue;
+        }
+        for (unsigned long r = 0; r < entry->list.size; r++) {
+            const uint32 row = entry->list.items[r];
+            bool enough;
+
+            if (index->seen[row] == index->probe) {
+                continue;
+            }
+            index->seen[row] = index->probe;
+            (*candidates)++;
+
+            enough = index->first ?
+                _enough_matchable(&index->rows[row], &x, index->exactness) :
+                _enough_matchable(&x, &index->rows[row], index->exactness);
+            if (enough) {
+                _cmp_index_match(index, row, &result);
+            }
+        }
+    }
+
+    MemoryContextSwitchTo(oldcontext);
 
+    *matches = index->matches;
     return result;
 }
@@ -11,6 +11,7 @@
  *	    contrib/mipt-asj/asj/cmp.h
  */
 
+#include <math.h>
 #include <string.h>
 
 #include "postgres.h"
@@ -19,17 +20,105 @@
 #include "executor/spi.h"
 #include "utils/builtins.h"
 #include "funcapi.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "common/hashfn.h"
+#include "lib/stringinfo.h"
 
 #include "lib/common.h"
+#include "lib/lru.h"
+#include "lib/ruleset.h"
+#include "lib/ruleset_cache.h"
+#include "lib/stat.h"
+
+
+/**
+ * @brief Maximum number of pairs whose scores are cached by 'cmp' (GUC 'mipt_asj.cmp_cache_size')
+ */
+extern int mipt_asj_cmp_cache_size;
 
 
 /**
  * @brief ASJ comparator function. Calculates pkduck()
  * for every pair of input received
  *
+ * Rules are loaded once per query. Scores of recently compared pairs are
+ * kept in a per-backend LRU cache, keyed by hashes of both strings and
+ * a hash of the rules, so repeated comparisons skip pkduck() calculation.
+ *
  * @return true | false, as any equality function
  */
 Datum cmp(PG_FUNCTION_ARGS);
 
 
+/**
+ * @brief ASJ comparator function, which takes rules as a value made by 'ruleset'
+ *
+ * Reads no tables, so it is immutable and parallel safe. The rules value
+ * is checked and tokenized once per query, unless it changes from call to call.
+ *
+ * @return true | false, as any equality function
+ */
+Datum cmp_ruleset(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Expand abbreviations in a string, using rules given as a value made by 'ruleset'
+ *
+ * Strings which differ only by order of words and by abbreviations (with only one
+ * full form in the rules) have the same canonical form. Tokens of the result
+ * are sorted and separated by single spaces.
+ *
+ * @param 0: String
+ * @param 1: Rules value
+ *
+ * @return text
+ */
+Datum canonicalize_text(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Strings prepared for search of the ones 'cmp' with rules value may consider equal to a given string
+ *
+ * No pair 'cmp' considers equal is missed. With exactness 'e' >= 0, more than e * |s2|
+ * tokens of the second string are 'matchable': tokens of the first string, or of the result
+ * side of a rule which applies to it. So one of the first |s2| - floor(e * |s2|) SORTED
+ * tokens of the second string is matchable, too; strings are found by these tokens.
+ * With a negative (or NaN) exactness every string is found.
+ *
+ * Strings found may still be falsely considered equal; use 'cmp' to check them.
+ */
+typedef struct CmpIndex CmpIndex;
+
+
+/**
+ * @brief Create an empty CmpIndex in current memory context
+ *
+ * @param rules detoasted rules value made by 'ruleset'
+ * @param exactness
+ * @param first whether strings added are the first arguments of 'cmp' (and strings probed are the second ones)
+ */
+CmpIndex*
+cmp_index_create(const struct varlena* rules, double exactness, bool first);
+
+
+/**
+ * @brief Add a string to CmpIndex. Strings are numbered from 0 in order of addition
+ */
+void
+cmp_index_add(CmpIndex* index, const char* string);
+
+
+/**
+ * @brief Find strings of CmpIndex which 'cmp' may consider equal to a given one
+ *
+ * @param matches set to numbers of strings found; valid until the next call
+ * @param candidates set to the number of strings which share a token with the given one
+ * @return number of strings found
+ */
+unsigned long
+cmp_index_probe(CmpIndex* index, const char* string, const uint32** matches, unsigned long* candidates);
+
+
 #endif /* CMP_H */
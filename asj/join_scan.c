@@ -0,0 +1,739 @@
+/*
+ * join_scan.c
+ *      Custom join node, which joins relations by 'cmp' using
+ *      an index of tokens the strings may have in common
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/asj/join_scan.c
+ */
+
+#include "join_scan.h"
+
+#include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "executor/executor.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/restrictinfo.h"
+#include "parser/parse_func.h"
+#include "utils/memutils.h"
+#include "utils/ruleutils.h"
+
+
+bool mipt_asj_enable_join_scan = true;
+
+
+/**
+ * Name of the node, shown by EXPLAIN
+ */
+#define JOIN_SCAN_NAME "PkduckJoin"
+
+/**
+ * Cost of finding the keys of a string in the index, in 'cpu_operator_cost' units
+ */
+#define JOIN_SCAN_KEYS_COST 50.0
+
+/**
+ * Share of pairs of rows assumed to be found in the index when all tokens of strings are keys
+ */
+#define JOIN_SCAN_CANDIDATES_SELECTIVITY 0.05
+
+/**
+ * Number of inner rows read between checks of the memory taken by the node
+ */
+#define JOIN_SCAN_MEMORY_CHECK_ROWS 1024
+
+
+/**
+ * @brief 'cmp' clause of a join condition
+ */
+typedef struct {
+    RestrictInfo* rinfo;
+    /// String of the outer relation
+    Expr* outer_string;
+    /// String of the inner relation
+    Expr* inner_string;
+    /// Rules value and exactness, which do not depend on joined rows
+    Expr* rules;
+    Expr* exactness;
+    /// Whether the inner string is the first argument of 'cmp'
+    bool inner_first;
+} JoinClause;
+
+
+/**
+ * @brief State of the node
+ */
+typedef struct {
+    CustomScanState css;
+
+    /// Child nodes
+    PlanState* outer;
+    PlanState* inner;
+    /// Number of leading columns of the scan tuple which come from the outer relation; the rest come from the inner one
+    int outer_natts;
+    /// Whether the inner string is the first argument of 'cmp'
+    bool inner_first;
+
+    /// Arguments of 'cmp', and the 'cmp' clause itself
+    ExprState* outer_string;
+    ExprState* inner_string;
+    ExprState* rules;
+    ExprState* exactness;
+    ExprState* clause;
+
+    /// Whether the index is made (it is NULL when no rows may be joined)
+    bool index_made;
+    CmpIndex* index;
+    /// Inner rows, numbered as their strings in the index
+    MinimalTuple* inner_tuples;
+    unsigned long inner_size;
+    unsigned long inner_allocated;
+    TupleTableSlot* inner_slot;
+    /// Context of the index and inner rows
+    MemoryContext index_context;
+
+    /// Current outer row (NULL if the next one must be read), and inner rows found for it
+    TupleTableSlot* outer_slot;
+    const uint32* matches;
+    unsigned long matches_size;
+    unsigned long match_i;
+
+    /// Pairs which share a key in the index, and pairs checked by 'cmp'
+    uint64 candidates;
+    uint64 verified;
+
+    /// Statistics of the node; time is measured for index calls only, as 'cmp' counts its own
+    StatCall stat;
+    /// Whether the current scan (the first one, or the one after the last rescan) is counted as a call
+    bool started;
+} JoinScanState;
+
+
+static Plan* _plan_join_path(PlannerInfo* root, RelOptInfo* rel, CustomPath* best_path, List* tlist, List* clauses, List* custom_plans);
+static Node* _create_join_scan_state(CustomScan* cscan);
+static void _begin_join_scan(CustomScanState* node, EState* estate, int eflags);
+static TupleTableSlot* _exec_join_scan(CustomScanState* node);
+static void _end_join_scan(CustomScanState* node);
+static void _rescan_join_scan(CustomScanState* node);
+static void _explain_join_scan(CustomScanState* node, List* ancestors, ExplainState* es);
+
+
+static const CustomPathMethods join_path_methods = {
+    .CustomName = JOIN_SCAN_NAME,
+    .PlanCustomPath = _plan_join_path,
+};
+
+static const CustomScanMethods join_scan_methods = {
+    .CustomName = JOIN_SCAN_NAME,
+    .CreateCustomScanState = _create_join_scan_state,
+};
+
+static const CustomExecMethods join_exec_methods = {
+    .CustomName = JOIN_SCAN_NAME,
+    .BeginCustomScan = _begin_join_scan,
+    .ExecCustomScan = _exec_join_scan,
+    .EndCustomScan = _end_join_scan,
+    .ReScanCustomScan = _rescan_join_scan,
+    .ExplainCustomScan = _explain_join_scan,
+};
+
+
+static set_join_pathlist_hook_type prev_set_join_pathlist_hook = NULL;
+
+
+
+// Planning
+
+
+/**
+ * @brief OID of 'mipt_asj.cmp(text, text, bytea, real)', or InvalidOid if the extension is not created
+ */
+static Oid
+_cmp_function_oid(void)
+{
+    Oid argtypes[4] = {TEXTOID, TEXTOID, BYTEAOID, FLOAT4OID};
+
+    return LookupFuncName(list_make2(makeString("mipt_asj"), makeString("cmp")), 4, argtypes, true);
+}
+
+
+/**
+ * @brief Relations an expression refers to
+ */
+static Relids
+_expr_relids(PlannerInfo* root, Expr* expr)
+{
+#if PG_VERSION_NUM >= 140000
+    return pull_varnos(root, (Node*)expr);
+#else
+    return pull_varnos((Node*)expr);
+#endif
+}
+
+
+/**
+ * @brief Find a 'cmp' clause, whose strings come from different sides of the join, in a join condition
+ *
+ * @return whether the join may be executed by the node
+ */
+static bool
+_find_join_clause(PlannerInfo* root, List* restrictlist, RelOptInfo* outerrel, RelOptInfo* innerrel, JoinClause* result)
+{
+    Oid cmp_oid = InvalidOid;
+    bool found = false;
+    ListCell* lc;
+
+    foreach(lc, restrictlist) {
+        RestrictInfo* rinfo = lfirst_node(RestrictInfo, lc);
+        FuncExpr* func;
+        Expr* args[4];
+        Relids relids[2];
+
+        // Pseudoconstant clauses are checked by a gating node, which is not made for custom joins
+        if (rinfo->pseudoconstant) {
+            return false;
+        }
+        if (found || !IsA(rinfo->clause, FuncExpr)) {
+            continue;
+        }
+        func = (FuncExpr*)rinfo->clause;
+        if (list_length(func->args) != 4) {
+            continue;
+        }
+        if (cmp_oid == InvalidOid) {
+            cmp_oid = _cmp_function_oid();
+        }
+        if (func->funcid != cmp_oid || cmp_oid == InvalidOid) {
+            continue;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            args[i] = (Expr*)list_nth(func->args, i);
+        }
+        if (contain_var_clause((Node*)args[2]) || contain_var_clause((Node*)args[3]) || contain_volatile_functions((Node*)func)) {
+            continue;
+        }
+        relids[0] = _expr_relids(root, args[0]);
+        relids[1] = _expr_relids(root, args[1]);
+        if (bms_is_empty(relids[0]) || bms_is_empty(relids[1])) {
+            continue;
+        }
+        if (bms_is_subset(relids[0], outerrel->relids) && bms_is_subset(relids[1], innerrel->relids)) {
+            result->outer_string = args[0];
+            result->inner_string = args[1];
+            result->inner_first = false;
+        }
+        else if (bms_is_subset(relids[1], outerrel->relids) && bms_is_subset(relids[0], innerrel->relids)) {
+            result->outer_string = args[1];
+            result->inner_string = args[0];
+            result->inner_first = true;
+        }
+        else {
+            continue;
+        }
+        result->rinfo = rinfo;
+        result->rules = args[2];
+        result->exactness = args[3];
+        found = true;
+    }
+
+    return found;
+}
+
+
+/**
+ * @brief Estimate the number of pairs of rows found in the index
+ *
+ * Keys of a string are about '1 - exactness' of its tokens; the exactness is not known
+ * until execution unless it is a constant.
+ */
+static double
+_candidates_estimate(Path* outer_path, Path* inner_path, const JoinClause* clause)
+{
+    double keys_share = 1.0;
+
+    if (IsA(clause->exactness, Const) && !((Const*)clause->exactness)->constisnull) {
+        const float4 exactness = DatumGetFloat4(((Const*)clause->exactness)->constvalue);
+        keys_share = Min(Max(1.0 - exactness, 0.0), 1.0);
+    }
+
+    return clamp_row_est(outer_path->rows * inner_path->rows * JOIN_SCAN_CANDIDATES_SELECTIVITY * keys_share);
+}
+
+
+/**
+ * @brief Estimate the memory taken by inner rows and their index, in bytes
+ *
+ * A row is kept as a MinimalTuple; tokens of its string in the index take about as much again.
+ */
+static double
+_inner_memory_estimate(Path* inner_path)
+{
+    const double width = MAXALIGN(inner_path->pathtarget->width);
+
+    return inner_path->rows * (sizeof(MinimalTuple) + MAXALIGN(SizeofMinimalTupleHeader) + 2.0 * width);
+}
+
+
+/**
+ * @brief Offer the node for a join whose condition contains a 'cmp' clause
+ */
+static void
+_set_join_pathlist(PlannerInfo* root, RelOptInfo* joinrel, RelOptInfo* outerrel, RelOptInfo* innerrel, JoinType jointype, JoinPathExtraData* extra)
+{
+    Path* outer_path = outerrel->cheapest_total_path;
+    Path* inner_path = innerrel->cheapest_total_path;
+    JoinClause clause;
+    CustomPath* path;
+    QualCost restrict_cost;
+    Cost keys_cost;
+    double candidates;
+
+    if (prev_set_join_pathlist_hook != NULL) {
+        prev_set_join_pathlist_hook(root, joinrel, outerrel, innerrel, jointype, extra);
+    }
+
+    // Rows locked or updated may have to be rechecked, which the node does not support
+    if (!mipt_asj_enable_join_scan || jointype != JOIN_INNER || root->rowMarks != NIL) {
+        return;
+    }
+    if (outer_path == NULL || inner_path == NULL || outer_path->param_info != NULL || inner_path->param_info != NULL) {
+        return;
+    }
+    if (!bms_is_empty(joinrel->lateral_relids)) {
+        return;
+    }
+    if (!_find_join_clause(root, extra->restrictlist, outerrel, innerrel, &clause)) {
+        return;
+    }
+    // With a negative exactness every pair is checked, as a nested loop does
+    if (IsA(clause.exactness, Const) && !((Const*)clause.exactness)->constisnull &&
+            !(DatumGetFloat4(((Const*)clause.exactness)->constvalue) >= 0.0f)) {
+        return;
+    }
+    // Inner rows are kept in memory, and are not spilled to disk
+    if (_inner_memory_estimate(inner_path) > work_mem * 1024.0) {
+        return;
+    }
+
+    path = makeNode(CustomPath);
+    path->path.pathtype = T_CustomScan;
+    path->path.parent = joinrel;
+    path->path.pathtarget = joinrel->reltarget;
+    path->path.param_info = NULL;
+    path->path.parallel_aware = false;
+    path->path.parallel_safe = false;
+    path->path.parallel_workers = 0;
+    path->path.rows = joinrel->rows;
+    path->path.pathkeys = NIL;
+    path->flags = 0;
+    path->custom_paths = list_make2(outer_path, inner_path);
+    path->custom_private = list_make4(
+        extra->restrictlist,
+        clause.rinfo,
+        list_make4(clause.outer_string, clause.inner_string, clause.rules, clause.exactness),
+        makeInteger(clause.inner_first)
+    );
+    path->methods = &join_path_methods;
+
+    // The inner relation is read and indexed before the first row is returned. Every outer row
+    // probes the index; the join condition is checked for every pair found
+    cost_qual_eval(&restrict_cost, extra->restrictlist, root);
+    keys_cost = JOIN_SCAN_KEYS_COST * cpu_operator_cost;
+    candidates = _candidates_estimate(outer_path, inner_path, &clause);
+    path->path.startup_cost =
+        inner_path->total_cost + outer_path->startup_cost + restrict_cost.startup +
+        inner_path->rows * keys_cost;
+    path->path.total_cost =
+        path->path.startup_cost +
+        outer_path->total_cost - outer_path->startup_cost +
+        outer_path->rows * keys_cost +
+        candidates * restrict_cost.per_tuple +
+        joinrel->rows * (cpu_tuple_cost + joinrel->reltarget->cost.per_tuple);
+
+    add_path(joinrel, &path->path);
+}
+
+
+/**
+ * @brief Make CustomScan of the node
+ *
+ * The scan tuple of the node is the outer row followed by the inner row. 'custom_exprs' are
+ * the strings, the rules and the exactness of the 'cmp' clause, followed by the clause itself.
+ * 'custom_private' is the number of columns of the outer row, and whether the inner string
+ * is the first argument of 'cmp'.
+ */
+static Plan*
+_plan_join_path(PlannerInfo* root, RelOptInfo* rel, CustomPath* best_path, List* tlist, List* clauses, List* custom_plans)
+{
+    CustomScan* cscan = makeNode(CustomScan);
+    List* restrictlist = (List*)linitial(best_path->custom_private);
+    RestrictInfo* cmp_rinfo = (RestrictInfo*)lsecond(best_path->custom_private);
+    List* cmp_args = (List*)lthird(best_path->custom_private);
+    Plan* outer_plan = (Plan*)linitial(custom_plans);
+    Plan* inner_plan = (Plan*)lsecond(custom_plans);
+    List* other_clauses = NIL;
+    List* scan_tlist = NIL;
+    ListCell* lc;
+
+    foreach(lc, restrictlist) {
+        if (lfirst(lc) != cmp_rinfo) {
+            other_clauses = lappend(other_clauses, lfirst(lc));
+        }
+    }
+    foreach(lc, outer_plan->targetlist) {
+        TargetEntry* tle = lfirst_node(TargetEntry, lc);
+        scan_tlist = lappend(scan_tlist, makeTargetEntry(copyObject(tle->expr), list_length(scan_tlist) + 1, NULL, false));
+    }
+    foreach(lc, inner_plan->targetlist) {
+        TargetEntry* tle = lfirst_node(TargetEntry, lc);
+        scan_tlist = lappend(scan_tlist, makeTargetEntry(copyObject(tle->expr), list_length(scan_tlist) + 1, NULL, false));
+    }
+
+    cscan->scan.plan.targetlist = tlist;
+    cscan->scan.plan.qual = extract_actual_clauses(other_clauses, false);
+    cscan->scan.scanrelid = 0;
+    cscan->flags = best_path->flags;
+    cscan->custom_plans = custom_plans;
+    cscan->custom_exprs = lappend(list_copy(cmp_args), cmp_rinfo->clause);
+    cscan->custom_private = list_make2(
+        makeInteger(list_length(outer_plan->targetlist)),
+        copyObject(lfourth(best_path->custom_private))
+    );
+    cscan->custom_scan_tlist = scan_tlist;
+    cscan->custom_relids = bms_copy(rel->relids);
+    cscan->methods = &join_scan_methods;
+
+    return &cscan->scan.plan;
+}
+
+
+
+// Execution
+
+
+static Node*
+_create_join_scan_state(CustomScan* cscan)
+{
+    JoinScanState* state = palloc0(sizeof(*state));
+
+    NodeSetTag(state, T_CustomScanState);
+    state->css.flags = cscan->flags;
+    state->css.methods = &join_exec_methods;
+
+    return (Node*)state;
+}
+
+
+static void
+_begin_join_scan(CustomScanState* node, EState* estate, int eflags)
+{
+    JoinScanState* state = (JoinScanState*)node;
+    CustomScan* cscan = (CustomScan*)node->ss.ps.plan;
+
+    state->outer = ExecInitNode((Plan*)linitial(cscan->custom_plans), estate, eflags);
+    state->inner = ExecInitNode((Plan*)lsecond(cscan->custom_plans), estate, eflags);
+    node->custom_ps = list_make2(state->outer, state->inner);
+    state->outer_natts = intVal(linitial(cscan->custom_private));
+    state->inner_first = intVal(lsecond(cscan->custom_private)) != 0;
+
+    state->outer_string = ExecInitExpr((Expr*)list_nth(cscan->custom_exprs, 0), &node->ss.ps);
+    state->inner_string = ExecInitExpr((Expr*)list_nth(cscan->custom_exprs, 1), &node->ss.ps);
+    state->rules = ExecInitExpr((Expr*)list_nth(cscan->custom_exprs, 2), &node->ss.ps);
+    state->exactness = ExecInitExpr((Expr*)list_nth(cscan->custom_exprs, 3), &node->ss.ps);
+    state->clause = ExecInitExpr((Expr*)list_nth(cscan->custom_exprs, 4), &node->ss.ps);
+
+    state->inner_slot = ExecInitExtraTupleSlot(estate, ExecGetResultType(state->inner), &TTSOpsMinimalTuple);
+    state->index_context = AllocSetContextCreate(estate->es_query_cxt, "mipt-asj join scan index", ALLOCSET_DEFAULT_SIZES);
+    state->index_made = false;
+    state->outer_slot = NULL;
+}
+
+
+/**
+ * @brief Fill the scan tuple with an outer and an inner row; a missing row is filled with NULLs
+ */
+static TupleTableSlot*
+_fill_scan_slot(JoinScanState* state, TupleTableSlot* outer, TupleTableSlot* inner)
+{
+    TupleTableSlot* slot = state->css.ss.ss_ScanTupleSlot;
+    const int natts = slot->tts_tupleDescriptor->natts;
+
+    ExecClearTuple(slot);
+    if (outer != NULL) {
+        slot_getallattrs(outer);
+    }
+    if (inner != NULL) {
+        slot_getallattrs(inner);
+    }
+    for (int i = 0; i < natts; i++) {
+        const bool is_outer = i < state->outer_natts;
+        TupleTableSlot* from = is_outer ? outer : inner;
+        const int attno = is_outer ? i : i - state->outer_natts;
+
+        if (from == NULL) {
+            slot->tts_values[i] = (Datum)0;
+            slot->tts_isnull[i] = true;
+        }
+        else {
+            slot->tts_values[i] = from->tts_values[attno];
+            slot->tts_isnull[i] = from->tts_isnull[attno];
+        }
+    }
+    ExecStoreVirtualTuple(slot);
+
+    return slot;
+}
+
+
+/**
+ * @brief Read all inner rows and make CmpIndex of their strings
+ *
+ * The index is left NULL when rules or exactness are NULL: 'cmp' is strict, so no rows are joined then.
+ * Will ereport(ERROR) if the rows and the index take more than 'work_mem'.
+ */
+static void
+_make_index(JoinScanState* state)
+{
+    ExprContext* econtext = state->css.ss.ps.ps_ExprContext;
+    MemoryContext oldcontext;
+    Datum rules;
+    Datum exactness;
+    bool rules_isnull;
+    bool exactness_isnull;
+
+    MemoryContextReset(state->index_context);
+    state->index = NULL;
+    state->inner_tuples = NULL;
+    state->inner_size = 0;
+    state->inner_allocated = 0;
+    state->index_made = true;
+
+    ResetExprContext(econtext);
+    econtext->ecxt_scantuple = _fill_scan_slot(state, NULL, NULL);
+    rules = ExecEvalExprSwitchContext(state->rules, econtext, &rules_isnull);
+    exactness = ExecEvalExprSwitchContext(state->exactness, econtext, &exactness_isnull);
+    if (rules_isnull || exactness_isnull) {
+        return;
+    }
+
+    oldcontext = MemoryContextSwitchTo(state->index_context);
+    stat_call_resume(&state->stat);
+    state->index = cmp_index_create(PG_DETOAST_DATUM(rules), DatumGetFloat4(exactness), state->inner_first);
+    stat_call_pause(&state->stat);
+    MemoryContextSwitchTo(oldcontext);
+
+    for (;;) {
+        TupleTableSlot* inner = ExecProcNode(state->inner);
+        Datum string;
+        bool isnull;
+        char* cstring;
+
+        if (TupIsNull(inner)) {
+            break;
+        }
+        CHECK_FOR_INTERRUPTS();
+        state->stat.counters.rows++;
+
+        ResetExprContext(econtext);
+        econtext->ecxt_scantuple = _fill_scan_slot(state, NULL, inner);
+        string = ExecEvalExprSwitchContext(state->inner_string, econtext, &isnull);
+        if (isnull) {
+            continue;
+        }
+        oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+        cstring = get_text_parameter(DatumGetTextP(string));
+
+        MemoryContextSwitchTo(state->index_context);
+        if (state->inner_size == state->inner_allocated) {
+            state->inner_allocated = state->inner_allocated == 0 ? 1024 : state->inner_allocated * 2;
+            state->inner_tuples = state->inner_tuples == NULL ?
+                MemoryContextAllocHuge(state->index_context, sizeof(*state->inner_tuples) * state->inner_allocated) :
+                repalloc_huge(state->inner_tuples, sizeof(*state->inner_tuples) * state->inner_allocated);
+        }
+        state->inner_tuples[state->inner_size++] = ExecCopySlotMinimalTuple(inner);
+        stat_call_resume(&state->stat);
+        cmp_index_add(state->index, cstring);
+        stat_call_pause(&state->stat);
+        MemoryContextSwitchTo(oldcontext);
+
+        if (state->inner_size % JOIN_SCAN_MEMORY_CHECK_ROWS == 0 &&
+                MemoryContextMemAllocated(state->index_context, true) > (Size)work_mem * 1024L) {
+            ereport(ERROR, (
+                errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                errmsg("Inner rows of %s do not fit into work_mem", JOIN_SCAN_NAME),
+                errhint("Increase work_mem, or set mipt_asj.enable_join_scan to off.")
+            ));
+        }
+    }
+}
+
+
+/**
+ * @brief Return the next pair of rows which satisfies the 'cmp' clause, as the scan tuple
+ */
+static TupleTableSlot*
+_join_scan_next(ScanState* node)
+{
+    JoinScanState* state = (JoinScanState*)node;
+    ExprContext* econtext = node->ps.ps_ExprContext;
+
+    // Every scan is an execution of the node, whether the index is made again or not
+    if (!state->started) {
+        state->started = true;
+        state->stat.counters.calls++;
+    }
+    if (!state->index_made) {
+        _make_index(state);
+    }
+
+    for (;;) {
+        TupleTableSlot* slot;
+        Datum joined;
+        bool isnull;
+
+        CHECK_FOR_INTERRUPTS();
+
+        // Read the next outer row and find inner rows for it
+        if (state->outer_slot == NULL || state->match_i == state->matches_size) {
+            TupleTableSlot* outer;
+            Datum string;
+
+            state->outer_slot = NULL;
+            if (state->index == NULL) {
+                return ExecClearTuple(node->ss_ScanTupleSlot);
+            }
+            outer = ExecProcNode(state->outer);
+            if (TupIsNull(outer)) {
+                return ExecClearTuple(node->ss_ScanTupleSlot);
+            }
+            state->stat.counters.rows++;
+
+            ResetExprContext(econtext);
+            econtext->ecxt_scantuple = _fill_scan_slot(state, outer, NULL);
+            string = ExecEvalExprSwitchContext(state->outer_string, econtext, &isnull);
+            state->outer_slot = outer;
+            state->match_i = 0;
+            state->matches_size = 0;
+            if (!isnull) {
+                MemoryContext oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+                unsigned long candidates;
+
+                stat_call_resume(&state->stat);
+                state->matches_size = cmp_index_probe(state->index, get_text_parameter(DatumGetTextP(string)), &state->matches, &candidates);
+                stat_call_pause(&state->stat);
+                state->candidates += candidates;
+                MemoryContextSwitchTo(oldcontext);
+            }
+            continue;
+        }
+
+        // Check the next pair
+        ExecStoreMinimalTuple(state->inner_tuples[state->matches[state->match_i++]], state->inner_slot, false);
+        ResetExprContext(econtext);
+        slot = _fill_scan_slot(state, state->outer_slot, state->inner_slot);
+        econtext->ecxt_scantuple = slot;
+        state->verified++;
+        joined = ExecEvalExprSwitchContext(state->clause, econtext, &isnull);
+        if (!isnull && DatumGetBool(joined)) {
+            return slot;
+        }
+    }
+}
+
+
+/**
+ * @brief Pairs are not rechecked: the node is not used when rows may have to be rechecked
+ */
+static bool
+_join_scan_recheck(ScanState* node, TupleTableSlot* slot)
+{
+    return true;
+}
+
+
+static TupleTableSlot*
+_exec_join_scan(CustomScanState* node)
+{
+    return ExecScan(&node->ss, (ExecScanAccessMtd)_join_scan_next, (ExecScanRecheckMtd)_join_scan_recheck);
+}
+
+
+static void
+_end_join_scan(CustomScanState* node)
+{
+    JoinScanState* state = (JoinScanState*)node;
+
+    ExecEndNode(state->outer);
+    ExecEndNode(state->inner);
+    MemoryContextDelete(state->index_context);
+
+    if (state->stat.counters.calls > 0) {
+        state->stat.counters.candidates = (int64)state->candidates;
+        state->stat.counters.verified = (int64)state->verified;
+        stat_add(STAT_JOIN_SCAN, &state->stat.counters);
+    }
+}
+
+
+static void
+_rescan_join_scan(CustomScanState* node)
+{
+    JoinScanState* state = (JoinScanState*)node;
+
+    // Children are not 'lefttree' and 'righttree', so changed parameters are passed to them here
+    if (node->ss.ps.chgParam != NULL) {
+        UpdateChangedParamSet(state->outer, node->ss.ps.chgParam);
+        UpdateChangedParamSet(state->inner, node->ss.ps.chgParam);
+    }
+
+    // The index is made again only if inner rows, rules or exactness may have changed
+    if (state->inner->chgParam != NULL || node->ss.ps.chgParam != NULL) {
+        state->index_made = false;
+        if (state->inner->chgParam == NULL) {
+            ExecReScan(state->inner);
+        }
+    }
+    if (state->outer->chgParam == NULL) {
+        ExecReScan(state->outer);
+    }
+    state->outer_slot = NULL;
+    state->match_i = 0;
+    state->matches_size = 0;
+    state->started = false;
+}
+
+
+static void
+_explain_join_scan(CustomScanState* node, List* ancestors, ExplainState* es)
+{
+    JoinScanState* state = (JoinScanState*)node;
+    CustomScan* cscan = (CustomScan*)node->ss.ps.plan;
+    List* context;
+
+    context = set_deparse_context_plan(es->deparse_cxt, node->ss.ps.plan, ancestors);
+    ExplainPropertyText(
+        "Join Clause",
+        deparse_expression((Node*)list_nth(cscan->custom_exprs, 4), context, es->verbose, false),
+        es
+    );
+    if (es->analyze) {
+        ExplainPropertyInteger("Candidates", NULL, (int64)state->candidates, es);
+        ExplainPropertyInteger("Verified", NULL, (int64)state->verified, es);
+    }
+}
+
+
+void
+join_scan_init(void)
+{
+    RegisterCustomScanMethods(&join_scan_methods);
+
+    prev_set_join_pathlist_hook = set_join_pathlist_hook;
+    set_join_pathlist_hook = _set_join_pathlist;
+}
@@ -0,0 +1,38 @@
+#ifndef JOIN_SCAN_H
+#define JOIN_SCAN_H
+
+/*
+ * join_scan.h
+ *      Custom join node, which joins relations by 'cmp' using
+ *      an index of tokens the strings may have in common
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/asj/join_scan.h
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "asj/cmp.h"
+
+
+/**
+ * @brief Whether the planner may join relations by 'cmp' with the custom node (GUC 'mipt_asj.enable_join_scan')
+ */
+extern bool mipt_asj_enable_join_scan;
+
+
+/**
+ * @brief Register the custom node and the planner hook that offers it
+ *
+ * An inner join whose condition contains 'mipt_asj.cmp(outer string, inner string, rules value, exactness)'
+ * (with rules and exactness not depending on joined rows) may be executed by the node.
+ * The node reads the inner relation and makes a CmpIndex of its strings;
+ * then it probes the index with every outer row, and checks every string found by 'cmp'
+ * and the rest of the join condition. The index never misses a pair 'cmp' joins, so the
+ * result is the same as the one of a nested loop.
+ */
+void join_scan_init(void);
+
+
+#endif /* JOIN_SCAN_H */
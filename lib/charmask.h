@@ -0,0 +1,54 @@
+#ifndef CHARMASK_H
+#define CHARMASK_H
+
+/*
+ * charmask.h
+ *      Character-presence bitmasks
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/charmask.h
+ *
+ * A mask has a bit set for every character present in a string. Several
+ * characters share the same bit, so masks may only be used to prove that
+ * a string does NOT contain some characters: if mask(P) is not a subset
+ * of mask(S), P can not be a subsequence of S.
+ */
+
+#include "postgres.h"
+
+
+/**
+ * @brief Mask of a single character
+ */
+static inline uint64
+char_mask(char c)
+{
+    return (uint64)1 << ((unsigned char)c & 63);
+}
+
+
+/**
+ * @brief Mask of a string
+ */
+static inline uint64
+string_char_mask(const char* s, size_t length)
+{
+    uint64 result = 0;
+    for (size_t i = 0; i < length; i++) {
+        result |= char_mask(s[i]);
+    }
+    return result;
+}
+
+
+/**
+ * @brief Check whether 'mask' is a subset of 'of'
+ */
+static inline bool
+char_mask_is_subset(uint64 mask, uint64 of)
+{
+    return (mask & ~of) == 0;
+}
+
+
+#endif /* CHARMASK_H */
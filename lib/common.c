@@ -8,6 +8,82 @@
 
 #include "common.h"
 
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+
+void
+string_pairs_init(StringPairRows* rows)
+{
+    *rows = (StringPairRows){
+        .size = 0,
+        .allocated = 0,
+        .pairs = NULL,
+        .arena = NULL,
+        .arena_size = 0,
+        .arena_allocated = 0,
+        .context = CurrentMemoryContext
+    };
+}
+
+
+Size
+string_pairs_add_string(StringPairRows* rows, const char* string, Size length)
+{
+    const Size offset = INTALIGN(rows->arena_size);
+    const Size end = offset + VARHDRSZ + length;
+
+    if (end > rows->arena_allocated) {
+        rows->arena_allocated = Max(rows->arena_allocated * 2, Max(end, 1024));
+        rows->arena = rows->arena == NULL ?
+            MemoryContextAllocHuge(rows->context, rows->arena_allocated) :
+            repalloc_huge(rows->arena, rows->arena_allocated);
+    }
+
+    SET_VARSIZE(rows->arena + offset, VARHDRSZ + length);
+    memcpy(VARDATA(rows->arena + offset), string, length);
+    rows->arena_size = end;
+
+    return offset;
+}
+
+
+void
+string_pairs_add(StringPairRows* rows, Size offset1, Size offset2)
+{
+    if (rows->size == rows->allocated) {
+        rows->allocated = rows->allocated == 0 ? 64 : rows->allocated * 2;
+        rows->pairs = rows->pairs == NULL ?
+            MemoryContextAllocHuge(rows->context, sizeof(*rows->pairs) * 2 * rows->allocated) :
+            repalloc_huge(rows->pairs, sizeof(*rows->pairs) * 2 * rows->allocated);
+    }
+
+    rows->pairs[rows->size * 2] = offset1;
+    rows->pairs[rows->size * 2 + 1] = offset2;
+    rows->size += 1;
+}
+
+
+void
+string_pairs_materialize(FunctionCallInfo fcinfo, const StringPairRows* rows)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+    Datum values[2];
+    bool nulls[2] = {false, false};
+
+#if PG_VERSION_NUM >= 160000
+    InitMaterializedSRF(fcinfo, 0);
+#else
+    SetSingleFuncCall(fcinfo, 0);
+#endif
+
+    for (unsigned long i = 0; i < rows->size; i++) {
+        values[0] = PointerGetDatum(rows->arena + rows->pairs[i * 2]);
+        values[1] = PointerGetDatum(rows->arena + rows->pairs[i * 2 + 1]);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+}
+
 
 TokenSequence
 tokenize(const char* string, const char* delim)
@@ -32,7 +108,7 @@ tokenize(const char* string, const char* delim)
                 palloc(sizeof(*result.ts) * size_allocated) :
                 repalloc(result.ts, sizeof(*result.ts) * size_allocated);
         }
-        result.ts[result.size++] = next;
+        result.ts[result.size++] = make_token(next, strlen(next));
         next = strtok(NULL, delim);
     }
 
@@ -47,6 +123,6 @@ tokenize(const char* string, const char* delim)
 int
 cmp_tokens_wrapper(const void* a, const void* b)
 {
-    return cmp_tokens(*(const char**)a, *(const char**)b);
+    return cmp_tokens((const Token*)a, (const Token*)b);
 }
 
@@ -12,6 +12,7 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include "common/hashfn.h"
 #include "executor/spi.h"
 #include "utils/builtins.h"
 #include "funcapi.h"
@@ -19,83 +20,120 @@
 
 /**
  * @brief Internal representation of StringPairRows.
+ *
+ * Every string is stored once, as a ready 'text' value, in a single arena;
+ * pairs refer to strings by their offsets in it.
  */
 typedef struct StringPairRows_t {
+    /// Number of pairs
     unsigned long size;
-    char*** pairs;
-    /**
-     * Elements, already returned to user
-     */
-    unsigned long read;
+    unsigned long allocated;
+    /// Offsets of pair elements in 'arena', two per pair
+    Size* pairs;
+
+    /// 'text' values, each starting at an INTALIGN'ed offset
+    char* arena;
+    Size arena_size;
+    Size arena_allocated;
+
+    /// Context 'pairs' and 'arena' are allocated in
+    MemoryContext context;
 } StringPairRows;
 
 
+/**
+ * Offset of a string which was not added to StringPairRows yet
+ */
+#define STRING_PAIRS_NO_OFFSET ((Size)-1)
+
+
+/**
+ * @brief Token, with its length and hash cached for fast comparisons
+ */
+typedef struct {
+    /// Null-terminated value
+    const char* s;
+    /// Length of 's'
+    uint32 len;
+    /// Hash of 's'
+    uint32 hash;
+} Token;
+
+
 /**
  * @brief ojbect to store tokenized strings in
  */
 typedef struct {
     unsigned long size;
     /**
-     * Token values
+     * Tokens
      */
-    char** ts;
+    Token* ts;
 } TokenSequence;
 
 
 /**
- * @brief Remove element from TokenSequence
- *
- * @param ts
- * @param i
- *
- * @return char* removed pointer
+ * @brief Make a Token of a null-terminated string of known length
  */
-inline char*
-remove_from_token_sequence(TokenSequence* ts, unsigned long i)
+inline Token
+make_token(const char* s, uint32 len)
 {
-    char* result;
-    for (unsigned long j = i + 1; j < ts->size; j++) {
-        ts->ts[j - 1] = ts->ts[j];
-    }
+    return (Token){s, len, hash_bytes((const unsigned char*)s, len)};
+}
 
-    result = ts->ts[ts->size - 1];
-    ts->ts[ts->size - 1] = NULL;
-    ts->size -= 1;
 
-    if (ts->size == 0) {
-        pfree(ts->ts);
-        ts->ts = NULL;
-    }
-    else {
-        ts->ts = repalloc(ts->ts, ts->size);
-    }
+/**
+ * @brief Initialize empty StringPairRows in current memory context
+ */
+void
+string_pairs_init(StringPairRows* rows);
 
-    return result;
-}
+
+/**
+ * @brief Add a string to StringPairRows arena
+ *
+ * @param string
+ * @param length length of 'string', without terminating null
+ *
+ * @return offset of the string, to be passed to 'string_pairs_add'
+ */
+Size
+string_pairs_add_string(StringPairRows* rows, const char* string, Size length);
 
 
 /**
- * @brief Return table name by given Oid. SPI must be prepared.
+ * @brief Add a pair of strings, already present in StringPairRows arena
+ */
+void
+string_pairs_add(StringPairRows* rows, Size offset1, Size offset2);
+
+
+/**
+ * @brief Return StringPairRows from a set-returning function in materialize mode
  *
- * @return palloc'ed pointer to table name
- * Will elog(ERROR) in case requested table does not exist
+ * Tuples are formed from the 'text' values in the arena directly and put
+ * into a tuplestore, so 'rows' may be released once this function returns.
  */
-inline char*
-get_table_name_by_oid(Oid oid)
-{
-    char query[32];
-    char* result;
+void
+string_pairs_materialize(FunctionCallInfo fcinfo, const StringPairRows* rows);
 
-    sprintf(query, "SELECT %d::regclass;", oid);
-    if (SPI_execute(query, true, 0) < 0 || SPI_tuptable == NULL || SPI_processed != 1) {
-        return NULL;
-    }
-    result = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
-    SPI_freetuptable(SPI_tuptable);
 
-    if (result == NULL) {
-        elog(ERROR, "Table with OID %d not found", oid);
+/**
+ * @brief Remove element from TokenSequence, keeping the order of others
+ *
+ * @param ts
+ * @param i
+ *
+ * @return Token removed
+ */
+inline Token
+remove_from_token_sequence(TokenSequence* ts, unsigned long i)
+{
+    Token result = ts->ts[i];
+    for (unsigned long j = i + 1; j < ts->size; j++) {
+        ts->ts[j - 1] = ts->ts[j];
     }
+    ts->size -= 1;
 
     return result;
 }
@@ -126,6 +164,8 @@ get_text_parameter(const void *PTR)
 /**
  * @brief Tokenize given string using provided delimeter
  *
+ * Tokens point into a single palloc'ed copy of the string.
+ *
  * @param string
  * @param delim delimeter used by strtok
  * @return Token sequence
@@ -137,17 +177,32 @@ tokenize(const char* string, const char* delim);
 
 
 /**
- * @brief Compare token sequences using special ("reverse") metric
+ * @brief Check two tokens are equal
+ *
+ * Most unequal tokens are told apart by length or hash, without comparing their values.
+ */
+inline bool
+tokens_equal(const Token* t1, const Token* t2)
+{
+    return t1->len == t2->len && t1->hash == t2->hash && memcmp(t1->s, t2->s, t1->len) == 0;
+}
+
+
+/**
+ * @brief Compare tokens using special ("reverse") metric: longer tokens go first
  */
 inline int
-cmp_tokens(const char* t1, const char* t2)
+cmp_tokens(const Token* t1, const Token* t2)
 {
-    return strlen(t1) == strlen(t2) ? strcmp(t1, t2) : strlen(t2) - strlen(t1);
+    if (t1->len != t2->len) {
+        return t2->len > t1->len ? 1 : -1;
+    }
+    return memcmp(t1->s, t2->s, t1->len);
 }
 
 
 /**
- * @brief Wrapper around 'cmp_tokens' for qsort
+ * @brief Wrapper around 'cmp_tokens' for qsort of Token array
  */
 int
 cmp_tokens_wrapper(const void* a, const void* b);
@@ -0,0 +1,234 @@
+/*
+ * hashset.c
+ *      Open-addressing hash set of 64-bit keys
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/hashset.c
+ */
+
+#include "hashset.h"
+
+#include "common/hashfn.h"
+#include "utils/memutils.h"
+
+
+/**
+ * @brief Hash a key (murmur3 64-bit finalizer)
+ */
+static inline uint64
+_hash(uint64 key)
+{
+    key ^= key >> 33;
+    key *= UINT64CONST(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+
+/**
+ * @brief Allocate 'capacity' empty slots
+ */
+static uint64*
+_slots_create(uint64 capacity)
+{
+    uint64* slots = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*slots) * capacity);
+    memset(slots, 0xFF, sizeof(*slots) * capacity);
+    return slots;
+}
+
+
+/**
+ * @brief Put a key into slots without any checks
+ *
+ * @return true if the key was not present before
+ */
+static inline bool
+_slots_put(uint64* slots, uint64 capacity, uint64 key)
+{
+    uint64 i = _hash(key) & (capacity - 1);
+    while (slots[i] != HASHSET_EMPTY) {
+        if (slots[i] == key) {
+            return false;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i] = key;
+    return true;
+}
+
+
+/**
+ * @brief Double the number of slots
+ */
+static void
+_grow(HashSet* set)
+{
+    const uint64 capacity = set->capacity * 2;
+    uint64* slots = _slots_create(capacity);
+
+    for (uint64 i = 0; i < set->capacity; i++) {
+        if (set->slots[i] != HASHSET_EMPTY) {
+            _slots_put(slots, capacity, set->slots[i]);
+        }
+    }
+
+    pfree(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+}
+
+
+void
+hashset_init(HashSet* set, uint64 expected_size)
+{
+    uint64 capacity = 16;
+    while (capacity < expected_size * 2) {
+        capacity *= 2;
+    }
+
+    set->size = 0;
+    set->capacity = capacity;
+    set->slots = _slots_create(capacity);
+    set->contains_empty = false;
+}
+
+
+bool
+hashset_insert(HashSet* set, uint64 key)
+{
+    if (key == HASHSET_EMPTY) {
+        if (set->contains_empty) {
+            return false;
+        }
+        set->contains_empty = true;
+        set->size += 1;
+        return true;
+    }
+
+    if ((set->size + 1) * 2 > set->capacity) {
+        _grow(set);
+    }
+    if (!_slots_put(set->slots, set->capacity, key)) {
+        return false;
+    }
+    set->size += 1;
+    return true;
+}
+
+
+bool
+hashset_contains(const HashSet* set, uint64 key)
+{
+    uint64 i;
+
+    if (key == HASHSET_EMPTY) {
+        return set->contains_empty;
+    }
+
+    i = _hash(key) & (set->capacity - 1);
+    while (set->slots[i] != HASHSET_EMPTY) {
+        if (set->slots[i] == key) {
+            return true;
+        }
+        i = (i + 1) & (set->capacity - 1);
+    }
+    return false;
+}
+
+
+void
+hashset_free(HashSet* set)
+{
+    if (set->slots != NULL) {
+        pfree(set->slots);
+    }
+    set->slots = NULL;
+    set->size = 0;
+    set->capacity = 0;
+    set->contains_empty = false;
+}
+
+
+/**
+ * @brief Put a C-string key into slots without any checks
+ *
+ * @return true if the key was not present before
+ */
+static inline bool
+_string_slots_put(const char** slots, uint32* hashes, uint64 capacity, const char* key, uint32 hash)
+{
+    uint64 i = _hash(hash) & (capacity - 1);
+    while (slots[i] != NULL) {
+        if (hashes[i] == hash && strcmp(slots[i], key) == 0) {
+            return false;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i] = key;
+    hashes[i] = hash;
+    return true;
+}
+
+
+void
+string_hashset_init(StringHashSet* set, uint64 expected_size)
+{
+    uint64 capacity = 16;
+    while (capacity < expected_size * 2) {
+        capacity *= 2;
+    }
+
+    set->size = 0;
+    set->capacity = capacity;
+    set->slots = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*set->slots) * capacity);
+    memset(set->slots, 0, sizeof(*set->slots) * capacity);
+    set->hashes = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*set->hashes) * capacity);
+}
+
+
+bool
+string_hashset_insert(StringHashSet* set, const char* key)
+{
+    const uint32 hash = hash_bytes((const unsigned char*)key, strlen(key));
+
+    if ((set->size + 1) * 2 > set->capacity) {
+        const uint64 capacity = set->capacity * 2;
+        const char** slots = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*slots) * capacity);
+        uint32* hashes = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*hashes) * capacity);
+
+        memset(slots, 0, sizeof(*slots) * capacity);
+        for (uint64 i = 0; i < set->capacity; i++) {
+            if (set->slots[i] != NULL) {
+                _string_slots_put(slots, hashes, capacity, set->slots[i], set->hashes[i]);
+            }
+        }
+        pfree(set->slots);
+        pfree(set->hashes);
+        set->slots = slots;
+        set->hashes = hashes;
+        set->capacity = capacity;
+    }
+
+    if (!_string_slots_put(set->slots, set->hashes, set->capacity, key, hash)) {
+        return false;
+    }
+    set->size += 1;
+    return true;
+}
+
+
+void
+string_hashset_free(StringHashSet* set)
+{
+    if (set->slots != NULL) {
+        pfree(set->slots);
+        pfree(set->hashes);
+    }
+    set->slots = NULL;
+    set->hashes = NULL;
+    set->size = 0;
+    set->capacity = 0;
+}
+
@@ -0,0 +1,136 @@
+#ifndef HASHSET_H
+#define HASHSET_H
+
+/*
+ * hashset.h
+ *      Open-addressing hash set of 64-bit keys
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/hashset.h
+ *
+ * Keys are stored in a single flat array of slots (linear probing),
+ * so no per-key allocation is made. The table is kept at most half full
+ * and doubles when this limit is reached.
+ *
+ * A similar set of C-strings is provided. It stores pointers to keys
+ * and never copies them.
+ */
+
+#include "postgres.h"
+
+
+/**
+ * @brief Hash set of uint64 keys
+ */
+typedef struct {
+    /// Number of keys stored
+    uint64 size;
+    /// Number of slots; always a power of 2
+    uint64 capacity;
+    /// Slots. HASHSET_EMPTY marks a free slot
+    uint64* slots;
+    /// Whether HASHSET_EMPTY itself is a member of the set
+    bool contains_empty;
+} HashSet;
+
+
+/**
+ * @brief Hash set of C-strings
+ */
+typedef struct {
+    /// Number of keys stored
+    uint64 size;
+    /// Number of slots; always a power of 2
+    uint64 capacity;
+    /// Slots. NULL marks a free slot
+    const char** slots;
+    /// Hashes of keys in slots
+    uint32* hashes;
+} StringHashSet;
+
+
+/**
+ * Value of an unused slot
+ */
+#define HASHSET_EMPTY (~(uint64)0)
+
+
+/**
+ * @brief Pack a pair of 32-bit values into a single key
+ */
+static inline uint64
+hashset_pack_pair(uint32 a, uint32 b)
+{
+    return ((uint64)a << 32) | (uint64)b;
+}
+
+
+/**
+ * @brief Unpack a key created by 'hashset_pack_pair'
+ */
+static inline void
+hashset_unpack_pair(uint64 key, uint32* a, uint32* b)
+{
+    *a = (uint32)(key >> 32);
+    *b = (uint32)key;
+}
+
+
+/**
+ * @brief Initialize an empty HashSet in current memory context
+ *
+ * @param expected_size expected number of keys to be inserted
+ */
+void
+hashset_init(HashSet* set, uint64 expected_size);
+
+
+/**
+ * @brief Insert a key into HashSet
+ *
+ * @return true if the key was inserted; false if it was already present
+ */
+bool
+hashset_insert(HashSet* set, uint64 key);
+
+
+/**
+ * @brief Check whether a key is present in HashSet
+ */
+bool
+hashset_contains(const HashSet* set, uint64 key);
+
+
+/**
+ * @brief Release memory occupied by HashSet
+ */
+void
+hashset_free(HashSet* set);
+
+
+/**
+ * @brief Initialize an empty StringHashSet in current memory context
+ *
+ * @param expected_size expected number of keys to be inserted
+ */
+void
+string_hashset_init(StringHashSet* set, uint64 expected_size);
+
+
+/**
+ * @brief Insert a key into StringHashSet. The key is not copied
+ *
+ * @return true if the key was inserted; false if an equal key was already present
+ */
+bool
+string_hashset_insert(StringHashSet* set, const char* key);
+
+
+/**
+ * @brief Release memory occupied by StringHashSet (but not by its keys)
+ */
+void
+string_hashset_free(StringHashSet* set);
+
+
+#endif /* HASHSET_H */
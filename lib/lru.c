@@ -0,0 +1,76 @@
+/*
+ * lru.c
+ *      Bounded least-recently-used cache of scores
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/lru.c
+ */
+
+#include "lru.h"
+
+#include "utils/memutils.h"
+
+
+LruCache*
+lru_create(MemoryContext parent, const char* name, long capacity)
+{
+    MemoryContext context = AllocSetContextCreate(parent, name, ALLOCSET_DEFAULT_SIZES);
+    LruCache* cache = MemoryContextAlloc(context, sizeof(*cache));
+    HASHCTL ctl;
+
+    ctl.keysize = sizeof(LruKey);
+    ctl.entrysize = sizeof(LruEntry);
+    ctl.hcxt = context;
+
+    cache->capacity = Max(capacity, 1);
+    cache->entries = hash_create(name, cache->capacity, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    dlist_init(&cache->used);
+    cache->context = context;
+
+    return cache;
+}
+
+
+bool
+lru_lookup(LruCache* cache, const LruKey* key, ScoreBounds* score)
+{
+    LruEntry* entry = hash_search(cache->entries, key, HASH_FIND, NULL);
+
+    if (entry == NULL) {
+        return false;
+    }
+    dlist_move_head(&cache->used, &entry->node);
+    *score = entry->score;
+    return true;
+}
+
+
+void
+lru_insert(LruCache* cache, const LruKey* key, ScoreBounds score)
+{
+    LruEntry* entry;
+    bool found;
+
+    if (hash_get_num_entries(cache->entries) >= cache->capacity &&
+            hash_search(cache->entries, key, HASH_FIND, NULL) == NULL) {
+        LruEntry* evicted = dlist_tail_element(LruEntry, node, &cache->used);
+        dlist_delete(&evicted->node);
+        hash_search(cache->entries, &evicted->key, HASH_REMOVE, NULL);
+    }
+
+    entry = hash_search(cache->entries, key, HASH_ENTER, &found);
+    if (found) {
+        dlist_move_head(&cache->used, &entry->node);
+    }
+    else {
+        dlist_push_head(&cache->used, &entry->node);
+    }
+    entry->score = score;
+}
+
+
+void
+lru_destroy(LruCache* cache)
+{
+    MemoryContextDelete(cache->context);
+}
@@ -0,0 +1,93 @@
+#ifndef LRU_H
+#define LRU_H
+
+/*
+ * lru.h
+ *      Bounded least-recently-used cache of scores
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/lru.h
+ *
+ * Entries are kept in a dynahash table, and linked into a list ordered
+ * by the time of last use. When the cache is full, the least recently
+ * used entry is evicted.
+ *
+ * A score may be known only approximately: every entry keeps its bounds.
+ */
+
+#include "postgres.h"
+
+#include "lib/ilist.h"
+#include "utils/hsearch.h"
+
+
+/**
+ * @brief Cache key: hashes of two strings and a version of data they were scored with
+ */
+typedef struct {
+    uint64 hash1;
+    uint64 hash2;
+    uint64 version;
+} LruKey;
+
+
+/**
+ * @brief Bounds of a score; equal when the score is known exactly
+ */
+typedef struct {
+    double lower;
+    double upper;
+} ScoreBounds;
+
+
+typedef struct {
+    /// Must be the first field (dynahash requirement)
+    LruKey key;
+    ScoreBounds score;
+    /// Node in 'LruCache.used'
+    dlist_node node;
+} LruEntry;
+
+
+typedef struct {
+    /// Maximum number of entries
+    long capacity;
+    HTAB* entries;
+    /// Entries, most recently used first
+    dlist_head used;
+    /// Context all entries are allocated in
+    MemoryContext context;
+} LruCache;
+
+
+/**
+ * @brief Create an empty cache in a new child of 'parent' context
+ */
+LruCache*
+lru_create(MemoryContext parent, const char* name, long capacity);
+
+
+/**
+ * @brief Look up a score, marking it as used
+ *
+ * @return whether the key was found; 'score' is set only if it was
+ */
+bool
+lru_lookup(LruCache* cache, const LruKey* key, ScoreBounds* score);
+
+
+/**
+ * @brief Insert or replace a score, evicting the least recently used one if the cache is full
+ */
+void
+lru_insert(LruCache* cache, const LruKey* key, ScoreBounds score);
+
+
+/**
+ * @brief Release all memory of the cache
+ */
+void
+lru_destroy(LruCache* cache);
+
+
+#endif /* LRU_H */
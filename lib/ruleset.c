@@ -0,0 +1,152 @@
+/*
+ * ruleset.c
+ *      Tokenized abbreviation rules in a single flat block of memory
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/ruleset.c
+ */
+
+#include "ruleset.h"
+
+#include "common/hashfn.h"
+#include "utils/memutils.h"
+
+
+RuleSet*
+ruleset_build(const TextRows* rows)
+{
+    // Tokenized sides of every rule: abbreviation and full form
+    TokenSequence* sides = palloc(sizeof(*sides) * Max(rows->size * 2, 1));
+    Size ntokens = 0;
+    Size strings_size = 0;
+    Size size;
+    uint64 version = 0;
+
+    RuleSet* result;
+    RuleSetRule* rules;
+    RuleSetToken* tokens;
+    char* strings;
+    uint32 token_i = 0;
+    uint32 strings_used = 0;
+
+    for (unsigned long i = 0; i < rows->size * 2; i++) {
+        const char* value = rows->values[i];
+
+        // Include terminating null, so that ("a b", "c") and ("a", "b c") differ
+        version = hash_combine64(version, hash_bytes_extended((const unsigned char*)value, strlen(value) + 1, 0));
+
+        sides[i] = tokenize(value, " ");
+        pg_qsort(sides[i].ts, sides[i].size, sizeof(*sides[i].ts), cmp_tokens_wrapper);
+        ntokens += sides[i].size;
+        for (unsigned long t = 0; t < sides[i].size; t++) {
+            strings_size += sides[i].ts[t].len + 1;
+        }
+    }
+
+    if (ntokens > PG_UINT32_MAX || strings_size > PG_UINT32_MAX) {
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("Too many abbreviation rules")));
+    }
+
+    size = MAXALIGN(sizeof(RuleSet)) + sizeof(RuleSetRule) * rows->size + sizeof(RuleSetToken) * ntokens + strings_size;
+    if (!AllocSizeIsValid(size)) {
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("Too many abbreviation rules")));
+    }
+    result = palloc0(size);
+    SET_VARSIZE(result, size);
+    result->nrules = rows->size;
+    result->ntokens = ntokens;
+    result->strings_size = strings_size;
+    result->version = version;
+
+    rules = RULESET_RULES(result);
+    tokens = RULESET_TOKENS(result);
+    strings = RULESET_STRINGS(result);
+    for (unsigned long i = 0; i < rows->size; i++) {
+        uint32* starts[2] = {&rules[i].abbr, &rules[i].full};
+        uint32* counts[2] = {&rules[i].abbr_count, &rules[i].full_count};
+
+        for (int j = 0; j < 2; j++) {
+            const TokenSequence side = sides[i * 2 + j];
+
+            *starts[j] = token_i;
+            *counts[j] = side.size;
+            for (unsigned long t = 0; t < side.size; t++) {
+                tokens[token_i] = (RuleSetToken){strings_used, side.ts[t].len, side.ts[t].hash};
+                memcpy(strings + strings_used, side.ts[t].s, side.ts[t].len + 1);
+                strings_used += side.ts[t].len + 1;
+                token_i += 1;
+            }
+        }
+    }
+
+    return result;
+}
+
+
+RuleSet*
+ruleset_from_value(const struct varlena* value)
+{
+    const Size size = VARSIZE(value);
+    RuleSet* result;
+    const RuleSetRule* rules;
+    RuleSetToken* tokens;
+    const char* strings;
+    uint64 expected_size;
+
+    if (size < MAXALIGN(sizeof(RuleSet))) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid rule set value")));
+    }
+    result = palloc(size);
+    memcpy(result, value, size);
+
+    expected_size = (uint64)MAXALIGN(sizeof(RuleSet)) +
+        (uint64)sizeof(RuleSetRule) * result->nrules +
+        (uint64)sizeof(RuleSetToken) * result->ntokens +
+        result->strings_size;
+    if (expected_size != size) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid rule set value")));
+    }
+
+    rules = RULESET_RULES(result);
+    tokens = RULESET_TOKENS(result);
+    strings = RULESET_STRINGS(result);
+    for (uint32 i = 0; i < result->nrules; i++) {
+        if ((uint64)rules[i].abbr + rules[i].abbr_count > result->ntokens ||
+                (uint64)rules[i].full + rules[i].full_count > result->ntokens) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid rule set value")));
+        }
+    }
+    for (uint32 i = 0; i < result->ntokens; i++) {
+        if ((uint64)tokens[i].offset + tokens[i].len >= result->strings_size ||
+                strings[tokens[i].offset + tokens[i].len] != '\0') {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("Invalid rule set value")));
+        }
+        tokens[i].hash = make_token(strings + tokens[i].offset, tokens[i].len).hash;
+    }
+    // 'version' of the value can not be trusted to identify its contents
+    result->version = ruleset_value_hash(value);
+
+    return result;
+}
+
+
+uint64
+ruleset_value_hash(const struct varlena* value)
+{
+    return hash_bytes_extended((const unsigned char*)value, VARSIZE(value), 0);
+}
+
+
+Token*
+ruleset_tokens(const RuleSet* rs)
+{
+    const RuleSetToken* tokens = RULESET_TOKENS(rs);
+    const char* strings = RULESET_STRINGS(rs);
+    Token* result = palloc(sizeof(*result) * Max(rs->ntokens, 1));
+
+    for (uint32 i = 0; i < rs->ntokens; i++) {
+        result[i] = (Token){strings + tokens[i].offset, tokens[i].len, tokens[i].hash};
+    }
+
+    return result;
+}
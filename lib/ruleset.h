@@ -0,0 +1,103 @@
+#ifndef RULESET_H
+#define RULESET_H
+
+/*
+ * ruleset.h
+ *      Tokenized abbreviation rules in a single flat block of memory
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/ruleset.h
+ *
+ * A RuleSet contains no pointers: rules refer to tokens by indexes, and
+ * tokens refer to their values by offsets. It may thus be placed in shared
+ * memory and read by any backend, wherever it is mapped.
+ *
+ * A RuleSet starts with a varlena header, and is a valid 'bytea' value.
+ */
+
+#include "postgres.h"
+
+#include "lib/common.h"
+#include "lib/scan.h"
+
+
+typedef struct {
+    /// Offset of the null-terminated value in strings area
+    uint32 offset;
+    uint32 len;
+    uint32 hash;
+} RuleSetToken;
+
+
+/**
+ * @brief A rule. Tokens of each side are SORTED by 'cmp_tokens'
+ */
+typedef struct {
+    /// Index of the first abbreviation token
+    uint32 abbr;
+    uint32 abbr_count;
+    /// Index of the first full form token
+    uint32 full;
+    uint32 full_count;
+} RuleSetRule;
+
+
+typedef struct {
+    /// varlena header; do not touch directly
+    int32 vl_len_;
+    uint32 nrules;
+    uint32 ntokens;
+    uint32 strings_size;
+    /// Hash of rules' contents; of the whole value, when made by 'ruleset_from_value'
+    uint64 version;
+    /* RuleSetRule rules[nrules], RuleSetToken tokens[ntokens], char strings[strings_size] follow */
+} RuleSet;
+
+
+#define RULESET_RULES(rs) ((RuleSetRule*)((char*)(rs) + MAXALIGN(sizeof(RuleSet))))
+#define RULESET_TOKENS(rs) ((RuleSetToken*)(RULESET_RULES(rs) + (rs)->nrules))
+#define RULESET_STRINGS(rs) ((char*)(RULESET_TOKENS(rs) + (rs)->ntokens))
+
+
+/**
+ * @brief Build a RuleSet from rows (abbreviation, full form)
+ *
+ * Result is allocated in current memory context.
+ */
+RuleSet*
+ruleset_build(const TextRows* rows);
+
+
+/**
+ * @brief Make a RuleSet of a 'bytea' value, which is not trusted
+ *
+ * The value is copied into current memory context (so that it is properly
+ * aligned), and checked to be a well-formed RuleSet; hashes of tokens and
+ * 'version' are recalculated. Will ereport(ERROR) if the value is not a RuleSet.
+ *
+ * @param value detoasted value
+ */
+RuleSet*
+ruleset_from_value(const struct varlena* value);
+
+
+/**
+ * @brief Hash of a 'bytea' value, which is 'version' of the RuleSet made of it by 'ruleset_from_value'
+ *
+ * @param value detoasted value
+ */
+uint64
+ruleset_value_hash(const struct varlena* value);
+
+
+/**
+ * @brief Make Tokens of all tokens of a RuleSet
+ *
+ * Tokens point into 'rs' and are valid as long as it is.
+ * Result is allocated in current memory context.
+ */
+Token*
+ruleset_tokens(const RuleSet* rs);
+
+
+#endif /* RULESET_H */
@@ -0,0 +1,782 @@
+/*
+ * ruleset_cache.c
+ *      Cache of RuleSets in shared memory, common for all backends
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/ruleset_cache.c
+ */
+
+#include "ruleset_cache.h"
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_inherits.h"
+#include "executor/executor.h"
+#include "parser/parsetree.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/utility.h"
+#include "utils/dsa.h"
+#include "utils/fmgroids.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+
+/**
+ * Maximum number of RuleSets in the cache
+ */
+#define RULESET_CACHE_ENTRIES 32
+
+/**
+ * Number of slots tables are spread over (by OID) to remember their last change
+ */
+#define RULESET_CACHE_CHANGE_SLOTS 256
+
+#define RULESET_CACHE_NAME "mipt-asj rulesets"
+
+
+/**
+ * Set of slots of 'RulesetCacheShared.changes'
+ */
+typedef struct {
+    uint32 words[RULESET_CACHE_CHANGE_SLOTS / 32];
+} ChangeSlots;
+
+
+typedef struct {
+    /// RuleSet in 'area'; InvalidDsaPointer if the entry is free
+    dsa_pointer ruleset;
+    Oid relid;
+    NameData abbr_column;
+    NameData full_column;
+    /// xmin of the table 'pg_class' row when the rules were read
+    TransactionId xmin;
+    /// Number of users of the RuleSet
+    uint32 pins;
+    /// Slots of the rules table and of tables it inherits, whose changes make the RuleSet outdated
+    ChangeSlots slots;
+    /// The RuleSet is outdated (or the entry is free), and is freed when the last user unpins it
+    bool stale;
+    /// Value of 'RulesetCacheShared.clock' when the RuleSet was last used
+    uint64 last_used;
+} RulesetCacheEntry;
+
+
+typedef struct {
+    /// Protects all fields, except atomic ones
+    LWLock* lock;
+    int area_tranche;
+    /// Handle of 'area'; DSA_HANDLE_INVALID until the area is created by the first user
+    dsa_handle area_handle;
+    /**
+     * The newest transaction which changed a table of every slot (see '_change_slot'),
+     * recorded just before it commits
+     */
+    pg_atomic_uint32 changes[RULESET_CACHE_CHANGE_SLOTS];
+    /// Number of entries of every slot which are not stale, and of entries being stored
+    pg_atomic_uint32 cached[RULESET_CACHE_CHANGE_SLOTS];
+    /// Logical clock for LRU eviction
+    uint64 clock;
+    RulesetCacheEntry entries[RULESET_CACHE_ENTRIES];
+} RulesetCacheShared;
+
+
+/**
+ * @brief Pin of a RuleSet, released by 'owner' context reset callback
+ */
+typedef struct {
+    MemoryContextCallback callback;
+    RulesetCacheEntry* entry;
+} RulesetPin;
+
+
+static RulesetCacheShared* shared = NULL;
+static dsa_area* area = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorStart_hook_type prev_executor_start_hook = NULL;
+static ProcessUtility_hook_type prev_process_utility_hook = NULL;
+
+// Slots of tables changed by current transaction
+static bool changes_pending[RULESET_CACHE_CHANGE_SLOTS];
+static bool change_pending = false;
+static bool xact_callback_registered = false;
+
+// Pins of every entry held by this backend, released when it exits
+static uint32 local_pins[RULESET_CACHE_ENTRIES];
+
+
+static void
+_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook != NULL) {
+        prev_shmem_request_hook();
+    }
+#endif
+    RequestAddinShmemSpace(MAXALIGN(sizeof(RulesetCacheShared)));
+    RequestNamedLWLockTranche(RULESET_CACHE_NAME, 1);
+}
+
+
+static void
+_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook != NULL) {
+        prev_shmem_startup_hook();
+    }
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    shared = ShmemInitStruct(RULESET_CACHE_NAME, sizeof(*shared), &found);
+    if (!found) {
+        shared->lock = &(GetNamedLWLockTranche(RULESET_CACHE_NAME))->lock;
+        shared->area_tranche = LWLockNewTrancheId();
+        shared->area_handle = DSA_HANDLE_INVALID;
+        for (int i = 0; i < RULESET_CACHE_CHANGE_SLOTS; i++) {
+            pg_atomic_init_u32(&shared->changes[i], InvalidTransactionId);
+            pg_atomic_init_u32(&shared->cached[i], 0);
+        }
+        shared->clock = 0;
+        for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+            shared->entries[i].ruleset = InvalidDsaPointer;
+            shared->entries[i].stale = true;
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+static void
+_release_pins(int code, Datum arg);
+
+static void
+_executor_start(QueryDesc* queryDesc, int eflags);
+
+#if PG_VERSION_NUM >= 140000
+static void
+_process_utility(PlannedStmt* pstmt, const char* queryString, bool readOnlyTree, ProcessUtilityContext context,
+                 ParamListInfo params, QueryEnvironment* queryEnv, DestReceiver* dest, QueryCompletion* qc);
+#else
+static void
+_process_utility(PlannedStmt* pstmt, const char* queryString, ProcessUtilityContext context,
+                 ParamListInfo params, QueryEnvironment* queryEnv, DestReceiver* dest, QueryCompletion* qc);
+#endif
+
+
+void
+ruleset_cache_init(void)
+{
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = _shmem_request;
+#else
+    _shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = _shmem_startup;
+    prev_executor_start_hook = ExecutorStart_hook;
+    ExecutorStart_hook = _executor_start;
+    prev_process_utility_hook = ProcessUtility_hook;
+    ProcessUtility_hook = _process_utility;
+}
+
+
+/**
+ * @brief Create or attach the DSA area. Must be called without 'shared->lock' held
+ */
+static void
+_attach_area(void)
+{
+    MemoryContext oldcontext;
+
+    if (area != NULL) {
+        return;
+    }
+
+    LWLockRegisterTranche(shared->area_tranche, RULESET_CACHE_NAME);
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    if (shared->area_handle == DSA_HANDLE_INVALID) {
+        area = dsa_create(shared->area_tranche);
+        dsa_pin(area);
+        shared->area_handle = dsa_get_handle(area);
+    }
+    else {
+        area = dsa_attach(shared->area_handle);
+    }
+    LWLockRelease(shared->lock);
+    dsa_pin_mapping(area);
+    MemoryContextSwitchTo(oldcontext);
+
+    // Memory context callbacks, which release pins otherwise, are not called on FATAL
+    before_shmem_exit(_release_pins, (Datum)0);
+}
+
+
+/**
+ * @brief Get xmin of 'pg_class' row of a table
+ */
+static TransactionId
+_relation_xmin(Oid relid)
+{
+    HeapTuple tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    TransactionId result;
+
+    if (!HeapTupleIsValid(tuple)) {
+        elog(ERROR, "cache lookup failed for relation %u", relid);
+    }
+    result = HeapTupleHeaderGetRawXmin(tuple->t_data);
+    ReleaseSysCache(tuple);
+
+    return result;
+}
+
+
+/**
+ * @brief Slot of 'RulesetCacheShared.changes' of a table
+ */
+static inline int
+_change_slot(Oid relid)
+{
+    return relid % RULESET_CACHE_CHANGE_SLOTS;
+}
+
+
+static inline bool
+_slots_contain(const ChangeSlots* slots, int slot)
+{
+    return (slots->words[slot / 32] & ((uint32)1 << (slot % 32))) != 0;
+}
+
+
+/**
+ * @brief Get slots of a table and of all tables it inherits (directly or not): rows of the
+ * table are changed by queries to any of them
+ */
+static ChangeSlots
+_change_slots(Oid relid)
+{
+    ChangeSlots result;
+    List* tables = list_make1_oid(relid);
+    Relation inherits = table_open(InheritsRelationId, AccessShareLock);
+
+    memset(&result, 0, sizeof(result));
+    for (int i = 0; i < list_length(tables); i++) {
+        const Oid table = list_nth_oid(tables, i);
+        const int slot = _change_slot(table);
+        ScanKeyData key;
+        SysScanDesc scan;
+        HeapTuple tuple;
+
+        result.words[slot / 32] |= (uint32)1 << (slot % 32);
+
+        ScanKeyInit(&key, Anum_pg_inherits_inhrelid, BTEqualStrategyNumber, F_OIDEQ, ObjectIdGetDatum(table));
+        scan = systable_beginscan(inherits, InheritsRelidSeqnoIndexId, true, NULL, 1, &key);
+        while (HeapTupleIsValid(tuple = systable_getnext(scan))) {
+            tables = list_append_unique_oid(tables, ((Form_pg_inherits)GETSTRUCT(tuple))->inhparent);
+        }
+        systable_endscan(scan);
+    }
+    table_close(inherits, AccessShareLock);
+    list_free(tables);
+
+    return result;
+}
+
+
+/**
+ * @brief Check whether tables of some slots were changed by current transaction, or by one
+ * a snapshot may not see: cached rules of them may differ from what the snapshot sees then
+ *
+ * A transaction the snapshot does not see is not older than its 'xmin'. Transactions older
+ * than the newest one recorded for a slot (which precedes 'xmin') are finished as well.
+ */
+static bool
+_slots_changed(const ChangeSlots* slots, Snapshot snapshot)
+{
+    for (int i = 0; i < RULESET_CACHE_CHANGE_SLOTS; i++) {
+        TransactionId change_xid;
+
+        if (!_slots_contain(slots, i)) {
+            continue;
+        }
+        if (changes_pending[i]) {
+            return true;
+        }
+        change_xid = pg_atomic_read_u32(&shared->changes[i]);
+        if (TransactionIdIsValid(change_xid) && !TransactionIdPrecedes(change_xid, snapshot->xmin)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief Add 'delta' to 'RulesetCacheShared.cached' of slots
+ */
+static void
+_slots_count(const ChangeSlots* slots, int32 delta)
+{
+    for (int i = 0; i < RULESET_CACHE_CHANGE_SLOTS; i++) {
+        if (_slots_contain(slots, i)) {
+            pg_atomic_fetch_add_u32(&shared->cached[i], delta);
+        }
+    }
+}
+
+
+/**
+ * @brief Find an entry which is not stale. 'shared->lock' must be held
+ */
+static RulesetCacheEntry*
+_find(Oid relid, const char* abbr_column, const char* full_column)
+{
+    for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+        RulesetCacheEntry* entry = &shared->entries[i];
+        if (DsaPointerIsValid(entry->ruleset) && !entry->stale &&
+                entry->relid == relid &&
+                strcmp(NameStr(entry->abbr_column), abbr_column) == 0 &&
+                strcmp(NameStr(entry->full_column), full_column) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Mark an entry stale, without freeing it. 'shared->lock' must be held exclusively
+ */
+static void
+_mark_stale(RulesetCacheEntry* entry)
+{
+    if (!entry->stale) {
+        entry->stale = true;
+        _slots_count(&entry->slots, -1);
+    }
+}
+
+
+/**
+ * @brief Mark an entry stale, and free it if it is not used. 'shared->lock' must be held exclusively
+ */
+static void
+_invalidate(RulesetCacheEntry* entry)
+{
+    _mark_stale(entry);
+    if (entry->pins == 0) {
+        dsa_free(area, entry->ruleset);
+        entry->ruleset = InvalidDsaPointer;
+    }
+}
+
+
+/**
+ * @brief Free all stale entries which are not used. 'shared->lock' must be held exclusively
+ *
+ * Entries are marked stale without freeing them when the area may be not attached.
+ */
+static void
+_free_stale(void)
+{
+    for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+        RulesetCacheEntry* entry = &shared->entries[i];
+        if (DsaPointerIsValid(entry->ruleset) && entry->stale && entry->pins == 0) {
+            _invalidate(entry);
+        }
+    }
+}
+
+
+static void
+_unpin(void* arg)
+{
+    RulesetCacheEntry* entry = ((RulesetPin*)arg)->entry;
+    const int i = entry - shared->entries;
+
+    // Released by '_release_pins' already
+    if (local_pins[i] == 0) {
+        return;
+    }
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    local_pins[i] -= 1;
+    entry->pins -= 1;
+    if (entry->pins == 0 && entry->stale) {
+        _invalidate(entry);
+    }
+    LWLockRelease(shared->lock);
+}
+
+
+/**
+ * @brief Release all pins held by this backend, when it exits
+ */
+static void
+_release_pins(int code, Datum arg)
+{
+    // The backend may exit with the lock held
+    if (LWLockHeldByMe(shared->lock)) {
+        LWLockRelease(shared->lock);
+    }
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+        RulesetCacheEntry* entry = &shared->entries[i];
+        if (local_pins[i] == 0) {
+            continue;
+        }
+        entry->pins -= local_pins[i];
+        local_pins[i] = 0;
+        if (entry->pins == 0 && entry->stale) {
+            _invalidate(entry);
+        }
+    }
+    LWLockRelease(shared->lock);
+}
+
+
+/**
+ * @brief Pin an entry for the lifetime of 'owner'. 'shared->lock' must be held exclusively
+ *
+ * @return RuleSet of the entry
+ */
+static const RuleSet*
+_pin(RulesetCacheEntry* entry, MemoryContext owner)
+{
+    RulesetPin* pin = MemoryContextAlloc(owner, sizeof(*pin));
+
+    entry->pins += 1;
+    local_pins[entry - shared->entries] += 1;
+    entry->last_used = ++shared->clock;
+
+    pin->entry = entry;
+    pin->callback.func = _unpin;
+    pin->callback.arg = pin;
+    MemoryContextRegisterResetCallback(owner, &pin->callback);
+
+    return dsa_get_address(area, entry->ruleset);
+}
+
+
+/**
+ * @brief Find a free entry, evicting the least recently used unpinned one if there is none.
+ * 'shared->lock' must be held exclusively
+ *
+ * @return NULL if all entries are pinned
+ */
+static RulesetCacheEntry*
+_free_entry(void)
+{
+    RulesetCacheEntry* evicted = NULL;
+
+    for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+        RulesetCacheEntry* entry = &shared->entries[i];
+        if (!DsaPointerIsValid(entry->ruleset)) {
+            return entry;
+        }
+        if (entry->pins == 0 && (evicted == NULL || entry->last_used < evicted->last_used)) {
+            evicted = entry;
+        }
+    }
+    if (evicted != NULL) {
+        _invalidate(evicted);
+    }
+    return evicted;
+}
+
+
+const RuleSet*
+ruleset_get(Oid relid, const char* abbr_column, const char* full_column, MemoryContext owner)
+{
+    const char* const columns[2] = {abbr_column, full_column};
+    TextRows rows;
+    RuleSet* built;
+    const RuleSet* result;
+    RulesetCacheEntry* entry;
+    TransactionId xmin;
+    ChangeSlots slots;
+    Snapshot snapshot;
+    dsa_pointer stored;
+
+    // Cached rules may have been read by another user
+    scan_check_columns(relid, 2, columns);
+
+    if (shared == NULL) {
+        rows = scan_text_columns(relid, 2, columns, SCAN_ROW_ID_NONE, NULL);
+        return ruleset_build(&rows);
+    }
+
+    _attach_area();
+    xmin = _relation_xmin(relid);
+    slots = _change_slots(relid);
+    snapshot = GetActiveSnapshot();
+
+    if (_slots_changed(&slots, snapshot)) {
+        rows = scan_text_columns(relid, 2, columns, SCAN_ROW_ID_NONE, NULL);
+        return ruleset_build(&rows);
+    }
+
+    // Look for cached rules. A transaction which changes the table after the check above
+    // either is not seen by the snapshot, or marks the entry stale before it commits
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    _free_stale();
+    entry = _find(relid, abbr_column, full_column);
+    if (entry != NULL && (entry->xmin != xmin || memcmp(&entry->slots, &slots, sizeof(slots)) != 0)) {
+        _invalidate(entry);
+    }
+    else if (entry != NULL) {
+        result = _pin(entry, owner);
+        LWLockRelease(shared->lock);
+        return result;
+    }
+    LWLockRelease(shared->lock);
+
+    // Read rules, without holding the lock
+    rows = scan_text_columns(relid, 2, columns, SCAN_ROW_ID_NONE, NULL);
+    built = ruleset_build(&rows);
+    result = built;
+
+    // Store the rules, unless the table was changed since they were looked for. The entry is
+    // counted before the check, so that a transaction which changes the table after the check
+    // finds it (see '_xact_callback')
+    stored = InvalidDsaPointer;
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    _slots_count(&slots, 1);
+    if (!_slots_changed(&slots, snapshot)) {
+        entry = _find(relid, abbr_column, full_column);
+        if (entry != NULL && entry->xmin == xmin && memcmp(&entry->slots, &slots, sizeof(slots)) == 0) {
+            // Stored by another backend meanwhile
+            result = _pin(entry, owner);
+        }
+        else {
+            if (entry != NULL) {
+                _invalidate(entry);
+            }
+            entry = _free_entry();
+            if (entry != NULL) {
+                stored = dsa_allocate_extended(area, VARSIZE(built), DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+            }
+            if (DsaPointerIsValid(stored)) {
+                memcpy(dsa_get_address(area, stored), built, VARSIZE(built));
+                entry->ruleset = stored;
+                entry->relid = relid;
+                namestrcpy(&entry->abbr_column, abbr_column);
+                namestrcpy(&entry->full_column, full_column);
+                entry->xmin = xmin;
+                entry->slots = slots;
+                entry->pins = 0;
+                entry->stale = false;
+                result = _pin(entry, owner);
+            }
+        }
+    }
+    if (!DsaPointerIsValid(stored)) {
+        _slots_count(&slots, -1);
+    }
+    LWLockRelease(shared->lock);
+
+    if (result != built) {
+        pfree(built);
+    }
+    return result;
+}
+
+
+/**
+ * @brief Forget tables changed by current transaction
+ */
+static void
+_changes_reset(void)
+{
+    memset(changes_pending, 0, sizeof(changes_pending));
+    change_pending = false;
+}
+
+
+/**
+ * @brief Record a change of a table of a slot by a transaction, unless a newer one is recorded
+ */
+static void
+_record_change(int slot, TransactionId xid)
+{
+    uint32 recorded = pg_atomic_read_u32(&shared->changes[slot]);
+
+    while (!TransactionIdIsValid(recorded) || TransactionIdFollows(xid, recorded)) {
+        if (pg_atomic_compare_exchange_u32(&shared->changes[slot], &recorded, xid)) {
+            break;
+        }
+    }
+}
+
+
+/**
+ * @brief Invalidate rules of tables changed by a transaction which is about to commit
+ *
+ * The change is recorded before it becomes visible, so that other backends do not
+ * cache rules read without it meanwhile. The lock is only taken when some of the
+ * changed slots have cached entries.
+ */
+static void
+_xact_callback(XactEvent event, void* arg)
+{
+    TransactionId xid;
+    bool cached = false;
+
+    if (!change_pending) {
+        return;
+    }
+
+    switch (event) {
+        case XACT_EVENT_PRE_COMMIT:
+        case XACT_EVENT_PRE_PREPARE:
+            // Tables were not changed if no transaction ID was assigned
+            xid = GetTopTransactionIdIfAny();
+            if (TransactionIdIsValid(xid)) {
+                for (int i = 0; i < RULESET_CACHE_CHANGE_SLOTS; i++) {
+                    if (changes_pending[i]) {
+                        _record_change(i, xid);
+                    }
+                }
+                // Pairs with the count of an entry being stored, made before its slots are checked
+                pg_memory_barrier();
+                for (int i = 0; i < RULESET_CACHE_CHANGE_SLOTS && !cached; i++) {
+                    cached = changes_pending[i] && pg_atomic_read_u32(&shared->cached[i]) > 0;
+                }
+            }
+            if (cached) {
+                LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+                // This backend may have no area attached; stale entries are freed by '_free_stale'
+                for (int i = 0; i < RULESET_CACHE_ENTRIES; i++) {
+                    RulesetCacheEntry* entry = &shared->entries[i];
+                    if (entry->stale) {
+                        continue;
+                    }
+                    for (int j = 0; j < RULESET_CACHE_CHANGE_SLOTS; j++) {
+                        if (changes_pending[j] && _slots_contain(&entry->slots, j)) {
+                            _mark_stale(entry);
+                            break;
+                        }
+                    }
+                }
+                LWLockRelease(shared->lock);
+            }
+            _changes_reset();
+            break;
+        case XACT_EVENT_ABORT:
+            _changes_reset();
+            break;
+        default:
+            break;
+    }
+}
+
+
+/**
+ * @brief Note a change of a table by current transaction. Tables inheriting it are
+ * covered by slots of their cached entries (see '_change_slots')
+ */
+static void
+_note_change(Oid relid)
+{
+    if (!xact_callback_registered) {
+        RegisterXactCallback(_xact_callback, NULL);
+        xact_callback_registered = true;
+    }
+    changes_pending[_change_slot(relid)] = true;
+    change_pending = true;
+}
+
+
+/**
+ * @brief Note tables a query is going to change
+ */
+static void
+_executor_start(QueryDesc* queryDesc, int eflags)
+{
+    if ((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0) {
+        ListCell* lc;
+
+        foreach(lc, queryDesc->plannedstmt->resultRelations) {
+            _note_change(rt_fetch(lfirst_int(lc), queryDesc->plannedstmt->rtable)->relid);
+        }
+    }
+
+    if (prev_executor_start_hook != NULL) {
+        prev_executor_start_hook(queryDesc, eflags);
+    }
+    else {
+        standard_ExecutorStart(queryDesc, eflags);
+    }
+}
+
+
+/**
+ * @brief Note tables 'COPY FROM' is going to change; other utility commands which change
+ * contents of tables change 'xmin' of their 'pg_class' rows as well
+ */
+#if PG_VERSION_NUM >= 140000
+static void
+_process_utility(PlannedStmt* pstmt, const char* queryString, bool readOnlyTree, ProcessUtilityContext context,
+                 ParamListInfo params, QueryEnvironment* queryEnv, DestReceiver* dest, QueryCompletion* qc)
+#else
+static void
+_process_utility(PlannedStmt* pstmt, const char* queryString, ProcessUtilityContext context,
+                 ParamListInfo params, QueryEnvironment* queryEnv, DestReceiver* dest, QueryCompletion* qc)
+#endif
+{
+    if (IsA(pstmt->utilityStmt, CopyStmt)) {
+        const CopyStmt* copy = (const CopyStmt*)pstmt->utilityStmt;
+        if (copy->is_from && copy->relation != NULL) {
+            const Oid relid = RangeVarGetRelid(copy->relation, NoLock, true);
+            if (OidIsValid(relid)) {
+                _note_change(relid);
+            }
+        }
+    }
+
+#if PG_VERSION_NUM >= 140000
+    if (prev_process_utility_hook != NULL) {
+        prev_process_utility_hook(pstmt, queryString, readOnlyTree, context, params, queryEnv, dest, qc);
+    }
+    else {
+        standard_ProcessUtility(pstmt, queryString, readOnlyTree, context, params, queryEnv, dest, qc);
+    }
+#else
+    if (prev_process_utility_hook != NULL) {
+        prev_process_utility_hook(pstmt, queryString, context, params, queryEnv, dest, qc);
+    }
+    else {
+        standard_ProcessUtility(pstmt, queryString, context, params, queryEnv, dest, qc);
+    }
+#endif
+}
+
+
+Datum
+ruleset(PG_FUNCTION_ARGS)
+{
+    const Oid relid = PG_GETARG_OID(0);
+    const char* full_column = get_text_parameter(PG_GETARG_TEXT_P(1));
+    const char* abbr_column = get_text_parameter(PG_GETARG_TEXT_P(2));
+    const RuleSet* rs = ruleset_get(relid, abbr_column, full_column, CurrentMemoryContext);
+    RuleSet* result;
+
+    // A shared RuleSet must not leave the cache
+    result = palloc(VARSIZE(rs));
+    memcpy(result, rs, VARSIZE(rs));
+    PG_RETURN_BYTEA_P(result);
+}
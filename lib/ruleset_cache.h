@@ -0,0 +1,62 @@
+#ifndef RULESET_CACHE_H
+#define RULESET_CACHE_H
+
+/*
+ * ruleset_cache.h
+ *      Cache of RuleSets in shared memory, common for all backends
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/ruleset_cache.h
+ *
+ * The cache is available only when the extension is loaded by
+ * 'shared_preload_libraries'. RuleSets are placed into a DSA area and are
+ * read by backends in place. A RuleSet is identified by the rules table OID,
+ * its column names, and xmin of its 'pg_class' row (which changes on DDL and
+ * TRUNCATE). Tables changed by queries and 'COPY FROM' are noted by executor
+ * and utility hooks: cached RuleSets of them, and of tables inheriting them,
+ * are invalidated just before a transaction which changed them commits, and
+ * are not cached again until every snapshot sees the change.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "lib/ruleset.h"
+
+
+/**
+ * @brief Request shared memory and install hooks. Must be called from _PG_init
+ * while shared preload libraries are loaded
+ */
+void
+ruleset_cache_init(void);
+
+
+/**
+ * @brief Get RuleSet of a rules table
+ *
+ * Access to the table columns is checked on every call.
+ * The RuleSet is taken from shared cache when possible, and stays pinned
+ * (will not be freed) until 'owner' context is reset or deleted. Otherwise,
+ * it is read from the table and allocated in current memory context.
+ *
+ * @param relid rules table OID
+ * @param abbr_column abbreviations column name
+ * @param full_column full forms column name
+ * @param owner context whose lifetime the RuleSet is used for
+ */
+const RuleSet*
+ruleset_get(Oid relid, const char* abbr_column, const char* full_column, MemoryContext owner);
+
+
+/**
+ * @brief Get RuleSet of a rules table as a 'bytea' value
+ *
+ * @param 0: Rules table OID
+ * @param 1: Rules table column 'full'
+ * @param 2: Rules table column 'abbr'
+ */
+Datum ruleset(PG_FUNCTION_ARGS);
+
+
+#endif /* RULESET_CACHE_H */
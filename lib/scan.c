@@ -0,0 +1,512 @@
+/*
+ * scan.c
+ *      Direct sequential scan of table columns, and reading of query results
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/scan.c
+ */
+
+#include "scan.h"
+
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "common/pg_prng.h"
+#include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/portal.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+
+
+/**
+ * Number of rows after which temporary memory is released
+ */
+#define SCAN_BATCH_SIZE 1024
+
+
+/**
+ * @brief How to convert a column value to a C-string
+ */
+typedef struct {
+    AttrNumber attnum;
+    /// Value is 'text' or binary-compatible with it
+    bool is_text;
+    /// Output function, used when 'is_text' is false
+    FmgrInfo output;
+} ScanColumn;
+
+
+/**
+ * @brief Find a column of a relation and check it may be read
+ */
+static AttrNumber
+_column_attnum(Relation relation, const char* column, bool table_readable)
+{
+    const Oid relid = RelationGetRelid(relation);
+    AttrNumber attnum = get_attnum(relid, column);
+
+    if (attnum == InvalidAttrNumber || attnum < 0) {
+        ereport(ERROR, (
+            errcode(ERRCODE_UNDEFINED_COLUMN),
+            errmsg("Column '%s' of table '%s' (OID %d) does not exist", column, RelationGetRelationName(relation), relid)
+        ));
+    }
+    if (!table_readable && pg_attribute_aclcheck(relid, attnum, GetUserId(), ACL_SELECT) != ACLCHECK_OK) {
+        ereport(ERROR, (
+            errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+            errmsg("Permission denied for column '%s' of table '%s'", column, RelationGetRelationName(relation))
+        ));
+    }
+    return attnum;
+}
+
+
+/**
+ * @brief Prepare conversion of values of a given type to C-strings
+ */
+static void
+_scan_column_init(ScanColumn* column, AttrNumber attnum, Oid type)
+{
+    column->attnum = attnum;
+    column->is_text = type == TEXTOID || type == VARCHAROID || type == BPCHAROID;
+    if (!column->is_text) {
+        Oid output_oid;
+        bool is_varlena;
+        getTypeOutputInfo(type, &output_oid, &is_varlena);
+        fmgr_info(output_oid, &column->output);
+    }
+}
+
+
+/**
+ * @brief Convert a (not NULL) value to a C-string allocated in 'resultcontext'
+ *
+ * Temporary data is allocated in current memory context.
+ */
+static char*
+_scan_column_value(ScanColumn* column, Datum value, MemoryContext resultcontext)
+{
+    char* result;
+
+    if (column->is_text) {
+        text* detoasted = DatumGetTextPP(value);
+        const int length = VARSIZE_ANY_EXHDR(detoasted);
+
+        result = MemoryContextAlloc(resultcontext, length + 1);
+        memcpy(result, VARDATA_ANY(detoasted), length);
+        result[length] = '\0';
+    }
+    else {
+        result = MemoryContextStrdup(resultcontext, OutputFunctionCall(&column->output, value));
+    }
+    return result;
+}
+
+
+/**
+ * @brief Convert a (not NULL) key value of type 'type' to int64
+ */
+static int64
+_scan_key_value(Oid type, Datum value)
+{
+    return type == INT8OID ? DatumGetInt64(value) :
+        type == INT4OID ? DatumGetInt32(value) :
+        DatumGetInt16(value);
+}
+
+
+/**
+ * @brief Make space for one more row in 'rows', allocated in 'resultcontext'
+ *
+ * @return place for values of the row
+ */
+static char**
+_text_rows_reserve(TextRows* rows, unsigned long* allocated, ScanRowId row_id, MemoryContext resultcontext)
+{
+    if (rows->size == *allocated) {
+        *allocated = *allocated == 0 ? SCAN_BATCH_SIZE : *allocated * 2;
+        if (rows->values == NULL) {
+            rows->values = MemoryContextAllocHuge(resultcontext, sizeof(*rows->values) * *allocated * rows->ncolumns);
+            if (row_id == SCAN_ROW_ID_TID) {
+                rows->tids = MemoryContextAllocHuge(resultcontext, sizeof(*rows->tids) * *allocated);
+            }
+            else if (row_id == SCAN_ROW_ID_KEY) {
+                rows->keys = MemoryContextAllocHuge(resultcontext, sizeof(*rows->keys) * *allocated);
+            }
+        }
+        else {
+            rows->values = repalloc_huge(rows->values, sizeof(*rows->values) * *allocated * rows->ncolumns);
+            if (rows->tids != NULL) {
+                rows->tids = repalloc_huge(rows->tids, sizeof(*rows->tids) * *allocated);
+            }
+            if (rows->keys != NULL) {
+                rows->keys = repalloc_huge(rows->keys, sizeof(*rows->keys) * *allocated);
+            }
+        }
+    }
+    return &rows->values[rows->size * rows->ncolumns];
+}
+
+
+/**
+ * @brief Read columns of a table; see 'scan_text_columns' and 'scan_text_columns_sample'
+ *
+ * @param fraction probability of every row (where none of the columns is NULL) to be read
+ * @param total if not NULL, set to the number of rows where none of the columns is NULL
+ */
+static TextRows
+_scan_text_columns(Oid relid, int ncolumns, const char* const* columns, ScanRowId row_id, const char* key_column, double fraction, unsigned long* total)
+{
+    TextRows result = {0, ncolumns, NULL, NULL, NULL};
+    unsigned long allocated = 0;
+
+    Relation relation;
+    TupleDesc tupdesc;
+    ScanColumn* scan_columns;
+    bool table_readable;
+    AttrNumber key_attnum = InvalidAttrNumber;
+    Oid key_type = InvalidOid;
+
+    TableScanDesc scan;
+    TupleTableSlot* slot;
+    MemoryContext resultcontext = CurrentMemoryContext;
+    MemoryContext batchcontext;
+    unsigned long batch_used = 0;
+    unsigned long not_null = 0;
+
+    relation = table_open(relid, AccessShareLock);
+    // Other relations have no table access method. Row security policies are not applied by a direct scan
+    if (relation->rd_rel->relkind != RELKIND_RELATION && relation->rd_rel->relkind != RELKIND_MATVIEW) {
+        ereport(ERROR, (
+            errcode(ERRCODE_WRONG_OBJECT_TYPE),
+            errmsg("'%s' is not a table or a materialized view", RelationGetRelationName(relation)),
+            errhint("Pass a query reading the relation instead of its OID.")
+        ));
+    }
+    if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED) {
+        ereport(ERROR, (
+            errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("Table '%s' has row-level security enabled, and can not be scanned directly", RelationGetRelationName(relation)),
+            errhint("Pass a query reading the table instead of its OID.")
+        ));
+    }
+    tupdesc = RelationGetDescr(relation);
+    table_readable = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) == ACLCHECK_OK;
+
+    scan_columns = palloc(sizeof(*scan_columns) * ncolumns);
+    for (int j = 0; j < ncolumns; j++) {
+        AttrNumber attnum = _column_attnum(relation, columns[j], table_readable);
+        _scan_column_init(&scan_columns[j], attnum, TupleDescAttr(tupdesc, attnum - 1)->atttypid);
+    }
+
+    if (row_id == SCAN_ROW_ID_KEY) {
+        key_attnum = _column_attnum(relation, key_column, table_readable);
+        key_type = TupleDescAttr(tupdesc, key_attnum - 1)->atttypid;
+        if (key_type != INT2OID && key_type != INT4OID && key_type != INT8OID) {
+            ereport(ERROR, (
+                errcode(ERRCODE_DATATYPE_MISMATCH),
+                errmsg("Key column '%s' of table '%s' must be of an integer type", key_column, RelationGetRelationName(relation))
+            ));
+        }
+    }
+
+    batchcontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj scan batch", ALLOCSET_DEFAULT_SIZES);
+
+    scan = table_beginscan(relation, GetActiveSnapshot(), 0, NULL);
+    slot = table_slot_create(relation, NULL);
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot)) {
+        char** row;
+        bool has_null = false;
+        int64 key = 0;
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (row_id == SCAN_ROW_ID_KEY) {
+            bool is_null;
+            Datum value = slot_getattr(slot, key_attnum, &is_null);
+
+            if (is_null) {
+                continue;
+            }
+            key = _scan_key_value(key_type, value);
+        }
+
+        // Rows where any of the columns is NULL are skipped
+        for (int j = 0; j < ncolumns && !has_null; j++) {
+            slot_getattr(slot, scan_columns[j].attnum, &has_null);
+        }
+        if (has_null) {
+            continue;
+        }
+        not_null += 1;
+        if (fraction < 1.0 && pg_prng_double(&pg_global_prng_state) >= fraction) {
+            continue;
+        }
+
+        row = _text_rows_reserve(&result, &allocated, row_id, resultcontext);
+        for (int j = 0; j < ncolumns; j++) {
+            bool is_null;
+            Datum value = slot_getattr(slot, scan_columns[j].attnum, &is_null);
+            MemoryContext oldcontext = MemoryContextSwitchTo(batchcontext);
+
+            row[j] = _scan_column_value(&scan_columns[j], value, resultcontext);
+            MemoryContextSwitchTo(oldcontext);
+        }
+
+        if (result.tids != NULL) {
+            ItemPointerCopy(&slot->tts_tid, &result.tids[result.size]);
+        }
+        if (result.keys != NULL) {
+            result.keys[result.size] = key;
+        }
+        result.size += 1;
+
+        batch_used += 1;
+        if (batch_used == SCAN_BATCH_SIZE) {
+            MemoryContextReset(batchcontext);
+            batch_used = 0;
+        }
+    }
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+
+    MemoryContextDelete(batchcontext);
+    table_close(relation, NoLock);
+
+    if (total != NULL) {
+        *total = not_null;
+    }
+    return result;
+}
+
+
+TextRows
+scan_text_columns(Oid relid, int ncolumns, const char* const* columns, ScanRowId row_id, const char* key_column)
+{
+    return _scan_text_columns(relid, ncolumns, columns, row_id, key_column, 1.0, NULL);
+}
+
+
+TextRows
+scan_text_columns_sample(Oid relid, int ncolumns, const char* const* columns, double fraction, unsigned long* total)
+{
+    return _scan_text_columns(relid, ncolumns, columns, SCAN_ROW_ID_NONE, NULL, fraction, total);
+}
+
+
+/**
+ * @brief Read rows of a portal; see 'scan_source'
+ *
+ * @note SPI must be connected by caller
+ */
+static TextRows
+_scan_portal(Portal portal, int ncolumns, ScanRowId row_id, MemoryContext resultcontext)
+{
+    TextRows result = {0, ncolumns, NULL, NULL, NULL};
+    unsigned long allocated = 0;
+
+    ScanColumn* scan_columns = NULL;
+    const int key_attnum = ncolumns + 1;
+    Oid key_type = InvalidOid;
+
+    MemoryContext batchcontext = AllocSetContextCreate(CurrentMemoryContext, "mipt-asj scan batch", ALLOCSET_DEFAULT_SIZES);
+
+    if (row_id == SCAN_ROW_ID_TID) {
+        ereport(ERROR, (
+            errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("Rows of a query or a cursor can not be identified by 'ctid'")
+        ));
+    }
+
+    for (;;) {
+        SPITupleTable* tuptable;
+        TupleDesc tupdesc;
+
+        SPI_cursor_fetch(portal, true, SCAN_BATCH_SIZE);
+        tuptable = SPI_tuptable;
+        if (tuptable == NULL || SPI_processed == 0) {
+            break;
+        }
+        tupdesc = tuptable->tupdesc;
+
+        // The result is known once the first rows are fetched
+        if (scan_columns == NULL) {
+            const int required = ncolumns + (row_id == SCAN_ROW_ID_KEY ? 1 : 0);
+
+            if (tupdesc->natts < required) {
+                ereport(ERROR, (
+                    errcode(ERRCODE_DATATYPE_MISMATCH),
+                    errmsg("Query or cursor must return at least %d columns, but returns %d", required, tupdesc->natts)
+                ));
+            }
+            scan_columns = palloc(sizeof(*scan_columns) * ncolumns);
+            for (int j = 0; j < ncolumns; j++) {
+                _scan_column_init(&scan_columns[j], j + 1, SPI_gettypeid(tupdesc, j + 1));
+            }
+            if (row_id == SCAN_ROW_ID_KEY) {
+                key_type = SPI_gettypeid(tupdesc, key_attnum);
+                if (key_type != INT2OID && key_type != INT4OID && key_type != INT8OID) {
+                    ereport(ERROR, (
+                        errcode(ERRCODE_DATATYPE_MISMATCH),
+                        errmsg("Key column (%d) of query or cursor must be of an integer type", key_attnum)
+                    ));
+                }
+            }
+        }
+
+        for (uint64 i = 0; i < SPI_processed; i++) {
+            HeapTuple tuple = tuptable->vals[i];
+            char** row;
+            bool has_null = false;
+            int64 key = 0;
+
+            CHECK_FOR_INTERRUPTS();
+
+            if (row_id == SCAN_ROW_ID_KEY) {
+                Datum value = SPI_getbinval(tuple, tupdesc, key_attnum, &has_null);
+                if (!has_null) {
+                    key = _scan_key_value(key_type, value);
+                }
+            }
+            for (int j = 0; j < ncolumns && !has_null; j++) {
+                SPI_getbinval(tuple, tupdesc, j + 1, &has_null);
+            }
+            if (has_null) {
+                continue;
+            }
+
+            row = _text_rows_reserve(&result, &allocated, row_id, resultcontext);
+            for (int j = 0; j < ncolumns; j++) {
+                bool is_null;
+                Datum value = SPI_getbinval(tuple, tupdesc, j + 1, &is_null);
+                MemoryContext oldcontext = MemoryContextSwitchTo(batchcontext);
+
+                row[j] = _scan_column_value(&scan_columns[j], value, resultcontext);
+                MemoryContextSwitchTo(oldcontext);
+            }
+            if (result.keys != NULL) {
+                result.keys[result.size] = key;
+            }
+            result.size += 1;
+        }
+
+        SPI_freetuptable(tuptable);
+        MemoryContextReset(batchcontext);
+    }
+
+    MemoryContextDelete(batchcontext);
+
+    return result;
+}
+
+
+TextRows
+scan_source(const ScanSource* source, int ncolumns, ScanRowId row_id)
+{
+    MemoryContext resultcontext = CurrentMemoryContext;
+    TextRows result;
+    Portal portal;
+
+    if (source->kind == SCAN_SOURCE_TABLE) {
+        return scan_text_columns(source->relid, ncolumns, source->columns, row_id, source->key_column);
+    }
+
+    if (SPI_connect() != SPI_OK_CONNECT) {
+        elog(ERROR, "SPI_connect failed");
+    }
+    if (source->kind == SCAN_SOURCE_QUERY) {
+        portal = SPI_cursor_open_with_args(NULL, source->query, 0, NULL, NULL, NULL, true, 0);
+    }
+    else {
+        portal = SPI_cursor_find(source->query);
+        if (portal == NULL) {
+            ereport(ERROR, (
+                errcode(ERRCODE_UNDEFINED_CURSOR),
+                errmsg("Cursor '%s' does not exist", source->query)
+            ));
+        }
+    }
+
+    result = _scan_portal(portal, ncolumns, row_id, resultcontext);
+
+    if (source->kind == SCAN_SOURCE_QUERY) {
+        SPI_cursor_close(portal);
+    }
+    SPI_finish();
+
+    return result;
+}
+
+
+int
+scan_source_from_args(FunctionCallInfo fcinfo, int arg, bool with_key, ScanSource* source)
+{
+    const Oid type = get_fn_expr_argtype(fcinfo->flinfo, arg);
+
+    source->key_column = NULL;
+    source->columns = NULL;
+    source->query = NULL;
+    if (type == InvalidOid || type == OIDOID) {
+        const char** columns = palloc(sizeof(*columns));
+
+        source->kind = SCAN_SOURCE_TABLE;
+        source->relid = PG_GETARG_OID(arg);
+        columns[0] = get_text_parameter(PG_GETARG_TEXT_P(arg + 1));
+        source->columns = columns;
+        if (with_key) {
+            source->key_column = get_text_parameter(PG_GETARG_TEXT_P(arg + 2));
+            return arg + 3;
+        }
+        return arg + 2;
+    }
+
+    source->kind = type == REFCURSOROID ? SCAN_SOURCE_CURSOR : SCAN_SOURCE_QUERY;
+    source->relid = InvalidOid;
+    source->query = get_text_parameter(PG_GETARG_TEXT_P(arg));
+    return arg + 1;
+}
+
+
+bool
+scan_source_equal(const ScanSource* a, const ScanSource* b, int ncolumns)
+{
+    if (a->kind != b->kind) {
+        return false;
+    }
+    if (a->kind != SCAN_SOURCE_TABLE) {
+        return strcmp(a->query, b->query) == 0;
+    }
+    if (a->relid != b->relid) {
+        return false;
+    }
+    for (int j = 0; j < ncolumns; j++) {
+        if (strcmp(a->columns[j], b->columns[j]) != 0) {
+            return false;
+        }
+    }
+    if (a->key_column == NULL || b->key_column == NULL) {
+        return a->key_column == b->key_column;
+    }
+    return strcmp(a->key_column, b->key_column) == 0;
+}
+
+
+void
+scan_check_columns(Oid relid, int ncolumns, const char* const* columns)
+{
+    Relation relation = table_open(relid, AccessShareLock);
+    const bool table_readable = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) == ACLCHECK_OK;
+
+    for (int j = 0; j < ncolumns; j++) {
+        _column_attnum(relation, columns[j], table_readable);
+    }
+
+    table_close(relation, NoLock);
+}
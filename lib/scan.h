@@ -0,0 +1,181 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * scan.h
+ *      Direct sequential scan of table columns, and reading of query results
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/scan.h
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "storage/itemptr.h"
+
+#include "lib/common.h"
+
+
+/**
+ * @brief Identifier of every row to record along with values
+ */
+typedef enum {
+    /// Do not record row identifiers
+    SCAN_ROW_ID_NONE,
+    /// Record 'ctid' of every row in 'tids'
+    SCAN_ROW_ID_TID,
+    /// Record value of an integer key column of every row in 'keys'
+    SCAN_ROW_ID_KEY
+} ScanRowId;
+
+
+/**
+ * @brief Kind of a source of rows
+ */
+typedef enum {
+    /// Columns of a table, read by a direct scan
+    SCAN_SOURCE_TABLE,
+    /// Result of a SQL query
+    SCAN_SOURCE_QUERY,
+    /// Rows not fetched yet from an open cursor
+    SCAN_SOURCE_CURSOR
+} ScanSourceKind;
+
+
+/**
+ * @brief Source of rows
+ */
+typedef struct {
+    ScanSourceKind kind;
+    /// Table OID (SCAN_SOURCE_TABLE)
+    Oid relid;
+    /// Column names (SCAN_SOURCE_TABLE)
+    const char* const* columns;
+    /// Key column name (SCAN_SOURCE_TABLE), when rows are identified by keys
+    const char* key_column;
+    /// Query text (SCAN_SOURCE_QUERY) or cursor name (SCAN_SOURCE_CURSOR)
+    const char* query;
+} ScanSource;
+
+
+/**
+ * @brief Rows of some columns of a table, as C-strings
+ */
+typedef struct {
+    /// Number of rows
+    unsigned long size;
+    /// Number of columns
+    int ncolumns;
+    /**
+     * Values, row by row: values[i * ncolumns + j] is j-th column of i-th row.
+     * Rows where any of the columns is NULL are skipped
+     */
+    char** values;
+    /// 'ctid' of every row, when requested; NULL otherwise
+    ItemPointerData* tids;
+    /// Key column value of every row, when requested; NULL otherwise
+    int64* keys;
+} TextRows;
+
+
+/**
+ * @brief Read columns of a table, scanning it directly (without SPI)
+ *
+ * 'text', 'varchar' and 'char' values are detoasted and copied as they are;
+ * values of other types are converted by type output functions.
+ * Temporary data is kept in a memory context which is reset every few rows.
+ *
+ * A key column must be of 'smallint', 'integer' or 'bigint' type;
+ * rows where it is NULL are skipped as well.
+ *
+ * Result is allocated in current memory context.
+ * Will ereport(ERROR) if the table or any of the columns does not exist,
+ * or current user may not read them.
+ *
+ * @param relid table OID
+ * @param ncolumns number of columns to read
+ * @param columns column names
+ * @param row_id identifier of rows to record
+ * @param key_column key column name, used when 'row_id' is SCAN_ROW_ID_KEY
+ */
+TextRows
+scan_text_columns(Oid relid, int ncolumns, const char* const* columns, ScanRowId row_id, const char* key_column);
+
+
+
+/**
+ * @brief Read a random sample of rows of a table, scanning it directly (without SPI)
+ *
+ * Every row where none of the columns is NULL is read with probability 'fraction';
+ * the table is still scanned in full, but values of other rows are not detoasted or copied.
+ * Behaves as 'scan_text_columns' otherwise; row identifiers are not recorded.
+ *
+ * @param relid table OID
+ * @param ncolumns number of columns to read
+ * @param columns column names
+ * @param fraction probability of a row to be read, in range (0; 1]
+ * @param total set to the number of rows where none of the columns is NULL
+ */
+TextRows
+scan_text_columns_sample(Oid relid, int ncolumns, const char* const* columns, double fraction, unsigned long* total);
+
+
+/**
+ * @brief Read rows of a source
+ *
+ * Tables are read by 'scan_text_columns'. Queries and cursors are read through a portal,
+ * a batch of rows at a time; values of the first 'ncolumns' columns of the result
+ * are converted as 'scan_text_columns' does, and rows where any of them is NULL are skipped.
+ * When 'row_id' is SCAN_ROW_ID_KEY, the next column of the result is the key. Cursors are
+ * left open, with all their rows fetched. Rows of queries and cursors can not be identified by 'ctid'.
+ *
+ * Result is allocated in current memory context.
+ * Will ereport(ERROR) if the query fails, the cursor does not exist, or the result has too few columns.
+ *
+ * @param source source of rows
+ * @param ncolumns number of columns to read
+ * @param row_id identifier of rows to record
+ */
+TextRows
+scan_source(const ScanSource* source, int ncolumns, ScanRowId row_id);
+
+
+/**
+ * @brief Read a source of one column from function call arguments
+ *
+ * A table is given by two arguments, its OID and a column name, followed by a key column name
+ * when 'with_key' is set. A query or a cursor is given by one argument of type 'text' or 'refcursor';
+ * its key (when 'with_key' is set) is its second column.
+ *
+ * @param arg index of the first argument of the source
+ * @param source filled in; refers to memory allocated in current memory context
+ * @return index of the argument following the source
+ */
+int
+scan_source_from_args(FunctionCallInfo fcinfo, int arg, bool with_key, ScanSource* source);
+
+
+/**
+ * @brief Whether two sources (of the same number of columns) give the same rows
+ *
+ * A query is not expected to give different rows when run twice; a cursor can only be read once.
+ */
+bool
+scan_source_equal(const ScanSource* a, const ScanSource* b, int ncolumns);
+
+
+/**
+ * @brief Check columns of a table exist and may be read by current user, without reading them
+ *
+ * Will ereport(ERROR) in the same cases as 'scan_text_columns' does.
+ * The table is locked in AccessShareLock mode until the end of transaction.
+ *
+ * @param relid table OID
+ * @param ncolumns number of columns to check
+ * @param columns column names
+ */
+void
+scan_check_columns(Oid relid, int ncolumns, const char* const* columns);
+
+#endif /* SCAN_H */
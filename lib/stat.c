@@ -0,0 +1,299 @@
+/*
+ * stat.c
+ *      Cumulative statistics of the extension functions in shared memory
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/stat.c
+ */
+
+#include "stat.h"
+
+#include "access/xact.h"
+#include "funcapi.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/tuplestore.h"
+
+
+#define STAT_NAME "mipt-asj stat"
+
+/**
+ * Names of functions, as shown by 'mipt_asj.stat'
+ */
+static const char* const stat_function_names[STAT_FUNCTIONS] = {
+    "calc_dict",
+    "calc_pairs",
+    "estimate_pairs",
+    "cmp",
+    "PkduckJoin",
+};
+
+
+typedef struct {
+    /// Protects 'counters'
+    slock_t mutex;
+    StatCounters counters;
+} StatEntry;
+
+
+typedef struct {
+    StatEntry entries[STAT_FUNCTIONS];
+} StatShared;
+
+
+uint64 stat_rule_evaluations = 0;
+uint64 stat_g_evaluations = 0;
+
+bool mipt_asj_track_timing = false;
+
+static StatShared* shared = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+// Statistics of this backend not yet added to 'shared'
+static StatCounters pending[STAT_FUNCTIONS];
+static bool pending_any = false;
+static bool xact_callback_registered = false;
+
+
+static void
+_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook != NULL) {
+        prev_shmem_request_hook();
+    }
+#endif
+    RequestAddinShmemSpace(MAXALIGN(sizeof(StatShared)));
+}
+
+
+static void
+_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook != NULL) {
+        prev_shmem_startup_hook();
+    }
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    shared = ShmemInitStruct(STAT_NAME, sizeof(*shared), &found);
+    if (!found) {
+        for (int i = 0; i < STAT_FUNCTIONS; i++) {
+            SpinLockInit(&shared->entries[i].mutex);
+            memset(&shared->entries[i].counters, 0, sizeof(shared->entries[i].counters));
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+
+void
+stat_init(void)
+{
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = _shmem_request;
+#else
+    _shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = _shmem_startup;
+}
+
+
+static void
+_counters_add(StatCounters* to, const StatCounters* from)
+{
+    to->calls += from->calls;
+    to->total_time += from->total_time;
+    to->rows += from->rows;
+    to->candidates += from->candidates;
+    to->verified += from->verified;
+    to->rule_evaluations += from->rule_evaluations;
+    to->g_evaluations += from->g_evaluations;
+}
+
+
+/**
+ * @brief Add statistics of this backend to the shared counters
+ */
+static void
+_flush(void)
+{
+    if (!pending_any || shared == NULL) {
+        return;
+    }
+    for (int i = 0; i < STAT_FUNCTIONS; i++) {
+        if (pending[i].calls == 0) {
+            continue;
+        }
+        SpinLockAcquire(&shared->entries[i].mutex);
+        _counters_add(&shared->entries[i].counters, &pending[i]);
+        SpinLockRelease(&shared->entries[i].mutex);
+    }
+    memset(pending, 0, sizeof(pending));
+    pending_any = false;
+}
+
+
+/**
+ * @brief Flush statistics when a transaction ends. Calls which failed are not counted:
+ * a call is added to the statistics only when it finishes
+ */
+static void
+_xact_callback(XactEvent event, void* arg)
+{
+    switch (event) {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+        case XACT_EVENT_PREPARE:
+            _flush();
+            break;
+        default:
+            break;
+    }
+}
+
+
+void
+stat_add(StatFunction function, const StatCounters* counters)
+{
+    if (shared == NULL) {
+        return;
+    }
+    if (!xact_callback_registered) {
+        RegisterXactCallback(_xact_callback, NULL);
+        xact_callback_registered = true;
+    }
+    _counters_add(&pending[function], counters);
+    pending_any = true;
+}
+
+
+void
+stat_call_start(StatCall* call)
+{
+    memset(&call->counters, 0, sizeof(call->counters));
+    stat_call_resume(call);
+}
+
+
+void
+stat_call_resume(StatCall* call)
+{
+    if (shared == NULL) {
+        return;
+    }
+    call->timed = mipt_asj_track_timing;
+    if (call->timed) {
+        INSTR_TIME_SET_CURRENT(call->start);
+    }
+    call->rule_evaluations = stat_rule_evaluations;
+    call->g_evaluations = stat_g_evaluations;
+}
+
+
+void
+stat_call_pause(StatCall* call)
+{
+    instr_time now;
+
+    if (shared == NULL) {
+        return;
+    }
+    if (call->timed) {
+        INSTR_TIME_SET_CURRENT(now);
+        INSTR_TIME_SUBTRACT(now, call->start);
+        call->counters.total_time += INSTR_TIME_GET_MILLISEC(now);
+    }
+    call->counters.rule_evaluations += (int64)(stat_rule_evaluations - call->rule_evaluations);
+    call->counters.g_evaluations += (int64)(stat_g_evaluations - call->g_evaluations);
+}
+
+
+void
+stat_call_finish(StatCall* call, StatFunction function)
+{
+    stat_call_pause(call);
+    call->counters.calls += 1;
+    stat_add(function, &call->counters);
+}
+
+
+static void
+_check_shared(void)
+{
+    if (shared == NULL) {
+        ereport(ERROR, (
+            errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+            errmsg("mipt-asj statistics are only collected when the extension is loaded by shared_preload_libraries")
+        ));
+    }
+}
+
+
+Datum
+stat_functions(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo* rsinfo = (ReturnSetInfo*)fcinfo->resultinfo;
+
+    _check_shared();
+    // Statistics of this backend are shown as well
+    _flush();
+
+#if PG_VERSION_NUM >= 160000
+    InitMaterializedSRF(fcinfo, 0);
+#else
+    SetSingleFuncCall(fcinfo, 0);
+#endif
+    for (int i = 0; i < STAT_FUNCTIONS; i++) {
+        Datum values[9];
+        bool nulls[9] = {false, false, false, false, false, false, false, false, false};
+        StatCounters counters;
+
+        SpinLockAcquire(&shared->entries[i].mutex);
+        counters = shared->entries[i].counters;
+        SpinLockRelease(&shared->entries[i].mutex);
+
+        values[0] = PointerGetDatum(cstring_to_text(stat_function_names[i]));
+        values[1] = Int64GetDatum(counters.calls);
+        values[2] = Float8GetDatum(counters.total_time);
+        values[3] = Float8GetDatum(counters.calls > 0 ? counters.total_time / counters.calls : 0.0);
+        nulls[3] = counters.calls == 0;
+        values[4] = Int64GetDatum(counters.rows);
+        values[5] = Int64GetDatum(counters.candidates);
+        values[6] = Int64GetDatum(counters.verified);
+        values[7] = Int64GetDatum(counters.rule_evaluations);
+        values[8] = Int64GetDatum(counters.g_evaluations);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum)0;
+}
+
+
+Datum
+stat_reset(PG_FUNCTION_ARGS)
+{
+    _check_shared();
+
+    memset(pending, 0, sizeof(pending));
+    pending_any = false;
+    for (int i = 0; i < STAT_FUNCTIONS; i++) {
+        SpinLockAcquire(&shared->entries[i].mutex);
+        memset(&shared->entries[i].counters, 0, sizeof(shared->entries[i].counters));
+        SpinLockRelease(&shared->entries[i].mutex);
+    }
+
+    PG_RETURN_VOID();
+}
@@ -0,0 +1,137 @@
+#ifndef STAT_H
+#define STAT_H
+
+/*
+ * stat.h
+ *      Cumulative statistics of the extension functions in shared memory
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/stat.h
+ *
+ * Statistics are collected only when the extension is loaded by
+ * 'shared_preload_libraries'. Every backend accumulates its statistics
+ * locally, and adds them to the shared counters when a transaction ends.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "portability/instr_time.h"
+
+
+/**
+ * @brief Functions statistics are collected for
+ */
+typedef enum {
+    STAT_CALC_DICT = 0,
+    STAT_CALC_PAIRS,
+    STAT_ESTIMATE_PAIRS,
+    STAT_CMP,
+    /// Custom join node, see 'join_scan.h'
+    STAT_JOIN_SCAN,
+    STAT_FUNCTIONS
+} StatFunction;
+
+
+/**
+ * @brief Statistics of a function
+ */
+typedef struct {
+    int64 calls;
+    /// Milliseconds
+    double total_time;
+    /// Rows read from tables, queries and cursors
+    int64 rows;
+    /// Pairs of rows whose signatures intersect
+    int64 candidates;
+    /// Pairs which passed positional and suffix filters (or compared by 'cmp')
+    int64 verified;
+    int64 rule_evaluations;
+    int64 g_evaluations;
+} StatCounters;
+
+
+/**
+ * @brief Number of rules applied (or found) by this backend; only grows
+ */
+extern uint64 stat_rule_evaluations;
+
+/**
+ * @brief Number of g-function calculations by this backend; only grows
+ */
+extern uint64 stat_g_evaluations;
+
+
+/**
+ * @brief Whether time of calls is measured (GUC 'mipt_asj.track_timing')
+ */
+extern bool mipt_asj_track_timing;
+
+
+/**
+ * @brief Measured call of a function
+ *
+ * Time and work counters are measured between 'stat_call_resume' and 'stat_call_pause';
+ * time is measured only if 'mipt_asj.track_timing' is on when the call is resumed.
+ * 'rows', 'candidates' and 'verified' are counted by the caller.
+ */
+typedef struct {
+    StatCounters counters;
+    /// Clock and work counters when the call was resumed; the clock is read only if 'timed'
+    bool timed;
+    instr_time start;
+    uint64 rule_evaluations;
+    uint64 g_evaluations;
+} StatCall;
+
+
+/**
+ * @brief Request shared memory and install hooks. Must be called from _PG_init
+ * while shared preload libraries are loaded
+ */
+void
+stat_init(void);
+
+
+/**
+ * @brief Start measuring a call: reset its counters and resume it
+ */
+void
+stat_call_start(StatCall* call);
+
+void
+stat_call_resume(StatCall* call);
+
+/**
+ * @brief Add time and work since the last 'stat_call_resume' to the call counters
+ */
+void
+stat_call_pause(StatCall* call);
+
+/**
+ * @brief Pause the call, and add it to statistics of 'function'
+ */
+void
+stat_call_finish(StatCall* call, StatFunction function);
+
+
+/**
+ * @brief Add counters to statistics of 'function'
+ */
+void
+stat_add(StatFunction function, const StatCounters* counters);
+
+
+/**
+ * @brief Statistics of all functions
+ */
+Datum stat_functions(PG_FUNCTION_ARGS);
+
+
+/**
+ * @brief Reset statistics of all functions
+ */
+Datum stat_reset(PG_FUNCTION_ARGS);
+
+
+#endif /* STAT_H */
@@ -0,0 +1,69 @@
+/*
+ * subseq.c
+ *      Subsequence automaton (next-occurrence table)
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/subseq.c
+ */
+
+#include "subseq.h"
+
+#include "utils/memutils.h"
+
+
+void
+subseq_automaton_init(SubsequenceAutomaton* automaton)
+{
+    automaton->length = 0;
+    automaton->alphabet_size = 0;
+    memset(automaton->columns, 0xFF, sizeof(automaton->columns));
+    automaton->next = NULL;
+    automaton->next_allocated = 0;
+}
+
+
+void
+subseq_automaton_build(SubsequenceAutomaton* automaton, const char* string, uint32 length)
+{
+    const unsigned char* s = (const unsigned char*)string;
+    uint64 next_size;
+
+    // Map characters present in the string to columns
+    memset(automaton->columns, 0xFF, sizeof(automaton->columns));
+    automaton->alphabet_size = 0;
+    for (uint32 i = 0; i < length; i++) {
+        if (automaton->columns[s[i]] < 0) {
+            automaton->columns[s[i]] = automaton->alphabet_size++;
+        }
+    }
+    automaton->length = length;
+
+    next_size = (uint64)(length + 1) * automaton->alphabet_size;
+    if (next_size > automaton->next_allocated) {
+        if (automaton->next != NULL) {
+            pfree(automaton->next);
+        }
+        automaton->next = MemoryContextAllocHuge(CurrentMemoryContext, sizeof(*automaton->next) * next_size);
+        automaton->next_allocated = next_size;
+    }
+
+    // Fill the table from the end of the string
+    for (uint32 c = 0; c < automaton->alphabet_size; c++) {
+        automaton->next[(uint64)length * automaton->alphabet_size + c] = length;
+    }
+    for (int64 i = (int64)length - 1; i >= 0; i--) {
+        uint32* row = &automaton->next[(uint64)i * automaton->alphabet_size];
+        memcpy(row, row + automaton->alphabet_size, sizeof(*row) * automaton->alphabet_size);
+        row[automaton->columns[s[i]]] = (uint32)i;
+    }
+}
+
+
+void
+subseq_automaton_free(SubsequenceAutomaton* automaton)
+{
+    if (automaton->next != NULL) {
+        pfree(automaton->next);
+    }
+    subseq_automaton_init(automaton);
+}
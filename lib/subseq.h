@@ -0,0 +1,88 @@
+#ifndef SUBSEQ_H
+#define SUBSEQ_H
+
+/*
+ * subseq.h
+ *      Subsequence automaton (next-occurrence table)
+ *
+ * IDENTIFICATION
+ *	    contrib/mipt-asj/lib/subseq.h
+ *
+ * The automaton is built for a string S in O(|S| * sigma) time, sigma being
+ * the number of distinct characters in S. Then it checks whether any other
+ * string P is a subsequence of S in O(|P|) time.
+ */
+
+#include "postgres.h"
+
+
+/**
+ * @brief Subsequence automaton of a string
+ */
+typedef struct {
+    /// Length of the string the automaton is built for
+    uint32 length;
+    /// Number of distinct characters in the string
+    uint32 alphabet_size;
+    /// Character -> column in 'next'; -1 for characters absent from the string
+    int16 columns[256];
+    /**
+     * next[i * alphabet_size + c]: position of the first occurrence of
+     * character with column c at or after position i; 'length' if there is none
+     */
+    uint32* next;
+    /// Number of elements allocated for 'next'
+    uint64 next_allocated;
+} SubsequenceAutomaton;
+
+
+/**
+ * @brief Initialize an empty automaton
+ */
+void
+subseq_automaton_init(SubsequenceAutomaton* automaton);
+
+
+/**
+ * @brief Build the automaton for a string, reusing memory allocated by previous builds
+ *
+ * @param string
+ * @param length length of string
+ */
+void
+subseq_automaton_build(SubsequenceAutomaton* automaton, const char* string, uint32 length);
+
+
+/**
+ * @brief Check whether a pattern is a subsequence of the string the automaton is built for
+ *
+ * @param pattern null-terminated string
+ */
+static inline bool
+subseq_automaton_match(const SubsequenceAutomaton* automaton, const char* pattern)
+{
+    uint32 position = 0;
+
+    for (const unsigned char* c = (const unsigned char*)pattern; *c != '\0'; c++) {
+        const int16 column = automaton->columns[*c];
+        if (column < 0) {
+            return false;
+        }
+        position = automaton->next[(uint64)position * automaton->alphabet_size + column];
+        if (position == automaton->length) {
+            return false;
+        }
+        position += 1;
+    }
+    return true;
+}
+
+
+/**
+ * @brief Release memory occupied by the automaton
+ */
+void
+subseq_automaton_free(SubsequenceAutomaton* automaton);
+
+
+#endif /* SUBSEQ_H */
@@ -16,6 +16,8 @@ struct trieptr {
 
 struct trie {
     void *data;
+    /* Characters present in every key of this subtree, after this node. */
+    uint64 required;
     short nchildren, size;
     struct trieptr children[];
 };
@@ -97,6 +99,7 @@ trie_create(void)
     root->size = 255;
     root->nchildren = 0;
     root->data = NULL;
+    root->required = ~(uint64)0;
     return root;
 }
 
@@ -217,9 +220,39 @@ create(void)
     trie->size = size;
     trie->nchildren = 0;
     trie->data = NULL;
+    trie->required = ~(uint64)0;
     return trie;
 }
 
+/*
+ * Narrow 'required' masks of all nodes on the path of a freshly inserted key.
+ * The key ends at its last node, so that node requires no characters.
+ */
+static void
+update_required(struct trie *self, const char *key, size_t length)
+{
+    uint64 suffix = string_char_mask(key, length);
+    for (size_t i = 0; i < length; i++) {
+        int first = 0;
+        int last = self->nchildren - 1;
+        self->required &= suffix;
+        suffix = string_char_mask(key + i + 1, length - i - 1);
+        while (first <= last) {
+            const int middle = (first + last) / 2;
+            struct trieptr *p = &self->children[middle];
+            if (p->c < key[i]) {
+                first = middle + 1;
+            } else if (p->c == key[i]) {
+                self = p->trie;
+                break;
+            } else {
+                last = middle - 1;
+            }
+        }
+    }
+    self->required = 0;
+}
+
 int
 trie_insert(struct trie *trie, const char *key, void *data)
 {
@@ -244,69 +277,142 @@ trie_insert(struct trie *trie, const char *key, void *data)
         depth++;
     }
     last->data = data;
+    update_required(trie, key, depth);
     return 0;
 }
 
 
-/* Subsequences search */
+/* Flat (pointer-free) trie */
 
-static int
-trie_search_subsequences_step(const struct trie *trie, const char *key, int key_start_pos, char ***container_ptr) {
-    int container_length = 0;
+struct flat_trie_node {
+    /* Characters present in every key of this subtree, after this node. */
+    uint64 required;
+    /* Index of data associated with the key of this node; -1 if none. */
+    int32 data;
+    /* Index of the first child in flat_trie.nodes; children are stored contiguously. */
+    uint32 children;
+    uint16 nchildren;
+    /* Character leading to this node from its parent. */
+    unsigned char c;
+};
 
-    if (*container_ptr != NULL) {
-        return -1;
-    }
+struct flat_trie {
+    uint32 nnodes;
+    /* Root is nodes[0]. Nodes are laid out in breadth-first order. */
+    struct flat_trie_node nodes[];
+};
 
-    if (trie->nchildren == 0) {
-        // this is a leaf, return
-        char** container = palloc(sizeof(*container));
-        *container_ptr = container;
-        container[0] = palloc(strlen(trie->data) + 1);
-        strcpy(container[0], (char*)trie->data);
-        return 1;
-    }
+static uint32
+count_nodes(const struct trie *self)
+{
+    uint32 result = 1;
+    for (int i = 0; i < self->nchildren; i++)
+        result += count_nodes(self->children[i].trie);
+    return result;
+}
 
-    // iterate over all characters
-    for (int i = key_start_pos; i < strlen(key); i++) {
-        int first = 0;
-        int last = trie->nchildren - 1;
-        // binary search
-        while (first <= last) {
-            const int middle = (first + last) / 2;
-            const struct trieptr *p = &trie->children[middle];
-            if (p->c < key[i]) {
-                first = middle + 1;
-            }
-            else if (p->c == key[i]) {
-                // character found; run recursively and copy result to container
-                char** temp = NULL;
-                int temp_length = trie_search_subsequences_step(p->trie, key, i + 1, &temp);
-                if (temp_length != 0) {
-                    *container_ptr = *container_ptr == NULL ?
-                        palloc(sizeof(**container_ptr) * temp_length) :
-                        repalloc(*container_ptr, sizeof(**container_ptr) * (container_length + temp_length));
-                    for (int j = 0; j < temp_length; j++) {
-                        (*container_ptr)[container_length + j] = palloc(strlen(temp[j]) + 1);
-                        strcpy((*container_ptr)[container_length + j], temp[j]);
-                        pfree(temp[j]);
-                    }
-                    pfree(temp);
-                    container_length += temp_length;
-                }
-                break;
-            }
-            else {
-                last = middle - 1;
-            }
+size_t
+trie_flat_size(const struct trie *trie)
+{
+    return offsetof(struct flat_trie, nodes) + sizeof(struct flat_trie_node) * count_nodes(trie);
+}
+
+struct flat_trie *
+trie_flatten(const struct trie *trie, void *dest, int32 (*data_index)(const void *data, void *arg), void *arg)
+{
+    struct flat_trie *result = dest;
+    const struct trie **queue;
+    uint32 queue_end = 1;
+
+    result->nnodes = count_nodes(trie);
+    queue = palloc(sizeof(*queue) * result->nnodes);
+    queue[0] = trie;
+    result->nodes[0].c = '\0';
+
+    /* Breadth-first traversal; node i of the flat trie is queue[i]. */
+    for (uint32 i = 0; i < result->nnodes; i++) {
+        const struct trie *self = queue[i];
+        struct flat_trie_node *node = &result->nodes[i];
+        node->required = self->required;
+        node->data = self->data == NULL ? -1 : data_index(self->data, arg);
+        node->children = queue_end;
+        node->nchildren = self->nchildren;
+        for (int j = 0; j < self->nchildren; j++) {
+            result->nodes[queue_end].c = (unsigned char)self->children[j].c;
+            queue[queue_end++] = self->children[j].trie;
         }
     }
 
-    return container_length;
+    pfree(queue);
+    return result;
+}
+
+
+/* Subsequences search */
+
+struct subsequences_container {
+    int32 *data;
+    int used, size;
+};
+
+static void
+container_push(struct subsequences_container *container, int32 data)
+{
+    if (container->used == container->size) {
+        container->size = container->size == 0 ? 16 : container->size * 2;
+        container->data = container->data == NULL ?
+            palloc(sizeof(*container->data) * container->size) :
+            repalloc(container->data, sizeof(*container->data) * container->size);
+    }
+    container->data[container->used++] = data;
+}
+
+/*
+ * Only the first occurrence of each child character in the rest of the key
+ * is followed: any subsequence found from a later occurrence is found from
+ * the first one as well. Thus every node is visited at most once.
+ *
+ * A child is skipped at once if some character required by its subtree is
+ * absent from the rest of the key ('suffix_masks[i]' is the mask of key[i..]).
+ */
+static void
+flat_trie_search_subsequences_step(const struct flat_trie *trie, const struct flat_trie_node *self,
+                                   const char *key, size_t key_length,
+                                   const uint64 *suffix_masks, size_t key_start_pos,
+                                   struct subsequences_container *container)
+{
+    const uint64 available = suffix_masks[key_start_pos];
+    for (uint32 i = self->children; i < self->children + self->nchildren; i++) {
+        const struct flat_trie_node *child = &trie->nodes[i];
+        const char *found;
+        if (!char_mask_is_subset(char_mask(child->c) | child->required, available))
+            continue;
+        found = memchr(key + key_start_pos, child->c, key_length - key_start_pos);
+        if (found == NULL)
+            continue;
+        if (child->data >= 0)
+            container_push(container, child->data);
+        flat_trie_search_subsequences_step(trie, child, key, key_length, suffix_masks, found - key + 1, container);
+    }
 }
 
 int
-trie_search_subsequences(const struct trie *trie, const char *key, char ***container)
+flat_trie_search_subsequences(const struct flat_trie *trie, const char *key, size_t key_length, int32 **container)
 {
-    return trie_search_subsequences_step(trie, key, 0, container);
+    struct subsequences_container result = {NULL, 0, 0};
+    uint64 suffix_masks_local[256];
+    uint64 *suffix_masks = key_length < lengthof(suffix_masks_local) ?
+        suffix_masks_local : palloc(sizeof(*suffix_masks) * (key_length + 1));
+
+    suffix_masks[key_length] = 0;
+    for (size_t i = key_length; i > 0; i--)
+        suffix_masks[i - 1] = suffix_masks[i] | char_mask(key[i - 1]);
+
+    if (char_mask_is_subset(trie->nodes[0].required, suffix_masks[0]))
+        flat_trie_search_subsequences_step(trie, &trie->nodes[0], key, key_length, suffix_masks, 0, &result);
+
+    if (suffix_masks != suffix_masks_local)
+        pfree(suffix_masks);
+    *container = result.data;
+    return result.used;
 }
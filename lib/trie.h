@@ -11,6 +11,7 @@
  * Adapted for PostgreSQL and mipt-asj. Changes include:
  *  * Use palloc() and pfree() calls
  *  * Add version of search() to check LCS in trie
+ *  * Keep masks of characters required by subtrees to prune that search
  *
  *
  * This trie associates an arbitrary void* pointer with a UTF-8,
@@ -38,6 +39,8 @@
 
 #include "postgres.h"
 
+#include "charmask.h"
+
 
 struct trie;
 
@@ -66,18 +69,41 @@ void *trie_search(const struct trie *, const char *key);
  * released.
  *
  * @return 0 on success
- *
- * For purposes of mipt-asj, data must be equal to key
  */
 int trie_insert(struct trie *, const char *key, void *data);
 
 /**
- * Find all subsequences of given key that exist in trie and put them into container.
+ * Pointer-free copy of a trie, stored in a single contiguous chunk of
+ * memory, e.g. in a dynamic shared memory segment. Data pointers are
+ * replaced by integer indices.
+ */
+struct flat_trie;
+
+/**
+ * @return size (in bytes) of the flat copy of the trie
+ */
+size_t trie_flat_size(const struct trie *);
+
+/**
+ * Write a flat copy of the trie into DEST, which must be at least
+ * trie_flat_size() bytes long. DATA_INDEX maps data associated with
+ * keys to non-negative indices stored in the flat copy.
+ *
+ * @return DEST
+ */
+struct flat_trie *trie_flatten(const struct trie *, void *dest,
+                               int32 (*data_index)(const void *data, void *arg), void *arg);
+
+/**
+ * Find all keys in flat trie that are subsequences of given key and put
+ * the indices of data associated with them into container.
  *
- * Container will be allocated automatically using palloc.
+ * Container will be allocated automatically using palloc. Every key
+ * is reported at most once.
  *
  * @return number of subsequences found.
  */
-int trie_search_subsequences(const struct trie *, const char *key, char ***container);
+int flat_trie_search_subsequences(const struct flat_trie *, const char *key, size_t key_length,
+                                  int32 **container);
 
 #endif
@@ -7,9 +7,30 @@ CREATE SCHEMA mipt_asj;
 -- Calculate abbreviation dictionary.
 -- #1, #2:      Full names table OID and column
 -- #3, #4:      Abbreviations table OID and column
+-- #5:          Number of background workers to use (0 to search in the calling backend)
 -- Return:      Abbreviation dictionary
 CREATE OR REPLACE FUNCTION
-    mipt_asj.calc_dict(oid, TEXT, oid, TEXT)
+    mipt_asj.calc_dict(oid, TEXT, oid, TEXT, INTEGER DEFAULT 0)
+    RETURNS TABLE(f VARCHAR, a VARCHAR)
+    AS 'MODULE_PATHNAME', 'calc_dict'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Calculate abbreviation dictionary from results of queries or cursors
+-- #1:          Full names query (its first column), or cursor
+-- #2:          Abbreviations query (its first column), or cursor
+-- #3:          Number of background workers to use (0 to search in the calling backend)
+-- Return:      Abbreviation dictionary
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_dict(TEXT, TEXT, INTEGER DEFAULT 0)
+    RETURNS TABLE(f VARCHAR, a VARCHAR)
+    AS 'MODULE_PATHNAME', 'calc_dict'
+    LANGUAGE C
+    VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_dict(refcursor, refcursor, INTEGER DEFAULT 0)
     RETURNS TABLE(f VARCHAR, a VARCHAR)
     AS 'MODULE_PATHNAME', 'calc_dict'
     LANGUAGE C
@@ -21,14 +42,110 @@ CREATE OR REPLACE FUNCTION
 -- #3, #4:      Second string set table OID and column
 -- #5, #6, #7:  Abbreviation dictionary table OID, 'full' and 'abbr' column
 -- #8:          Exactness parameter
+-- #9, #10:     Partition modulus and remainder: only #1 rows hashing into the partition are processed
+-- #11:         Return every unordered pair once, without pairs of a row with itself (when #1#2 is #3#4)
 -- Return:      Set of pairs (#1#2, #3#4)
 CREATE OR REPLACE FUNCTION
-    mipt_asj.calc_pairs(oid, TEXT, oid, TEXT, oid, TEXT, TEXT, REAL)
+    mipt_asj.calc_pairs(oid, TEXT, oid, TEXT, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(s1 VARCHAR, s2 VARCHAR)
+    AS 'MODULE_PATHNAME', 'calc_pairs'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Filter out pairs of strings returned by queries or cursors that could be joined
+-- #1:          First string set query (its first column), or cursor
+-- #2:          Second string set query (its first column), or cursor
+-- #3-#9:       Same as #5-#11 of 'calc_pairs'
+-- Return:      Set of pairs (#1, #2)
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs(TEXT, TEXT, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
     RETURNS TABLE(s1 VARCHAR, s2 VARCHAR)
     AS 'MODULE_PATHNAME', 'calc_pairs'
     LANGUAGE C
     VOLATILE;
 
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs(refcursor, refcursor, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(s1 VARCHAR, s2 VARCHAR)
+    AS 'MODULE_PATHNAME', 'calc_pairs'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Filter out pairs of rows that could be joined, identified by their 'ctid'
+-- #1-#11:      Same as of 'calc_pairs'
+-- Return:      Set of pairs ('ctid' of #1 row, 'ctid' of #3 row)
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs_tid(oid, TEXT, oid, TEXT, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(ctid1 tid, ctid2 tid)
+    AS 'MODULE_PATHNAME', 'calc_pairs_tid'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Filter out pairs of rows that could be joined, identified by key columns
+-- #1, #2, #3:  First string set table OID, column and key column (of an integer type)
+-- #4, #5, #6:  Second string set table OID, column and key column (of an integer type)
+-- #7, #8, #9:  Abbreviation dictionary table OID, 'full' and 'abbr' column
+-- #10:         Exactness parameter
+-- #11, #12:    Partition modulus and remainder: only #1 rows whose #3 hashes into the partition are processed
+-- #13:         Return every unordered pair once, without pairs of a row with itself (when #1#2#3 is #4#5#6)
+-- Return:      Set of pairs (#3 of #1 row, #6 of #4 row)
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs_key(oid, TEXT, TEXT, oid, TEXT, TEXT, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(key1 BIGINT, key2 BIGINT)
+    AS 'MODULE_PATHNAME', 'calc_pairs_key'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Filter out pairs of rows returned by queries or cursors that could be joined, identified by keys
+-- #1:          First query or cursor; its first column is a string, and its second column is a key (of an integer type)
+-- #2:          Second query or cursor, of the same form
+-- #3-#9:       Same as #7-#13 of 'calc_pairs_key'
+-- Return:      Set of pairs (key of #1 row, key of #2 row)
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs_key(TEXT, TEXT, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(key1 BIGINT, key2 BIGINT)
+    AS 'MODULE_PATHNAME', 'calc_pairs_key'
+    LANGUAGE C
+    VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+    mipt_asj.calc_pairs_key(refcursor, refcursor, oid, TEXT, TEXT, REAL, INTEGER DEFAULT 1, INTEGER DEFAULT 0, BOOLEAN DEFAULT false)
+    RETURNS TABLE(key1 BIGINT, key2 BIGINT)
+    AS 'MODULE_PATHNAME', 'calc_pairs_key'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Estimate the result of 'calc_pairs', and time and memory it takes, by a random sample of rows
+-- #1-#8:       Same as of 'calc_pairs'
+-- #9:          Probability of a row to be sampled
+-- Return:      One row: numbers of rows and of sampled rows in #1#2 and #3#4; estimated numbers
+--              of candidate pairs and of pairs returned; estimated time (seconds) and memory (bytes)
+CREATE OR REPLACE FUNCTION
+    mipt_asj.estimate_pairs(oid, TEXT, oid, TEXT, oid, TEXT, TEXT, REAL, REAL DEFAULT 0.01)
+    RETURNS TABLE(rows1 BIGINT, rows2 BIGINT, sampled1 BIGINT, sampled2 BIGINT, candidates DOUBLE PRECISION, pairs DOUBLE PRECISION, seconds DOUBLE PRECISION, memory BIGINT)
+    AS 'MODULE_PATHNAME', 'estimate_pairs'
+    LANGUAGE C
+    VOLATILE;
+
+
+-- Calculate signature of a string, which is intersected with signatures of other strings to find candidate pairs
+-- #1:          String
+-- #2:          Abbreviation dictionary made by 'ruleset'
+-- #3:          Exactness parameter
+-- #4:          Return prefix signature instead of U-signature
+-- Return:      Array of distinct tokens
+CREATE OR REPLACE FUNCTION
+    mipt_asj.signature(TEXT, bytea, REAL, BOOLEAN DEFAULT false)
+    RETURNS TEXT[]
+    AS 'MODULE_PATHNAME', 'pkduck_signature'
+    LANGUAGE C
+    IMMUTABLE STRICT PARALLEL SAFE;
+
 
 -- Compare pairs in JOIN
 -- #1, #2:      Strings to compare
@@ -41,3 +158,67 @@ CREATE OR REPLACE FUNCTION
     AS 'MODULE_PATHNAME', 'cmp'
     LANGUAGE C
     VOLATILE;
+
+
+-- Get abbreviation dictionary as a value, to be passed to functions instead of the table
+-- #1, #2, #3:  Abbreviation dictionary table OID, 'full' and 'abbr' column
+-- Return:      Tokenized abbreviation dictionary
+CREATE OR REPLACE FUNCTION
+    mipt_asj.ruleset(oid, TEXT, TEXT)
+    RETURNS bytea
+    AS 'MODULE_PATHNAME', 'ruleset'
+    LANGUAGE C
+    STABLE PARALLEL RESTRICTED;
+
+
+-- Compare pairs in JOIN, with rules given as a value; may be run by parallel workers
+-- #1, #2:      Strings to compare
+-- #3:          Abbreviation dictionary made by 'ruleset'
+-- #4:          Exactness parameter
+-- Return:      boolean
+CREATE OR REPLACE FUNCTION
+    mipt_asj.cmp(TEXT, TEXT, bytea, REAL)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'cmp_ruleset'
+    LANGUAGE C
+    IMMUTABLE STRICT PARALLEL SAFE;
+
+
+-- Expand abbreviations, to get a key equal for strings which only differ by abbreviations
+-- #1:          String
+-- #2:          Abbreviation dictionary made by 'ruleset'
+-- Return:      Sorted tokens of the string with abbreviations expanded
+CREATE OR REPLACE FUNCTION
+    mipt_asj.canonicalize(TEXT, bytea)
+    RETURNS TEXT
+    AS 'MODULE_PATHNAME', 'canonicalize_text'
+    LANGUAGE C
+    IMMUTABLE STRICT PARALLEL SAFE;
+
+
+-- Statistics of the extension functions, cumulative for all backends.
+-- Only collected when the extension is loaded by 'shared_preload_libraries'
+-- Return:      Table with a row per function; times are in milliseconds
+CREATE OR REPLACE FUNCTION
+    mipt_asj.stat_functions()
+    RETURNS TABLE(
+        function TEXT, calls BIGINT, total_time DOUBLE PRECISION, mean_time DOUBLE PRECISION,
+        rows BIGINT, candidates BIGINT, verified BIGINT, rule_evaluations BIGINT, g_evaluations BIGINT
+    )
+    AS 'MODULE_PATHNAME', 'stat_functions'
+    LANGUAGE C
+    VOLATILE;
+
+CREATE VIEW mipt_asj.stat AS
+    SELECT * FROM mipt_asj.stat_functions();
+
+
+-- Reset statistics of the extension functions
+CREATE OR REPLACE FUNCTION
+    mipt_asj.stat_reset()
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'stat_reset'
+    LANGUAGE C
+    VOLATILE;
+
+REVOKE ALL ON FUNCTION mipt_asj.stat_reset() FROM PUBLIC;
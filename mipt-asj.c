@@ -3,6 +3,9 @@
 #include "postgres.h"
 #include "fmgr.h"
 
+#include "miscadmin.h"
+#include "utils/guc.h"
+
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
@@ -10,5 +13,82 @@ PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(calc_dict);
 PG_FUNCTION_INFO_V1(calc_pairs);
+PG_FUNCTION_INFO_V1(calc_pairs_tid);
+PG_FUNCTION_INFO_V1(calc_pairs_key);
+PG_FUNCTION_INFO_V1(pkduck_signature);
+PG_FUNCTION_INFO_V1(estimate_pairs);
 PG_FUNCTION_INFO_V1(cmp);
+PG_FUNCTION_INFO_V1(cmp_ruleset);
+PG_FUNCTION_INFO_V1(canonicalize_text);
+PG_FUNCTION_INFO_V1(ruleset);
+PG_FUNCTION_INFO_V1(stat_functions);
+PG_FUNCTION_INFO_V1(stat_reset);
+
+
+
+void _PG_init(void);
+
+
+/**
+ * @brief Define configuration parameters of the extension.
+ * Register the custom join node.
+ * When loaded by 'shared_preload_libraries', set up shared cache of rules and statistics
+ */
+void
+_PG_init(void)
+{
+    DefineCustomBoolVariable(
+        "mipt_asj.suffix_filter",
+        "Check candidate pairs of calc_pairs by the number of tokens they may share.",
+        "Tokens that can not appear in any string derived from the other string by rules are not counted.",
+        &mipt_asj_suffix_filter,
+        false,
+        PGC_USERSET,
+        0,
+        NULL, NULL, NULL
+    );
+    DefineCustomIntVariable(
+        "mipt_asj.cmp_cache_size",
+        "Maximum number of compared pairs whose scores are cached by cmp.",
+        "Every backend has its own cache. 0 disables the cache.",
+        &mipt_asj_cmp_cache_size,
+        65536,
+        0,
+        INT_MAX / 2,
+        PGC_USERSET,
+        0,
+        NULL, NULL, NULL
+    );
+    DefineCustomBoolVariable(
+        "mipt_asj.enable_join_scan",
+        "Enables the planner's use of the custom join node for joins by cmp.",
+        "The node indexes tokens of the inner relation and probes the index with outer rows.",
+        &mipt_asj_enable_join_scan,
+        true,
+        PGC_USERSET,
+        0,
+        NULL, NULL, NULL
+    );
+    DefineCustomBoolVariable(
+        "mipt_asj.track_timing",
+        "Collects timing statistics of the extension functions.",
+        "Time is shown by mipt_asj.stat. Every call of cmp reads the clock twice then.",
+        &mipt_asj_track_timing,
+        false,
+        PGC_SUSET,
+        0,
+        NULL, NULL, NULL
+    );
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("mipt_asj");
+#else
+    EmitWarningsOnPlaceholders("mipt_asj");
+#endif
+
+    join_scan_init();
 
+    if (process_shared_preload_libraries_in_progress) {
+        ruleset_cache_init();
+        stat_init();
+    }
+}
@@ -12,4 +12,7 @@
 #include "asj/calc_dict.h"
 #include "asj/calc_pairs.h"
 #include "asj/cmp.h"
+#include "asj/join_scan.h"
+#include "lib/ruleset_cache.h"
+#include "lib/stat.h"
 
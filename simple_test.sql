@@ -39,6 +39,31 @@ INSERT INTO rules(f, a) (
 );
 SELECT * FROM rules;
 
+DROP TABLE IF EXISTS rules_sources;
+CREATE TABLE rules_sources(f VARCHAR, a VARCHAR, source TEXT);
+
+-- Test: queries and cursors give the same dictionary as tables
+INSERT INTO rules_sources(f, a, source) (
+	SELECT f, a, 'query' FROM mipt_asj.calc_dict(
+		'SELECT f FROM ddata',
+		'SELECT a FROM ddata'
+	)
+);
+
+BEGIN;
+DECLARE ddata_f CURSOR FOR SELECT f FROM ddata;
+DECLARE ddata_a CURSOR FOR SELECT a FROM ddata;
+INSERT INTO rules_sources(f, a, source) (
+	SELECT f, a, 'cursor' FROM mipt_asj.calc_dict('ddata_f'::refcursor, 'ddata_a'::refcursor)
+);
+COMMIT;
+
+-- All return no rows
+SELECT f, a FROM rules_sources WHERE source = 'query' EXCEPT ALL SELECT f, a FROM rules;
+SELECT f, a FROM rules EXCEPT ALL SELECT f, a FROM rules_sources WHERE source = 'query';
+SELECT f, a FROM rules_sources WHERE source = 'cursor' EXCEPT ALL SELECT f, a FROM rules;
+SELECT f, a FROM rules EXCEPT ALL SELECT f, a FROM rules_sources WHERE source = 'cursor';
+
 --
 --
 -- calc_pairs
@@ -72,6 +97,248 @@ INSERT INTO to_join(s1, s2) (
 );
 SELECT * FROM to_join;
 
+-- Identical short strings are joined, whatever filters are on
+DROP TABLE IF EXISTS pdata_short;
+CREATE TABLE pdata_short(c1 VARCHAR, c2 VARCHAR);
+
+INSERT INTO pdata_short(c1, c2) VALUES
+('a b', 'a b');
+
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_short'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_short'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+);
+
+SET mipt_asj.suffix_filter = on;
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_short'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_short'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+);
+RESET mipt_asj.suffix_filter;
+
+-- Strings sharing a single token are a candidate pair, which positional filter drops: the result is still empty
+DROP TABLE IF EXISTS pdata_pos;
+CREATE TABLE pdata_pos(c1 VARCHAR, c2 VARCHAR);
+
+INSERT INTO pdata_pos(c1, c2) VALUES
+('zz a', 'bb zz');
+
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_pos'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata_pos'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.5
+);
+
+SELECT t1.c1, t2.c2
+FROM pdata_pos AS t1 INNER JOIN pdata_pos AS t2 ON mipt_asj.cmp(
+	t1.c1,
+	t2.c2,
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.5
+) = TRUE;
+
+-- Data: rows with keys; some strings repeat
+DROP TABLE IF EXISTS sdata;
+CREATE TABLE sdata(k INTEGER, s VARCHAR);
+
+INSERT INTO sdata(k, s) VALUES
+(1, 'mipt mosmetro'),
+(2, 'moscow metro hall'),
+(3, 'moscow institute of physics and technology moscow metro'),
+(4, 'mm hall'),
+(5, 'moscow metro'),
+(6, 'mosmetro'),
+(7, 'a b'),
+(8, 'a b');
+
+DROP TABLE IF EXISTS spairs;
+CREATE TABLE spairs(s1 VARCHAR, s2 VARCHAR);
+
+INSERT INTO spairs(s1, s2) (
+	SELECT * FROM mipt_asj.calc_pairs(
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7
+	)
+);
+SELECT * FROM spairs;
+
+DROP TABLE IF EXISTS spairs_unordered;
+CREATE TABLE spairs_unordered(s1 VARCHAR, s2 VARCHAR);
+
+-- Test: unordered self-join returns every pair of different strings once
+INSERT INTO spairs_unordered(s1, s2) (
+	SELECT * FROM mipt_asj.calc_pairs(
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7, 1, 0, true
+	)
+);
+SELECT * FROM spairs_unordered;
+
+-- All return no rows
+SELECT * FROM spairs_unordered WHERE s1 = s2;
+
+SELECT LEAST(s1, s2), GREATEST(s1, s2)
+FROM spairs_unordered
+GROUP BY LEAST(s1, s2), GREATEST(s1, s2)
+HAVING count(*) > 1;
+
+SELECT s1, s2 FROM spairs WHERE s1 <> s2
+EXCEPT ALL
+(SELECT s1, s2 FROM spairs_unordered UNION ALL SELECT s2, s1 FROM spairs_unordered);
+
+(SELECT s1, s2 FROM spairs_unordered UNION ALL SELECT s2, s1 FROM spairs_unordered)
+EXCEPT ALL
+SELECT s1, s2 FROM spairs WHERE s1 <> s2;
+
+-- Test: partitions are disjoint, and together are the result without partitioning. Both return no rows
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7, 3, 0
+)
+UNION ALL
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7, 3, 1
+)
+UNION ALL
+SELECT * FROM mipt_asj.calc_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7, 3, 2
+)
+EXCEPT ALL
+SELECT s1, s2 FROM spairs;
+
+SELECT s1, s2 FROM spairs
+EXCEPT ALL
+(
+	SELECT * FROM mipt_asj.calc_pairs(
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7, 3, 0
+	)
+	UNION ALL
+	SELECT * FROM mipt_asj.calc_pairs(
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7, 3, 1
+	)
+	UNION ALL
+	SELECT * FROM mipt_asj.calc_pairs(
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7, 3, 2
+	)
+);
+
+-- Test: when every row is sampled, the estimate of pairs is the number of pairs calc_pairs returns ('equal' is true)
+SELECT e.rows1, e.rows2, e.sampled1, e.sampled2, e.candidates, e.pairs, e.pairs = (SELECT count(*) FROM to_join) AS equal
+FROM mipt_asj.estimate_pairs(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7, 1.0
+) AS e;
+
+DROP TABLE IF EXISTS to_join_sources;
+CREATE TABLE to_join_sources(s1 VARCHAR, s2 VARCHAR, source TEXT);
+
+-- Test: queries and cursors give the same pairs as tables
+INSERT INTO to_join_sources(s1, s2, source) (
+	SELECT s1, s2, 'query' FROM mipt_asj.calc_pairs(
+		'SELECT c1 FROM pdata',
+		'SELECT c2 FROM pdata',
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7
+	)
+);
+
+BEGIN;
+DECLARE pdata_c1 CURSOR FOR SELECT c1 FROM pdata;
+DECLARE pdata_c2 CURSOR FOR SELECT c2 FROM pdata;
+INSERT INTO to_join_sources(s1, s2, source) (
+	SELECT s1, s2, 'cursor' FROM mipt_asj.calc_pairs(
+		'pdata_c1'::refcursor,
+		'pdata_c2'::refcursor,
+		(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+		0.7
+	)
+);
+COMMIT;
+
+-- All return no rows
+SELECT s1, s2 FROM to_join_sources WHERE source = 'query' EXCEPT ALL SELECT s1, s2 FROM to_join;
+SELECT s1, s2 FROM to_join EXCEPT ALL SELECT s1, s2 FROM to_join_sources WHERE source = 'query';
+SELECT s1, s2 FROM to_join_sources WHERE source = 'cursor' EXCEPT ALL SELECT s1, s2 FROM to_join;
+SELECT s1, s2 FROM to_join EXCEPT ALL SELECT s1, s2 FROM to_join_sources WHERE source = 'cursor';
+
+-- Test: pairs of rows joined back to the tables are the pairs of strings. All return no rows
+SELECT t1.c1, t2.c2
+FROM mipt_asj.calc_pairs_tid(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+) AS p
+INNER JOIN pdata AS t1 ON t1.ctid = p.ctid1
+INNER JOIN pdata AS t2 ON t2.ctid = p.ctid2
+EXCEPT ALL
+SELECT s1, s2 FROM to_join;
+
+SELECT s1, s2 FROM to_join
+EXCEPT ALL
+SELECT t1.c1, t2.c2
+FROM mipt_asj.calc_pairs_tid(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c1',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'pdata'), 'c2',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+) AS p
+INNER JOIN pdata AS t1 ON t1.ctid = p.ctid1
+INNER JOIN pdata AS t2 ON t2.ctid = p.ctid2;
+
+-- Rows of 'sdata' with equal strings make the same pair of strings: DISTINCT
+SELECT DISTINCT t1.s, t2.s
+FROM mipt_asj.calc_pairs_key(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's', 'k',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's', 'k',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+) AS p
+INNER JOIN sdata AS t1 ON t1.k = p.key1
+INNER JOIN sdata AS t2 ON t2.k = p.key2
+EXCEPT ALL
+SELECT s1, s2 FROM spairs;
+
+SELECT s1, s2 FROM spairs
+EXCEPT ALL
+SELECT DISTINCT t1.s, t2.s
+FROM mipt_asj.calc_pairs_key(
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's', 'k',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'sdata'), 's', 'k',
+	(SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a',
+	0.7
+) AS p
+INNER JOIN sdata AS t1 ON t1.k = p.key1
+INNER JOIN sdata AS t2 ON t2.k = p.key2;
+
 --
 --
 -- calc_pairs
@@ -86,3 +353,118 @@ FROM to_join AS t1 INNER JOIN to_join AS t2 ON mipt_asj.cmp(
 	0.7
 ) = TRUE;
 
+
+--
+--
+-- canonicalize
+--
+
+-- Data
+DROP TABLE IF EXISTS crules;
+CREATE TABLE crules(f VARCHAR, a VARCHAR);
+
+INSERT INTO crules(f, a) VALUES
+('moscow metro', 'mm'),
+('moscow metro', 'mosmetro'),
+('moscow institute of physics and technology', 'mipt');
+
+-- Test: 'canonical' equals 'expected' in every row
+SELECT t.s, mipt_asj.canonicalize(
+	t.s,
+	(SELECT mipt_asj.ruleset((SELECT oid FROM pg_catalog.pg_class WHERE relname = 'crules'), 'f', 'a'))
+) AS canonical, t.expected
+FROM (VALUES
+	('mm hall', 'moscow metro hall'),
+	('hall mosmetro', 'moscow metro hall'),
+	('moscow metro hall', 'moscow metro hall'),
+	('mipt', 'technology institute physics moscow and of')
+) AS t(s, expected);
+
+
+--
+--
+-- Join node
+--
+
+-- Data
+DROP TABLE IF EXISTS jdata;
+CREATE TABLE jdata(s VARCHAR);
+
+INSERT INTO jdata(s) (
+	SELECT c1 FROM pdata
+	UNION ALL
+	SELECT c2 FROM pdata
+	UNION ALL
+	SELECT c1 FROM pdata_short
+	UNION ALL
+	SELECT f FROM rules
+	UNION ALL
+	SELECT a FROM rules
+);
+
+DROP TABLE IF EXISTS jpairs;
+CREATE TABLE jpairs(e REAL, s1 VARCHAR, s2 VARCHAR, node BOOLEAN);
+
+-- Test: the join node returns the same pairs as a nested loop, whatever the exactness is.
+-- The plan is generic, so the node does not know the exactness until it is executed
+SET enable_nestloop = off;
+SET plan_cache_mode = force_generic_plan;
+
+PREPARE jpairs_insert(REAL, BOOLEAN) AS
+INSERT INTO jpairs(e, s1, s2, node)
+SELECT $1, t1.s, t2.s, $2
+FROM jdata AS t1 INNER JOIN jdata AS t2 ON mipt_asj.cmp(
+	t1.s,
+	t2.s,
+	(SELECT mipt_asj.ruleset((SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a')),
+	$1
+);
+EXPLAIN (COSTS OFF) EXECUTE jpairs_insert(0.7, TRUE);
+EXECUTE jpairs_insert(0.7, TRUE);
+EXECUTE jpairs_insert(0.3, TRUE);
+EXECUTE jpairs_insert(0.0, TRUE);
+EXECUTE jpairs_insert(-1.0, TRUE);
+DEALLOCATE jpairs_insert;
+
+SET mipt_asj.enable_join_scan = off;
+RESET enable_nestloop;
+
+PREPARE jpairs_insert(REAL, BOOLEAN) AS
+INSERT INTO jpairs(e, s1, s2, node)
+SELECT $1, t1.s, t2.s, $2
+FROM jdata AS t1 INNER JOIN jdata AS t2 ON mipt_asj.cmp(
+	t1.s,
+	t2.s,
+	(SELECT mipt_asj.ruleset((SELECT oid FROM pg_catalog.pg_class WHERE relname = 'rules'), 'f', 'a')),
+	$1
+);
+EXPLAIN (COSTS OFF) EXECUTE jpairs_insert(0.7, FALSE);
+EXECUTE jpairs_insert(0.7, FALSE);
+EXECUTE jpairs_insert(0.3, FALSE);
+EXECUTE jpairs_insert(0.0, FALSE);
+EXECUTE jpairs_insert(-1.0, FALSE);
+DEALLOCATE jpairs_insert;
+
+RESET mipt_asj.enable_join_scan;
+RESET plan_cache_mode;
+
+-- Both return no rows
+SELECT e, s1, s2 FROM jpairs WHERE node
+EXCEPT ALL
+SELECT e, s1, s2 FROM jpairs WHERE NOT node;
+
+SELECT e, s1, s2 FROM jpairs WHERE NOT node
+EXCEPT ALL
+SELECT e, s1, s2 FROM jpairs WHERE node;
+
+-- Test: statistics of the calls above ('cmp' and 'PkduckJoin' have calls, when the extension
+-- is loaded by 'shared_preload_libraries'); after reset, the second query returns no rows
+SELECT function, calls, rows, candidates, verified, rule_evaluations
+FROM mipt_asj.stat
+WHERE function IN ('cmp', 'PkduckJoin');
+
+SELECT mipt_asj.stat_reset();
+
+SELECT function, calls, rows, candidates, verified, rule_evaluations
+FROM mipt_asj.stat
+WHERE calls > 0;